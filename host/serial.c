@@ -0,0 +1,103 @@
+/*
+ * Serial port and pseudo-terminal set up for transfers on POSIX hosts.
+ */
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+#include "serial.h"
+
+static speed_t speed(unsigned long baud)
+{
+    switch (baud) {
+    case 1200: return B1200;
+    case 2400: return B2400;
+    case 4800: return B4800;
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+#ifdef B460800
+    case 460800: return B460800;
+#endif
+#ifdef B921600
+    case 921600: return B921600;
+#endif
+    default: return B0;
+    }
+}
+
+int xmodemSerialRaw(int fd, unsigned long baud)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) < 0) {
+        return -1;
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+    tio.c_iflag &= ~(IXON | IXOFF | IXANY);
+    /* with O_NONBLOCK, a read with nothing to return fails with EAGAIN rather than returning 0 */
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    if (baud) {
+        speed_t s = speed(baud);
+        if (s == B0) {
+            errno = EINVAL;
+            return -1;
+        }
+        cfsetispeed(&tio, s);
+        cfsetospeed(&tio, s);
+    }
+    return tcsetattr(fd, TCSANOW, &tio);
+}
+
+int xmodemSerialOpen(char const *path, unsigned long baud)
+{
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+    if (xmodemSerialRaw(fd, baud) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+int xmodemSerialPty(int fds[2])
+{
+    int master, slave, err;
+    char const *name;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (master < 0) {
+        return -1;
+    }
+    if (grantpt(master) == 0 && unlockpt(master) == 0 && (name = ptsname(master)) != NULL &&
+        (slave = open(name, O_RDWR | O_NOCTTY | O_NONBLOCK)) >= 0) {
+        /* the line discipline is on the slave side, so this makes the pair transparent in both directions */
+        if (xmodemSerialRaw(slave, 0) == 0) {
+            fds[0] = master;
+            fds[1] = slave;
+            return 0;
+        }
+        err = errno;
+        close(slave);
+        errno = err;
+    }
+    err = errno;
+    close(master);
+    errno = err;
+    return -1;
+}
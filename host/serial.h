@@ -0,0 +1,39 @@
+//
+// Serial port and pseudo-terminal set up for transfers on POSIX hosts
+//
+
+#ifndef XMODEM_SERIAL_H
+#define XMODEM_SERIAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Open a serial port for transfers: non-blocking, raw, 8 data bits, no parity and no flow control
+ * @param path The device, such as /dev/ttyUSB0
+ * @param baud The line rate, or 0 to leave it as it is
+ * @return The file descriptor, or -1 with errno set
+ */
+int xmodemSerialOpen(char const *path, unsigned long baud);
+
+/**
+ * Put an open terminal into raw mode, as xmodemSerialOpen does
+ * @param fd The terminal
+ * @param baud The line rate, or 0 to leave it as it is
+ * @return 0, or -1 with errno set, EINVAL for a rate the host does not support
+ */
+int xmodemSerialRaw(int fd, unsigned long baud);
+
+/**
+ * Open a pseudo-terminal pair, both ends non-blocking and raw, so that transfers can be tried without hardware
+ * @param fds Set to the master and slave file descriptors
+ * @return 0, or -1 with errno set
+ */
+int xmodemSerialPty(int fds[2]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //XMODEM_SERIAL_H
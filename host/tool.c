@@ -0,0 +1,284 @@
+/*
+ * Option parsing, serial I/O and reporting shared by the xmodem-send and
+ * xmodem-recv tools.
+ *
+ * The tools run the blocking transfer functions over a non-blocking
+ * descriptor: input waits in poll for up to the engine's timeout, and
+ * output waits for room whenever the port is full.
+ */
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "serial.h"
+#include "tool.h"
+
+#define TOOL_HUNG_UP_WAIT 10 /* ms to wait before reading a pseudo-terminal whose slave is closed again */
+#define TOOL_PTY_LINGER 2000 /* ms to wait for the peer to close the slave of a pseudo-terminal */
+
+static unsigned char windowBuffer[127 * (XMODEM_MAX_BLOCK_SIZE + 5)];
+static unsigned char prepareBuffer[XMODEM_MAX_BLOCK_SIZE + 5];
+static lzEncoder encoder;
+static lzDecoder decoder;
+
+static void usage(char const *action)
+{
+    fprintf(stderr,
+            "usage: xmodem-%s [options] (DEVICE | -p) FILE\n"
+            "  -p        open a pseudo-terminal pair, print the slave name and transfer over the master\n"
+            "  -b BAUD   set the line rate\n"
+            "  -q        end a bad packet after a few byte times of silence at the -b rate, for a direct UART\n"
+            "            line; not for USB adapters, which deliver bytes in bursts\n"
+            "  -k        send 1024 byte packets\n"
+            "  -a        fall back to 128 byte packets on a poor line\n"
+            "  -A        scale the timeouts to the measured round trip time\n"
+            "  -w N      stream up to N packets ahead of their acknowledgement, up to 127\n"
+            "  -z        compress the data, when both ends use this library\n"
+            "  -s MS     time to wait for each synchronisation character\n"
+            "  -n N      number of synchronisation attempts\n"
+            "  -t MS     time to wait for the response to a packet\n"
+            "  -l BYTES  expected length, for the receiver to preallocate\n"
+            "  -v        print the statistics of the transfer\n",
+            action);
+    exit(2);
+}
+
+static long number(char const *arg, long min, long max, char const *action)
+{
+    char *end;
+    long n = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || n < min || n > max) {
+        usage(action);
+    }
+    return n;
+}
+
+void toolParse(toolOptions *o, int argc, char **argv, char const *action)
+{
+    int c;
+
+    memset(o, 0, sizeof(*o));
+    o->blockSize = 128;
+    o->length = -1;
+    while ((c = getopt(argc, argv, "pb:qkaAw:zs:n:t:l:v")) != -1) {
+        switch (c) {
+        case 'p': o->pty = 1; break;
+        case 'b': o->baud = (unsigned long)number(optarg, 1, 4000000, action); break;
+        case 'q': o->quietGap = 1; break;
+        case 'k': o->blockSize = 1024; break;
+        case 'a': o->adaptiveBlockSize = 1; break;
+        case 'A': o->adaptiveTimeouts = 1; break;
+        case 'w': o->window = (int)number(optarg, 1, 127, action); break;
+        case 'z': o->compress = 1; break;
+        case 's': o->syncTimeout = (unsigned short)number(optarg, 1, 65535, action); break;
+        case 'n': o->syncRetries = (int)number(optarg, 1, 10000, action); break;
+        case 't': o->ackTimeout = (unsigned short)number(optarg, 1, 65535, action); break;
+        case 'l': o->length = number(optarg, 0, 0x7fffffffL, action); break;
+        case 'v': o->verbose = 1; break;
+        default: usage(action);
+        }
+    }
+    if (argc - optind != (o->pty ? 1 : 2) || (o->quietGap && !o->baud)) {
+        usage(action);
+    }
+    if (!o->pty) {
+        o->device = argv[optind++];
+    }
+    o->file = argv[optind];
+    o->transmit = strcmp(action, "send") == 0;
+}
+
+void toolOpen(toolOptions const *o, toolLink *link)
+{
+    int fds[2];
+
+    link->slave = -1;
+    link->failed = 0;
+    if (o->pty) {
+        if (xmodemSerialPty(fds) < 0) {
+            perror("pseudo-terminal");
+            exit(1);
+        }
+        link->fd = fds[0];
+        link->slave = fds[1];
+        printf("%s\n", ptsname(fds[0]));
+        fflush(stdout);
+    } else if ((link->fd = xmodemSerialOpen(o->device, o->baud)) < 0) {
+        perror(o->device);
+        exit(1);
+    }
+}
+
+void toolClose(toolLink *link)
+{
+    struct pollfd pfd;
+    unsigned char discard[64];
+
+    /* let the last acknowledgement or EOT drain before the line goes */
+    tcdrain(link->fd);
+    if (link->slave >= 0) {
+        /* closing a master hangs up the slave, flushing what the peer has still to read */
+        close(link->slave);
+        pfd.fd = link->fd;
+        pfd.events = POLLIN;
+        while (poll(&pfd, 1, TOOL_PTY_LINGER) > 0 && !(pfd.revents & POLLHUP)) {
+            if (read(link->fd, discard, sizeof(discard)) <= 0) {
+                break;
+            }
+        }
+    }
+    close(link->fd);
+}
+
+static unsigned long toolClock(void *user)
+{
+    struct timespec ts;
+    (void)user;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000UL + (unsigned long)(ts.tv_nsec / 1000000L);
+}
+
+static int toolInBlock(void *user, unsigned char *buf, int len, unsigned short timeout)
+{
+    toolLink *link = user;
+    struct pollfd pfd;
+    unsigned long end = toolClock(NULL) + timeout;
+    long remaining;
+    ssize_t n;
+
+    if (link->failed) {
+        return xmodemErrorLinkFailed;
+    }
+    pfd.fd = link->fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        n = read(link->fd, buf, len);
+        if (n > 0) {
+            return (int)n;
+        }
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR && (errno != EIO || link->slave < 0))) {
+            /* hung up or failed: a port with nothing to read fails with EAGAIN rather than returning 0, and only a
+               pseudo-terminal master reads EIO and recovers from it */
+            link->failed = 1;
+            return xmodemErrorLinkFailed;
+        }
+        remaining = (long)(end - toolClock(NULL));
+        if (remaining <= 0) {
+            return 0;
+        }
+        if (n < 0 && errno == EIO) {
+            /* a pseudo-terminal master reads as hung up until the peer opens the slave */
+            struct timespec ts = { 0, TOOL_HUNG_UP_WAIT * 1000000L };
+            nanosleep(&ts, NULL);
+        } else {
+            poll(&pfd, 1, (int)remaining);
+        }
+    }
+}
+
+static void toolOutBlock(void *user, unsigned char const *buf, int len)
+{
+    toolLink *link = user;
+    struct pollfd pfd;
+    ssize_t n;
+
+    pfd.fd = link->fd;
+    pfd.events = POLLOUT;
+    while (len > 0) {
+        n = write(link->fd, buf, len);
+        if (n > 0) {
+            buf += n;
+            len -= (int)n;
+        } else if (n < 0 && errno == EAGAIN) {
+            poll(&pfd, 1, -1);
+        } else if (n < 0 && errno != EINTR) {
+            /* a tty fails a write only once it has hung up, so the transfer cannot go on */
+            link->failed = 1;
+            return;
+        }
+    }
+}
+
+void toolSession(toolOptions const *o, xmodemSession *s, toolLink *user)
+{
+    xmodemSessionInit(s);
+    s->inBlock = toolInBlock;
+    s->outBlock = toolOutBlock;
+    s->clock = toolClock;
+    s->user = user;
+    if (o->quietGap) {
+        s->baud = o->baud;
+    }
+    s->blockSize = o->blockSize;
+    s->adaptiveBlockSize = o->adaptiveBlockSize;
+    s->adaptiveTimeouts = o->adaptiveTimeouts;
+    if (o->syncTimeout) {
+        s->syncTimeout = o->syncTimeout;
+    }
+    if (o->syncRetries) {
+        s->syncRetries = o->syncRetries;
+    }
+    if (o->ackTimeout) {
+        s->ackTimeout = o->ackTimeout;
+    }
+    if (o->window > 1) {
+        s->window = o->window;
+        if (o->transmit) {
+            s->windowBuffer = windowBuffer;
+        }
+    }
+    if (o->transmit) {
+        s->prepareBuffer = prepareBuffer;
+    }
+    if (o->compress) {
+        if (o->transmit) {
+            s->encoder = &encoder;
+        } else {
+            s->decoder = &decoder;
+        }
+    }
+}
+
+static char const *describe(int result)
+{
+    switch (result) {
+    case xmodemErrorCancelledByRemote: return "cancelled by the other end";
+    case xmodemErrorNoSync: return "no answer from the other end";
+    case xmodemErrorTooManyRetries: return "too many retries";
+    case xmodemErrorTransmitError: return "transmit error";
+    case xmodemErrorUnexpectedResponse: return "unexpected response";
+    case xmodemErrorBufferFull: return "could not store the data";
+    case xmodemErrorFileRefused: return "file refused";
+    case xmodemErrorLinkFailed: return "link failed";
+    default: return "failed";
+    }
+}
+
+int toolReport(toolOptions const *o, char const *action, int result, xmodemStats const *st)
+{
+    if (result < 0) {
+        fprintf(stderr, "xmodem-%s: %s: %s\n", action, o->file, describe(result));
+    } else {
+        fprintf(stderr, "xmodem-%s: %s: %d bytes in %lu ms, %ld bytes/s\n", action, o->file, result, st->elapsed,
+                st->elapsed ? (long)((double)result * 1000 / st->elapsed) : 0L);
+    }
+    if (o->verbose) {
+        fprintf(stderr,
+                "  link: %ld bytes sent, %ld received, %ld packets with %s\n"
+                "  data: %ld bytes on the line, %ld bytes/s\n"
+                "  errors: %d NAKs, %d timeouts, %d duplicates, %ld bytes resent\n"
+                "  time: %lu ms sending, %lu ms waiting, %lu ms round trip\n",
+                st->bytesSent, st->bytesReceived, st->packets, st->crc ? "CRC" : "checksum", st->dataBytes,
+                st->goodput, st->naks, st->timeouts, st->duplicates, st->retransmittedBytes, st->transmitTime,
+                st->waitTime, st->rtt);
+    }
+    return result < 0 ? 1 : 0;
+}
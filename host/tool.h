@@ -0,0 +1,73 @@
+//
+// Option parsing, serial I/O and reporting shared by the xmodem-send and xmodem-recv tools
+//
+
+#ifndef XMODEM_TOOL_H
+#define XMODEM_TOOL_H
+
+#include "xmodem.h"
+
+/**
+ * The options common to both tools
+ */
+typedef struct toolOptions {
+    char const *device;
+    char const *file;
+    /** Open a pseudo-terminal pair and transfer over its master, printing the name of the slave */
+    int pty;
+    unsigned long baud;
+    /** End bad packets after a few byte times of silence at baud, rather than the byte timeout */
+    int quietGap;
+    int blockSize;
+    int adaptiveBlockSize;
+    int adaptiveTimeouts;
+    int window;
+    int compress;
+    unsigned short syncTimeout, ackTimeout;
+    int syncRetries;
+    /** The expected length, for the receiver to preallocate, or -1 */
+    long length;
+    int verbose;
+    /** Set for xmodem-send */
+    int transmit;
+} toolOptions;
+
+/**
+ * A port, at the start of the session user pointer of each tool
+ */
+typedef struct toolLink {
+    int fd;
+    /** The pseudo-terminal slave, held open so that the master reads rather than failing until the peer opens it */
+    int slave;
+    /** Set once a write has failed, such as after a hang-up, for input to end the transfer */
+    int failed;
+} toolLink;
+
+/**
+ * Parse the command line, printing the usage and exiting with status 2 if it is wrong
+ */
+void toolParse(toolOptions *options, int argc, char **argv, char const *action);
+
+/**
+ * Open the port, exiting with status 1 on failure
+ */
+void toolOpen(toolOptions const *options, toolLink *link);
+
+/**
+ * Set up a session from the options, with I/O functions that read and write the link, which must be at the start of
+ * user
+ */
+void toolSession(toolOptions const *options, xmodemSession *session, toolLink *user);
+
+/**
+ * Close the port
+ */
+void toolClose(toolLink *link);
+
+/**
+ * Print the outcome, and with verbose the statistics, to stderr
+ * @return The exit status
+ */
+int toolReport(toolOptions const *options, char const *action, int result, xmodemStats const *stats);
+
+#endif //XMODEM_TOOL_H
@@ -0,0 +1,233 @@
+//
+// An epoll event loop for the coroutine transfers of xmodemAsync.hpp. Linux only.
+//
+
+#ifndef XMODEM_EVENT_LOOP_HPP
+#define XMODEM_EVENT_LOOP_HPP
+
+#include <errno.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <coroutine>
+#include <map>
+#include "xmodemAsync.hpp"
+
+/*
+ * A loop runs the transfers on its ports in the one thread that calls run(), waiting on all of them with epoll and
+ * on the earliest of their timeouts. For a pool of threads, give each thread a loop of its own and share the ports
+ * out between them, as xmodemServer does with its workers; a port and its transfer stay with one loop.
+ *
+ *     xmodem::EventLoop loop;
+ *     xmodem::Port port(loop, fd);
+ *     auto task = xmodem::transmit(port, session, getBuffer);
+ *     task.start();
+ *     loop.run();
+ *     int result = task.result();
+ */
+
+namespace xmodem {
+
+class Port;
+
+class EventLoop {
+public:
+    EventLoop() : epoll(epoll_create1(EPOLL_CLOEXEC)) {}
+    ~EventLoop() {
+        if (epoll >= 0) close(epoll);
+    }
+    EventLoop(EventLoop const &) = delete;
+    EventLoop &operator=(EventLoop const &) = delete;
+
+    /**
+     * Resume the transfers waiting on the ports of this loop as their input, room to write or timeouts arrive
+     * @return 0 once nothing is waiting, or -1 with errno set if epoll fails
+     */
+    int run();
+
+    /** @return The time in ms */
+    static unsigned long now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (unsigned long)ts.tv_sec * 1000UL + (unsigned long)(ts.tv_nsec / 1000000L);
+    }
+
+private:
+    friend class Port;
+
+    int epoll;
+    /* the ports waiting with a timeout, by deadline */
+    std::multimap<unsigned long, Port *> timers;
+    int waiting = 0;
+};
+
+/**
+ * A stream over a non-blocking descriptor that epoll can wait on, such as a serial port from xmodemSerialOpen, a pty
+ * or a socket. One coroutine at a time may wait on it.
+ */
+class Port {
+public:
+    /**
+     * @param loop The loop to wait in, which must outlive the port
+     * @param fd The descriptor, which the port does not close
+     */
+    Port(EventLoop &loop, int fd) : loop(loop), fd(fd) {
+        struct epoll_event ev = {};
+        /* edge triggered, as the descriptor is only waited on once a read or write would block */
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = this;
+        epoll_ctl(loop.epoll, EPOLL_CTL_ADD, fd, &ev);
+    }
+    ~Port() {
+        epoll_ctl(loop.epoll, EPOLL_CTL_DEL, fd, nullptr);
+    }
+    Port(Port const &) = delete;
+    Port &operator=(Port const &) = delete;
+
+    struct ReadAwaiter {
+        Port &port;
+        unsigned char *buf;
+        int len;
+        long timeout;
+        int n;
+
+        bool await_ready() {
+            n = port.tryRead(buf, len);
+            return n > 0 || timeout == 0;
+        }
+        void await_suspend(std::coroutine_handle<> h) {
+            port.wait(h, EPOLLIN, timeout);
+        }
+        int await_resume() {
+            return n > 0 ? n : port.tryRead(buf, len);
+        }
+    };
+
+    struct WriteAwaiter {
+        Port &port;
+        unsigned char const *buf;
+        int len;
+        int n;
+
+        bool await_ready() {
+            n = port.tryWrite(buf, len);
+            return n != -EAGAIN;
+        }
+        void await_suspend(std::coroutine_handle<> h) {
+            port.wait(h, EPOLLOUT, -1);
+        }
+        int await_resume() {
+            if (n == -EAGAIN) {
+                n = port.tryWrite(buf, len);
+            }
+            return n == -EAGAIN ? 0 : n;
+        }
+    };
+
+    /** Read what has arrived, up to len bytes, waiting up to timeout ms for some if there is none */
+    ReadAwaiter read(unsigned char *buf, int len, long timeout) {
+        return ReadAwaiter{ *this, buf, len, timeout, 0 };
+    }
+
+    /** Write up to len bytes, waiting for room if there is none */
+    WriteAwaiter write(unsigned char const *buf, int len) {
+        return WriteAwaiter{ *this, buf, len, 0 };
+    }
+
+    unsigned long now() const {
+        return EventLoop::now();
+    }
+
+private:
+    friend class EventLoop;
+
+    /* bytes read, or 0 for none now, at the end of the stream or on failure, which are left to the timeout */
+    int tryRead(unsigned char *buf, int len) {
+        ssize_t n;
+        do {
+            n = ::read(fd, buf, len);
+        } while (n < 0 && errno == EINTR);
+        return n > 0 ? (int)n : 0;
+    }
+
+    /* bytes written, -EAGAIN if there is no room, or -1 on failure */
+    int tryWrite(unsigned char const *buf, int len) {
+        ssize_t n;
+        do {
+            /* a socket whose far end has gone fails the write rather than raising SIGPIPE */
+            n = socket ? ::send(fd, buf, len, MSG_NOSIGNAL) : ::write(fd, buf, len);
+            if (n < 0 && errno == ENOTSOCK) {
+                socket = false;
+                n = ::write(fd, buf, len);
+            }
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? -EAGAIN : -1;
+        return (int)n;
+    }
+
+    void wait(std::coroutine_handle<> h, unsigned int events, long timeout) {
+        waiter = h;
+        wanted = events;
+        if (timeout >= 0) {
+            timer = loop.timers.emplace(EventLoop::now() + (unsigned long)timeout, this);
+            timed = true;
+        }
+        ++loop.waiting;
+    }
+
+    void resume() {
+        std::coroutine_handle<> h = waiter;
+        if (timed) {
+            loop.timers.erase(timer);
+            timed = false;
+        }
+        waiter = nullptr;
+        --loop.waiting;
+        h.resume();
+    }
+
+    /* a hang up or error ends a wait for either direction, and the read or write then fails */
+    void ready(unsigned int events) {
+        if (waiter && (events & (wanted | EPOLLHUP | EPOLLERR))) {
+            resume();
+        }
+    }
+
+    EventLoop &loop;
+    int fd;
+    std::coroutine_handle<> waiter;
+    unsigned int wanted = 0;
+    std::multimap<unsigned long, Port *>::iterator timer;
+    bool timed = false;
+    bool socket = true;
+};
+
+inline int EventLoop::run() {
+    struct epoll_event events[32];
+
+    while (waiting > 0) {
+        int timeout = -1;
+        if (!timers.empty()) {
+            long t = (long)(timers.begin()->first - now());
+            timeout = t <= 0 ? 0 : (t > INT_MAX ? INT_MAX : (int)t);
+        }
+        int n = epoll_wait(epoll, events, 32, timeout);
+        if (n < 0 && errno != EINTR) {
+            return -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            static_cast<Port *>(events[i].data.ptr)->ready(events[i].events);
+        }
+        unsigned long t = now();
+        while (!timers.empty() && (long)(timers.begin()->first - t) <= 0) {
+            timers.begin()->second->resume();
+        }
+    }
+    return 0;
+}
+
+} // namespace xmodem
+
+#endif //XMODEM_EVENT_LOOP_HPP
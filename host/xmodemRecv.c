@@ -0,0 +1,120 @@
+/*
+ * xmodem-recv: receive a file over a serial port or pseudo-terminal.
+ *
+ * The receiver stores packets straight into a large batch buffer, which is
+ * written out in one call each time it fills, so the file sees a few large
+ * writes rather than one per packet. The file is preallocated ahead of the
+ * writes to keep it in few extents, and cut to the received length at the
+ * end, which also drops the padding of the last packet.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "tool.h"
+
+#define XMODEM_RECV_BATCH (1L << 20)      /* bytes received before each write */
+#define XMODEM_RECV_PREALLOCATE (16L << 20) /* bytes preallocated at a time when the length is not known */
+
+struct receiveFile {
+    toolLink link;
+    int fd;
+    unsigned char *batch;
+    /* nonzero once the batch has been handed to the receiver */
+    int filling;
+    long written, allocated;
+    int error;
+};
+
+static int writeAll(int fd, unsigned char const *buf, long len)
+{
+    ssize_t n;
+    while (len > 0) {
+        n = write(fd, buf, (size_t)len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= (long)n;
+    }
+    return 0;
+}
+
+static void preallocate(struct receiveFile *f, long upTo)
+{
+    if (upTo > f->allocated) {
+        /* only a hint: filesystems without it just allocate as the writes arrive */
+        fallocate(f->fd, FALLOC_FL_KEEP_SIZE, f->allocated, upTo - f->allocated);
+        f->allocated = upTo;
+    }
+}
+
+static unsigned char *getReceiveBuffer(void *user, int *size)
+{
+    struct receiveFile *f = user;
+
+    if (f->filling) {
+        /* the receiver only asks again once the batch is full */
+        if (writeAll(f->fd, f->batch, XMODEM_RECV_BATCH) < 0) {
+            f->error = errno;
+            return NULL;
+        }
+        f->written += XMODEM_RECV_BATCH;
+        preallocate(f, f->written + XMODEM_RECV_PREALLOCATE);
+    }
+    f->filling = 1;
+    *size = (int)XMODEM_RECV_BATCH;
+    return f->batch;
+}
+
+int main(int argc, char **argv)
+{
+    toolOptions options;
+    xmodemSession session;
+    xmodemStats stats;
+    struct receiveFile f;
+    int result;
+
+    toolParse(&options, argc, argv, "recv");
+    f.fd = open(options.file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    f.batch = malloc(XMODEM_RECV_BATCH);
+    if (f.fd < 0 || f.batch == NULL) {
+        perror(options.file);
+        return 1;
+    }
+    f.filling = 0;
+    f.written = f.allocated = 0;
+    f.error = 0;
+    preallocate(&f, options.length >= 0 ? options.length : XMODEM_RECV_PREALLOCATE);
+
+    toolOpen(&options, &f.link);
+    toolSession(&options, &session, &f.link);
+    session.stats = &stats;
+    result = xmodemReceiveEx(&session, getReceiveBuffer);
+    toolClose(&f.link);
+
+    if (result >= 0 && result > f.written && writeAll(f.fd, f.batch, result - f.written) < 0) {
+        f.error = errno;
+    }
+    /* the batches written may run into the padding, and the preallocation beyond; a failure keeps what was written */
+    if (!f.error && ftruncate(f.fd, result >= 0 ? result : f.written) < 0) {
+        f.error = errno;
+    }
+    if (close(f.fd) < 0 && !f.error) {
+        f.error = errno;
+    }
+    free(f.batch);
+    if (f.error) {
+        errno = f.error;
+        perror(options.file);
+        return 1;
+    }
+    return toolReport(&options, "recv", result, &stats);
+}
@@ -0,0 +1,83 @@
+/*
+ * xmodem-send: transmit a file over a serial port or pseudo-terminal.
+ *
+ * The file is mapped, and the transmitter is handed the mapping in ranges
+ * as large as it can take, so it builds its packets straight from the page
+ * cache with no copy or read call per packet.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tool.h"
+
+struct sendFile {
+    toolLink link;
+    unsigned char const *map;
+    long size, offset;
+};
+
+static unsigned char const *getTransmitBuffer(void *user, int *size)
+{
+    struct sendFile *f = user;
+    unsigned char const *ret;
+    long n = f->size - f->offset;
+
+    if (n == 0) {
+        return NULL;
+    }
+    *size = n > INT_MAX ? INT_MAX : (int)n;
+    ret = f->map + f->offset;
+    f->offset += *size;
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    toolOptions options;
+    xmodemSession session;
+    xmodemStats stats;
+    struct sendFile f;
+    struct stat st;
+    int fd, result;
+
+    toolParse(&options, argc, argv, "send");
+    fd = open(options.file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(options.file);
+        return 1;
+    }
+    if (st.st_size > INT_MAX) {
+        /* the transfer functions return the length as an int */
+        fprintf(stderr, "xmodem-send: %s: too large\n", options.file);
+        return 1;
+    }
+    f.size = (long)st.st_size;
+    f.offset = 0;
+    f.map = NULL;
+    if (f.size > 0) {
+        void *map = mmap(NULL, (size_t)f.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            perror(options.file);
+            return 1;
+        }
+        madvise(map, (size_t)f.size, MADV_SEQUENTIAL);
+        f.map = map;
+    }
+    close(fd);
+
+    toolOpen(&options, &f.link);
+    toolSession(&options, &session, &f.link);
+    session.stats = &stats;
+    result = xmodemTransmitEx(&session, getTransmitBuffer);
+    toolClose(&f.link);
+    if (f.map) {
+        munmap((void *)f.map, (size_t)f.size);
+    }
+    return toolReport(&options, "send", result, &stats);
+}
@@ -0,0 +1,324 @@
+/*
+ * Drives transfers on many serial ports at once, multiplexed with epoll.
+ *
+ * The ports are shared out between the workers, each of which has an
+ * epoll set of its own, so the workers share nothing while they run. A
+ * worker waits for input or room for output on any of its ports, or for
+ * the earliest engine timeout, then feeds what arrived, writes what the
+ * engines have to send and ticks them all with the time.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "xmodemServer.h"
+
+#define XMODEM_SERVER_EVENTS 32 /* events taken from epoll per wait */
+
+struct worker {
+    xmodemServer *server;
+    int first, stride;
+    int epoll;
+    int active;
+    int error;
+};
+
+static unsigned long nowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000UL + (unsigned long)(ts.tv_nsec / 1000000L);
+}
+
+void xmodemServerInit(xmodemServer *server, int workers)
+{
+    memset(server, 0, sizeof(*server));
+    server->workers = workers > 0 ? workers : 1;
+}
+
+void xmodemServerFree(xmodemServer *server)
+{
+    free(server->ports);
+    server->ports = NULL;
+    server->count = server->capacity = 0;
+}
+
+static int add(xmodemServer *server, int fd, xmodemSession const *session)
+{
+    xmodemServerPort *port;
+    if (server->count == server->capacity) {
+        int capacity = server->capacity ? server->capacity * 2 : 8;
+        xmodemServerPort *ports = realloc(server->ports, capacity * sizeof(*ports));
+        if (ports == NULL) {
+            return -1;
+        }
+        server->ports = ports;
+        server->capacity = capacity;
+    }
+    port = &server->ports[server->count];
+    memset(port, 0, sizeof(*port));
+    port->fd = fd;
+    port->session = session;
+    return server->count++;
+}
+
+int xmodemServerAddTransmit(xmodemServer *server, int fd, xmodemSession const *session,
+                            unsigned char const * (*getBufferCallback)(void *user, int *size))
+{
+    int i = add(server, fd, session);
+    if (i >= 0) {
+        server->ports[i].getTransmitBuffer = getBufferCallback;
+    }
+    return i;
+}
+
+int xmodemServerAddReceive(xmodemServer *server, int fd, xmodemSession const *session,
+                           unsigned char * (*getBufferCallback)(void *user, int *size))
+{
+    int i = add(server, fd, session);
+    if (i >= 0) {
+        server->ports[i].getReceiveBuffer = getBufferCallback;
+    }
+    return i;
+}
+
+static void watch(struct worker *w, xmodemServerPort *port, int op, unsigned int events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = port;
+    epoll_ctl(w->epoll, op, port->fd, &ev);
+}
+
+static void finish(struct worker *w, xmodemServerPort *port)
+{
+    /* a finished engine takes no input, which would leave the descriptor always readable */
+    watch(w, port, EPOLL_CTL_DEL, 0);
+    port->done = 1;
+    --w->active;
+}
+
+/* write what the engine has to send until the port is full */
+static void pump(struct worker *w, xmodemServerPort *port)
+{
+    unsigned char const *data;
+    ssize_t n;
+    int len;
+
+    while ((len = xmodemEnginePollOutput(&port->engine, &data)) > 0) {
+        /* a socket whose far end has gone fails the write rather than raising SIGPIPE */
+        n = port->notSocket ? write(port->fd, data, len) : send(port->fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK) {
+            port->notSocket = 1;
+            n = write(port->fd, data, len);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            if (!port->blocked) {
+                port->blocked = 1;
+                watch(w, port, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+            }
+            return;
+        }
+        if (n <= 0) {
+            /* hung up (EPIPE, or EIO from a tty) or failed: retrying would only wait out every timeout */
+            xmodemEngineAbort(&port->engine, xmodemErrorLinkFailed);
+            return;
+        }
+        xmodemEngineOutputSent(&port->engine, (int)n);
+    }
+    if (port->blocked) {
+        port->blocked = 0;
+        watch(w, port, EPOLL_CTL_MOD, EPOLLIN);
+    }
+}
+
+/* read what has arrived straight into the engine */
+static void feed(xmodemServerPort *port)
+{
+    unsigned char *buf;
+    ssize_t n;
+    int len;
+
+    while ((len = xmodemEngineInputBuffer(&port->engine, &buf)) > 0) {
+        n = read(port->fd, buf, len);
+        if (n > 0) {
+            xmodemEngineInputReceived(&port->engine, (int)n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            return;
+        } else {
+            /* hung up or failed: the descriptor would stay readable, so end the transfer now */
+            xmodemEngineAbort(&port->engine, xmodemErrorLinkFailed);
+            return;
+        }
+    }
+}
+
+static void *work(void *arg)
+{
+    struct worker *w = arg;
+    xmodemServer *server = w->server;
+    struct epoll_event events[XMODEM_SERVER_EVENTS];
+    unsigned long now = nowMs();
+    long timeout, t;
+    int i, n;
+
+    for (i = w->first; i < server->count; i += w->stride) {
+        xmodemServerPort *port = &server->ports[i];
+        if (port->getTransmitBuffer) {
+            xmodemEngineInitTransmit(&port->engine, port->session, port->getTransmitBuffer, now);
+        } else {
+            xmodemEngineInitReceive(&port->engine, port->session, port->getReceiveBuffer, now);
+        }
+        watch(w, port, EPOLL_CTL_ADD, EPOLLIN);
+        ++w->active;
+        pump(w, port);
+    }
+
+    while (w->active > 0) {
+        timeout = -1;
+        for (i = w->first; i < server->count; i += w->stride) {
+            xmodemServerPort *port = &server->ports[i];
+            if (port->done) {
+                continue;
+            }
+            if (xmodemEngineDone(&port->engine)) {
+                finish(w, port);
+            } else if ((t = xmodemEngineTimeout(&port->engine)) >= 0 && (timeout < 0 || t < timeout)) {
+                timeout = t;
+            }
+        }
+        if (w->active == 0) {
+            break;
+        }
+        n = epoll_wait(w->epoll, events, XMODEM_SERVER_EVENTS, timeout > INT_MAX ? INT_MAX : (int)timeout);
+        if (n < 0 && errno != EINTR) {
+            w->error = errno;
+            break;
+        }
+
+        /* time first, so the waits that the input starts run from now */
+        now = nowMs();
+        for (i = w->first; i < server->count; i += w->stride) {
+            if (!server->ports[i].done) {
+                xmodemEngineTick(&server->ports[i].engine, now);
+            }
+        }
+        for (i = 0; i < n; ++i) {
+            xmodemServerPort *port = events[i].data.ptr;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                feed(port);
+            }
+        }
+        for (i = w->first; i < server->count; i += w->stride) {
+            if (!server->ports[i].done) {
+                pump(w, &server->ports[i]);
+            }
+        }
+    }
+    return NULL;
+}
+
+int xmodemServerRun(xmodemServer *server)
+{
+    struct worker *workers;
+    pthread_t *threads;
+    xmodemServerStats *st = &server->stats;
+    unsigned long start = nowMs();
+    int count = server->workers < server->count ? server->workers : server->count;
+    int i, started, err = 0;
+
+    memset(st, 0, sizeof(*st));
+    workers = calloc(count > 0 ? count : 1, sizeof(*workers));
+    threads = calloc(count > 0 ? count : 1, sizeof(*threads));
+    if (workers == NULL || threads == NULL) {
+        free(workers);
+        free(threads);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < count; ++i) {
+        workers[i].server = server;
+        workers[i].first = i;
+        workers[i].stride = count;
+        workers[i].epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (workers[i].epoll < 0) {
+            err = errno;
+        }
+    }
+    started = 0;
+    if (!err && count == 1) {
+        work(&workers[0]);
+    } else if (!err) {
+        for (started = 0; started < count; ++started) {
+            if ((err = pthread_create(&threads[started], NULL, work, &workers[started])) != 0) {
+                break;
+            }
+        }
+    }
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < count; ++i) {
+        if (workers[i].epoll >= 0) {
+            close(workers[i].epoll);
+        }
+        if (!err && workers[i].error) {
+            err = workers[i].error;
+        }
+    }
+    free(workers);
+    free(threads);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    for (i = 0; i < server->count; ++i) {
+        xmodemServerPort *port = &server->ports[i];
+        long data = xmodemEngineStats(&port->engine)->dataBytes;
+        ++st->transfers;
+        if (xmodemEngineResult(&port->engine) < 0) {
+            ++st->failed;
+        }
+        if (port->getTransmitBuffer) {
+            st->transmitted += data;
+        } else {
+            st->received += data;
+        }
+    }
+    st->elapsed = nowMs() - start;
+    if (st->elapsed) {
+        long total = st->transmitted + st->received;
+        st->throughput = total / st->elapsed * 1000 + total % st->elapsed * 1000 / st->elapsed;
+    }
+    return st->failed;
+}
+
+int xmodemServerResult(xmodemServer const *server, int port)
+{
+    return xmodemEngineResult(&server->ports[port].engine);
+}
+
+xmodemStats const *xmodemServerPortStats(xmodemServer const *server, int port)
+{
+    return xmodemEngineStats(&server->ports[port].engine);
+}
+
+xmodemServerStats const *xmodemServerGetStats(xmodemServer const *server)
+{
+    return &server->stats;
+}
@@ -0,0 +1,122 @@
+//
+// Drives transfers on many serial ports at once from one thread or a small pool, multiplexed with epoll. Linux only.
+//
+
+#ifndef XMODEM_SERVER_H
+#define XMODEM_SERVER_H
+
+#include "xmodem.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * One transfer on one port. The fields are private.
+ */
+typedef struct xmodemServerPort {
+    int fd;
+    xmodemSession const *session;
+    unsigned char * (*getReceiveBuffer)(void *user, int *size);
+    unsigned char const * (*getTransmitBuffer)(void *user, int *size);
+    int blocked;
+    /* set once send has failed with ENOTSOCK, such as on a tty, to write without trying it first */
+    int notSocket;
+    int done;
+    xmodemEngine engine;
+} xmodemServerPort;
+
+/**
+ * The totals of a run
+ */
+typedef struct xmodemServerStats {
+    /** Transfers run, and those that failed */
+    int transfers, failed;
+    /** Data acknowledged to the transmitters, and stored by the receivers */
+    long transmitted, received;
+    /** Time the run took, in ms */
+    unsigned long elapsed;
+    /** transmitted and received per second over the elapsed time */
+    long throughput;
+} xmodemServerStats;
+
+/**
+ * A set of transfers. The fields are private.
+ */
+typedef struct xmodemServer {
+    xmodemServerPort *ports;
+    int count, capacity;
+    int workers;
+    xmodemServerStats stats;
+} xmodemServer;
+
+/**
+ * Initialise a server
+ * @param server The server
+ * @param workers The number of threads to share the ports between, 1 to run them all in the thread calling
+ *                xmodemServerRun
+ */
+void xmodemServerInit(xmodemServer *server, int workers);
+
+/**
+ * Free the memory held by a server. The ports are not closed.
+ * @param server The server
+ */
+void xmodemServerFree(xmodemServer *server);
+
+/**
+ * Add a port to transmit on. Ports may not be added during a run.
+ * @param server The server
+ * @param fd A non-blocking descriptor for the port, such as from xmodemSerialOpen
+ * @param session The session for the timeouts, retry limits and user pointer; the I/O functions are not used. Must
+ *                outlive the run, and may be shared by ports whose transfers need nothing of their own from it, such
+ *                as a user pointer or a staging buffer.
+ * @param getBufferCallback As for xmodemTransmitEx, called from the worker thread that runs the port
+ * @return The index of the port, or -1 if out of memory
+ */
+int xmodemServerAddTransmit(xmodemServer *server, int fd, xmodemSession const *session,
+                            unsigned char const * (*getBufferCallback)(void *user, int *size));
+
+/**
+ * Add a port to receive on
+ * @param server The server
+ * @param fd As for xmodemServerAddTransmit
+ * @param session As for xmodemServerAddTransmit
+ * @param getBufferCallback As for xmodemReceiveEx, called from the worker thread that runs the port
+ * @return The index of the port, or -1 if out of memory
+ */
+int xmodemServerAddReceive(xmodemServer *server, int fd, xmodemSession const *session,
+                           unsigned char * (*getBufferCallback)(void *user, int *size));
+
+/**
+ * Run every transfer to completion
+ * @param server The server
+ * @return The number of transfers that failed, or -1 with errno set if the workers could not be started
+ */
+int xmodemServerRun(xmodemServer *server);
+
+/**
+ * @param server The server
+ * @param port The index of a port
+ * @return Once run, the result of its transfer, as returned by xmodemTransmitEx or xmodemReceiveEx
+ */
+int xmodemServerResult(xmodemServer const *server, int port);
+
+/**
+ * @param server The server
+ * @param port The index of a port
+ * @return The statistics of its transfer
+ */
+xmodemStats const *xmodemServerPortStats(xmodemServer const *server, int port);
+
+/**
+ * @param server The server
+ * @return The totals of the last run
+ */
+xmodemServerStats const *xmodemServerGetStats(xmodemServer const *server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //XMODEM_SERVER_H
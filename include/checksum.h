@@ -0,0 +1,28 @@
+//
+// The 8 bit additive checksum of XMODEM packets, with vector implementations and a fused copy
+//
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the sum of the bytes modulo 256, continued from cks, the checksum of the preceding data or 0 to start */
+unsigned char checksum8(unsigned char cks, const unsigned char *buf, int len);
+
+/* copy len bytes from src to dst, continuing the checksum over them in the same pass */
+unsigned char checksum8_copy(unsigned char cks, unsigned char *dst, const unsigned char *src, int len);
+
+/* the implementations checksum8 chooses between, for testing and benchmarking */
+unsigned char checksum8_bytewise(unsigned char cks, const unsigned char *buf, int len);
+/* SSE2 or AVX2 on x86-64, NEON on ARM, the same as checksum8_bytewise when unavailable */
+unsigned char checksum8_simd(unsigned char cks, const unsigned char *buf, int len);
+int checksum8_simd_available(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHECKSUM_H
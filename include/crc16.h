@@ -28,6 +28,34 @@
 #ifndef _CRC16_H_
 #define _CRC16_H_
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 unsigned short crc16_ccitt(const unsigned char *buf, int len);
 
+/* streaming CRC, for data that arrives in pieces:
+     crc = crc16_ccitt_init();
+     crc = crc16_ccitt_update(crc, buf, len); // for each piece
+     result = crc16_ccitt_final(crc);
+ */
+unsigned short crc16_ccitt_init(void);
+unsigned short crc16_ccitt_update(unsigned short crc, const unsigned char *buf, int len);
+unsigned short crc16_ccitt_final(unsigned short crc);
+
+/* copy len bytes from src to dst, continuing a streaming CRC over them in the same pass */
+unsigned short crc16_ccitt_copy(unsigned short crc, unsigned char *dst, const unsigned char *src, int len);
+
+/* the implementations crc16_ccitt chooses between, for testing and benchmarking;
+   crc is the CRC of the preceding data, 0 to start */
+unsigned short crc16_ccitt_bytewise(unsigned short crc, const unsigned char *buf, int len);
+unsigned short crc16_ccitt_slice8(unsigned short crc, const unsigned char *buf, int len);
+/* carry-less multiply (PCLMULQDQ or PMULL), the same as crc16_ccitt_slice8 when unavailable */
+unsigned short crc16_ccitt_hw(unsigned short crc, const unsigned char *buf, int len);
+int crc16_ccitt_hw_available(void);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _CRC16_H_ */
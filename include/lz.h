@@ -0,0 +1,92 @@
+//
+// A small streaming LZSS codec for compressing transfers
+//
+
+#ifndef LZ_H
+#define LZ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The compressed stream is groups of a flag byte followed by up to 8 items, one per flag bit from the least
+ * significant. A set bit is a literal byte. A clear bit is a match of two bytes, b0 and b1: a copy of
+ * (b1 >> 2) + LZ_MIN_MATCH bytes from offset b0 | (b1 & 3) << 8 bytes back. Offset 0 ends the stream, so
+ * anything after it, such as packet padding, is ignored.
+ */
+#define LZ_WINDOW 1024
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 63)
+
+#ifndef LZ_ENCODER_BUFFER
+#define LZ_ENCODER_BUFFER 4096 /* history and input waiting to be compressed, more than LZ_WINDOW + LZ_MAX_MATCH */
+#endif
+#define LZ_HASH_SIZE 1024
+
+/**
+ * Compressor state, about 14 KB. The fields are private.
+ */
+typedef struct lzEncoder {
+    unsigned char buf[LZ_ENCODER_BUFFER];
+    short head[LZ_HASH_SIZE];
+    short prev[LZ_ENCODER_BUFFER];
+    int pos, end;
+    unsigned char group[1 + 8 * 2];
+    int groupLen, groupItems, groupOff;
+    int ended;
+    /** Bytes taken in */
+    long in;
+} lzEncoder;
+
+/**
+ * Decompressor state, a little over LZ_WINDOW bytes. The fields are private.
+ */
+typedef struct lzDecoder {
+    unsigned char window[LZ_WINDOW];
+    int pos;
+    int flags, items;
+    int first, haveFirst;
+    int offset, remaining;
+    int done;
+} lzDecoder;
+
+void lzEncoderInit(lzEncoder *z);
+
+/**
+ * Take data to compress
+ * @return The number of bytes taken, fewer than len once the encoder is full; then lzEncoderGet makes room
+ */
+int lzEncoderPut(lzEncoder *z, unsigned char const *in, int len);
+
+/**
+ * Get compressed data
+ * @param final Nonzero once all the data has been put, to compress the rest and end the stream
+ * @return The number of bytes written to out, fewer than len when more input is needed or the stream has ended
+ */
+int lzEncoderGet(lzEncoder *z, unsigned char *out, int len, int final);
+
+void lzDecoderInit(lzDecoder *d);
+
+/**
+ * Decompress data
+ * @param used Set to the number of bytes of in consumed
+ * @return The number of bytes written to out. Fewer than outLen once the input is consumed or the stream has ended.
+ */
+int lzDecode(lzDecoder *d, unsigned char const *in, int inLen, int *used, unsigned char *out, int outLen);
+
+/**
+ * @return Nonzero if part of a match remains to be written, so lzDecode needs more room even with no more input
+ */
+int lzDecoderPending(lzDecoder const *d);
+
+/**
+ * @return Nonzero once the end of the stream has been decoded
+ */
+int lzDecoderDone(lzDecoder const *d);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //LZ_H
@@ -5,6 +5,8 @@
 #ifndef XMODEM_H
 #define XMODEM_H
 
+#include "lz.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -13,15 +15,35 @@ extern "C" {
 #define XMODEM_MAXRETRANS 25
 #endif
 
+// Define to make 1K the default transmit block size of xmodemSessionInit
 //#define XMODEM_TRANSMIT_1K
 
+// Define for 128 byte packets only, shrinking the staging buffer to 134 bytes: receivers NAK 1K packets, and
+// transmitters send 128 byte packets whatever the session blockSize. Changes xmodemEngine, so define it for every user
+// of this header as well as for the library.
+//#define XMODEM_128_ONLY
+
+// Define to leave the staging buffer out of xmodemEngine, so that every session must supply its stagingBuffer
+//#define XMODEM_NO_ENGINE_BUFFER
+
+#ifdef XMODEM_128_ONLY
+#define XMODEM_MAX_BLOCK_SIZE 128
+#else
+#define XMODEM_MAX_BLOCK_SIZE 1024
+#endif
+
+/* the largest packet, 3 header bytes, 2 CRC bytes and a NUL */
+#define XMODEM_STAGING_BUFFER_SIZE (XMODEM_MAX_BLOCK_SIZE + 6)
+
 typedef enum {
     xmodemErrorCancelledByRemote = -1,
     xmodemErrorNoSync = -2,
     xmodemErrorTooManyRetries = -3,
     xmodemErrorTransmitError = -4,
     xmodemErrorUnexpectedResponse = -5,
-    xmodemErrorBufferFull = -6
+    xmodemErrorBufferFull = -6,
+    xmodemErrorFileRefused = -7,
+    xmodemErrorLinkFailed = -8
 } xmodemError;
 
 /**
@@ -56,6 +78,423 @@ extern int (*xmodemInByte)(unsigned short timeout);
  */
 extern void (*xmodemOutByte)(unsigned char c);
 
+/**
+ * Optional: get up to len received bytes in one call. If NULL, xmodemInByte is used.
+ * @param buf The buffer to store received bytes
+ * @param len The maximum number of bytes to read
+ * @param timeout The timeout for the whole read, in ms
+ * @return The number of bytes received (may be fewer than len), 0 or negative if none arrived before the timeout
+ */
+extern int (*xmodemInBlock)(unsigned char *buf, int len, unsigned short timeout);
+
+/**
+ * Optional: send a block of bytes in one call, such as a whole frame. If NULL, xmodemOutByte is used.
+ * @param buf The bytes to send
+ * @param len The number of bytes to send
+ */
+extern void (*xmodemOutBlock)(unsigned char const *buf, int len);
+
+/**
+ * Statistics of a single transfer, for spotting a degraded link without logging
+ */
+typedef struct xmodemStats {
+    /** All bytes written to and read from the link, including retransmissions and control characters */
+    long bytesSent, bytesReceived;
+    /** Packets sent by a transmitter, including retransmissions, or received whole by a receiver, including bad ones */
+    long packets;
+    /** Data acknowledged by the receiver, compressed if the transfer is, or stored by a receiver */
+    long dataBytes;
+    /** Bytes of packets sent more than once */
+    long retransmittedBytes;
+    /** NAKs received by a transmitter, or sent by a receiver */
+    int naks;
+    /** Waits for the other end that expired */
+    int timeouts;
+    /** Packets received again after their acknowledgement was lost */
+    int duplicates;
+    /** 1 if the packets carry a CRC, 0 for a checksum, -1 before the receiver has chosen */
+    int crc;
+    /** Time spent with output not yet sent, and waiting for the other end, in ms */
+    unsigned long transmitTime, waitTime;
+    /** Time since the transfer started, in ms */
+    unsigned long elapsed;
+    /** dataBytes per second over the elapsed time, 0 until time has passed */
+    long goodput;
+    /**
+     * Smoothed round trip time in ms, 0 until measured: from a packet being sent to its ACK for a transmitter, from
+     * an ACK being sent to the next packet starting for a receiver
+     */
+    unsigned long rtt;
+} xmodemStats;
+
+/**
+ * The link and protocol settings of a single transfer. Transfers using separate sessions share no state, so many may
+ * run at once on separate threads. Initialise with xmodemSessionInit, then set the I/O functions and user pointer.
+ */
+typedef struct xmodemSession {
+    /**
+     * Get a received byte. Required unless inBlock is set.
+     * @param user The session user pointer
+     * @param timeout The timeout, in ms
+     * @return The character received, if negative a failure. xmodemErrorLinkFailed, for a link that has gone, ends a
+     * blocking transfer with that result.
+     */
+    int (*inByte)(void *user, unsigned short timeout);
+    /**
+     * Send a byte. Required unless outBlock is set.
+     * @param user The session user pointer
+     * @param c The byte to send
+     */
+    void (*outByte)(void *user, unsigned char c);
+    /**
+     * Optional: get up to len received bytes in one call. If NULL, inByte is used.
+     * @return The number of bytes received (may be fewer than len), 0 or negative if none arrived before the timeout.
+     * xmodemErrorLinkFailed, for a link that has gone, ends a blocking transfer with that result.
+     */
+    int (*inBlock)(void *user, unsigned char *buf, int len, unsigned short timeout);
+    /**
+     * Optional: send a block of bytes in one call. If NULL, outByte is used.
+     */
+    void (*outBlock)(void *user, unsigned char const *buf, int len);
+    /** Passed to the I/O functions and buffer callbacks */
+    void *user;
+    /** Time to wait for each synchronisation character or packet header, in ms */
+    unsigned short syncTimeout;
+    /** Time to wait for the response to a transmitted packet, in ms */
+    unsigned short ackTimeout;
+    /** Time to wait for each byte within a packet, in ms */
+    unsigned short byteTimeout;
+    /** Time the line must be silent for before input is considered flushed, in ms */
+    unsigned short flushTimeout;
+    /**
+     * Optional: the line rate in bits per second, with 10 bits per byte. When set, a few byte times of silence within
+     * a packet or while flushing are enough to end it, rather than byteTimeout or flushTimeout. Leave 0 for links that
+     * deliver bytes in bursts, such as USB adapters or networks.
+     */
+    unsigned long baud;
+    /** Number of synchronisation attempts before failing with xmodemErrorNoSync */
+    int syncRetries;
+    /** Number of attempts per packet before failing */
+    int maxRetrans;
+    /**
+     * Nonzero to scale ackTimeout, byteTimeout and flushTimeout down to a few round trip times once the round trip
+     * time has been measured, so errors are recovered from in about the time the link takes rather than in seconds.
+     * The configured values remain the upper limits. Needs accurate times: the blocking functions need clock set.
+     */
+    int adaptiveTimeouts;
+    /** Transmit block size, 128 or 1024 bytes; always 128 with XMODEM_128_ONLY */
+    int blockSize;
+    /**
+     * Nonzero to resend a repeatedly failing 1024 byte packet as 128 byte packets, returning to blockSize once 128
+     * byte packets are being acknowledged first time
+     */
+    int adaptiveBlockSize;
+    /**
+     * Streaming, for when both ends use this library: the number of packets the transmitter may send ahead of their
+     * acknowledgement. The receiver asks for streaming when this is above 1, and the transmitter agrees when it is
+     * above 1 and windowBuffer is set. Acknowledgements are cumulative, and an error makes the transmitter go back
+     * to the packet the receiver names. Up to 127; adaptiveBlockSize does not apply.
+     */
+    int window;
+    /** Transmitter storage for the packets in flight when streaming, window * (blockSize + 5) bytes */
+    unsigned char *windowBuffer;
+    /**
+     * Optional: blockSize + 5 bytes in which the transmitter prepares the next packet, calling getBufferCallback and
+     * computing its CRC, while it waits for the acknowledgement of the current one. Not used when streaming.
+     */
+    unsigned char *prepareBuffer;
+    /**
+     * Optional: the current time, in ms. The blocking functions use it to measure the time spent transmitting and
+     * waiting; without it they only count the timeouts that expire.
+     */
+    unsigned long (*clock)(void *user);
+    /** Optional: called with the statistics as each packet is acknowledged or stored, and once done */
+    void (*progress)(void *user, xmodemStats const *stats);
+    /** Optional: filled in with the statistics once a blocking or coroutine transfer is done */
+    xmodemStats *stats;
+    /**
+     * Optional: called by a receiver as each packet is committed to the application buffers, to record where a
+     * failed transfer could resume from
+     * @param user The session user pointer
+     * @param packetno The number of the packet
+     * @param offset The length of data committed from the start of the stream, less any padding so far
+     */
+    void (*checkpoint)(void *user, unsigned char packetno, long offset);
+    /**
+     * Receiver: an offset from the checkpoint of an earlier attempt to resume from, or 0 to start afresh; the
+     * application buffers continue from there. A transmitter using this library skips that much of its data. Any
+     * other gives no answer, and after a few attempts the whole stream is received, discarding the data up to the
+     * offset. Not for batch transfers. Lengths and results still count from the start of the stream.
+     */
+    long resumeFrom;
+    /**
+     * Optional: compressor state for a transmitter. With it, a receiver that asks for compression is sent the data
+     * through the LZSS codec of lz.h, so more data fits in each packet.
+     */
+    lzEncoder *encoder;
+    /**
+     * Optional: decompressor state for a receiver, which then asks for compression, falling back to plain packets if
+     * the transmitter does not answer. A resumed transfer restarts the compressed stream at the resume offset.
+     */
+    lzDecoder *decoder;
+    /**
+     * Optional: XMODEM_STAGING_BUFFER_SIZE bytes for the engine to assemble packets in, in place of the buffer within
+     * xmodemEngine, which the blocking functions keep on the stack. Required with XMODEM_NO_ENGINE_BUFFER. Transfers
+     * running at once need buffers of their own.
+     */
+    unsigned char *stagingBuffer;
+} xmodemSession;
+
+/**
+ * Initialise a session with the default timeouts and retry limits, and no I/O functions
+ * @param session The session to initialise
+ */
+void xmodemSessionInit(xmodemSession *session);
+
+/**
+ * Receive data using the I/O functions of a session
+ * @param session The session
+ * @param getBufferCallback As for xmodemReceive, additionally passed the session user pointer. Packets that fit in
+ *                          the buffer are received straight into it, so bytes past the received length may have been
+ *                          written.
+ * @return If 0 or positive, the length of received data. If negative, a xmodemError
+ */
+int xmodemReceiveEx(xmodemSession const *session, unsigned char * (*getBufferCallback)(void *user, int *size));
+
+/**
+ * Transmit data using the I/O functions of a session
+ * @param session The session
+ * @param getBufferCallback As for xmodemTransmit, additionally passed the session user pointer. Whole packets are sent
+ *                          straight from the buffer, so it must stay valid and unchanged until the callback is next
+ *                          called.
+ * @return If positive, the size of data sent; if negative, an error code defined in the
+ *         xmodemError enum.
+ */
+int xmodemTransmitEx(xmodemSession const *session, unsigned char const * (*getBufferCallback)(void *user, int *size));
+
+/**
+ * Receive a YMODEM batch of files. Each file starts with a header packet giving its name and, usually, its exact
+ * length, so the data is truncated to that length rather than by removing trailing CTRLZ and NUL bytes.
+ * @param session The session; its window does not apply
+ * @param fileCallback Called as each file starts, before getBufferCallback is called for its data, with its name and
+ *                     length, or -1 if the transmitter did not give a length. Should return 0 to accept the file, or
+ *                     nonzero to cancel the transfer with xmodemErrorFileRefused. May be NULL.
+ * @param getBufferCallback As for xmodemReceiveEx; buffers are not shared between files, so a file of known length
+ *                          may be given a buffer of exactly that size
+ * @param fileEndCallback Optional: called as each file is complete, with its length
+ * @return If 0 or positive, the number of files received. If negative, a xmodemError
+ */
+int xmodemReceiveBatchEx(xmodemSession const *session,
+                         int (*fileCallback)(void *user, char const *name, long size),
+                         unsigned char * (*getBufferCallback)(void *user, int *size),
+                         void (*fileEndCallback)(void *user, long length));
+
+/**
+ * Transmit a YMODEM batch of files in one session
+ * @param session The session; its window does not apply
+ * @param nextFileCallback Called for each file: should set the name and length of the next file and return nonzero,
+ *                         or return 0 once there are no more. The length may be set to -1 if it is not known, in
+ *                         which case the receiver has to remove the padding of the last packet. The name is copied.
+ * @param getBufferCallback As for xmodemTransmitEx, returning NULL at the end of each file's data
+ * @return If 0 or positive, the number of files sent; if negative, an error code defined in the xmodemError enum.
+ */
+int xmodemTransmitBatchEx(xmodemSession const *session,
+                          int (*nextFileCallback)(void *user, char const **name, long *size),
+                          unsigned char const * (*getBufferCallback)(void *user, int *size));
+
+/**
+ * A non-blocking transfer engine. The application pushes received bytes in, polls for bytes to send and reports the
+ * passing of time, so one thread or an interrupt handler can drive any number of transfers. The fields are private;
+ * the struct is declared here so that engines may be statically allocated.
+ *
+ * All times are in ms from an arbitrary origin and may wrap. Timeouts are measured from the time most recently passed
+ * to xmodemEngineTick, so call it before feeding input after a period of waiting.
+ */
+typedef struct xmodemEngine {
+    xmodemSession const *session;
+    unsigned char * (*getReceiveBuffer)(void *user, int *size);
+    unsigned char const * (*getTransmitBuffer)(void *user, int *size);
+    int (*fileStart)(void *user, char const *name, long size);
+    void (*fileEnd)(void *user, long length);
+    int (*nextFile)(void *user, char const **name, long *size);
+    int state;
+    int result;
+    int afterFlush;
+    unsigned long now;
+    unsigned long deadline;
+    unsigned short wait;
+    int armed;
+    unsigned long armedAt;
+    long srtt, rttvar;
+    int timing, rttSamples;
+    unsigned char ctl[16];
+    int ctlLen, ctlOff;
+    unsigned char const *frame;
+    unsigned char const *framePayload;
+    unsigned char *txbuf;
+    unsigned char const *nextPayload;
+    int nextBufsz, nextData, prepared;
+    int frameLen, frameOff;
+    unsigned char in;
+    int crc;
+    unsigned char trychar;
+    unsigned char packetno;
+    int bufsz, blockSize;
+    int frameData, carry, clean;
+    int stream, window, base, next, end, eof;
+    unsigned char resp[3];
+    int respLen;
+    int retry, retrans;
+    int pos, need;
+    unsigned short check;
+    unsigned char *xbuff;
+#ifndef XMODEM_NO_ENGINE_BUFFER
+    unsigned char buffer[XMODEM_STAGING_BUFFER_SIZE];
+#endif
+    unsigned char *payload;
+    unsigned char *dest;
+    int destsz;
+    unsigned char const *src;
+    int srcsz;
+    int len;
+    int padding;
+    long total;
+    int batch, eot, files;
+    long size;
+    unsigned long start;
+    xmodemStats stats;
+    int resumeHeard;
+    long skip, resumed;
+    int compress, srcEnd;
+} xmodemEngine;
+
+/**
+ * Start receiving. The engine immediately has output to poll.
+ * @param engine The engine
+ * @param session The session for the timeouts, retry limits and user pointer; the I/O functions are not used. Must
+ *                outlive the transfer.
+ * @param getBufferCallback As for xmodemReceiveEx
+ * @param now The current time, in ms
+ */
+void xmodemEngineInitReceive(xmodemEngine *engine, xmodemSession const *session,
+                             unsigned char * (*getBufferCallback)(void *user, int *size), unsigned long now);
+
+/**
+ * Start transmitting, waiting for the receiver to synchronise
+ * @param engine The engine
+ * @param session As for xmodemEngineInitReceive
+ * @param getBufferCallback As for xmodemTransmitEx
+ * @param now The current time, in ms
+ */
+void xmodemEngineInitTransmit(xmodemEngine *engine, xmodemSession const *session,
+                              unsigned char const * (*getBufferCallback)(void *user, int *size), unsigned long now);
+
+/**
+ * Start receiving a YMODEM batch. The engine immediately has output to poll.
+ * @param engine The engine
+ * @param session As for xmodemEngineInitReceive
+ * @param fileCallback As for xmodemReceiveBatchEx
+ * @param getBufferCallback As for xmodemReceiveBatchEx
+ * @param fileEndCallback As for xmodemReceiveBatchEx
+ * @param now The current time, in ms
+ */
+void xmodemEngineInitReceiveBatch(xmodemEngine *engine, xmodemSession const *session,
+                                  int (*fileCallback)(void *user, char const *name, long size),
+                                  unsigned char * (*getBufferCallback)(void *user, int *size),
+                                  void (*fileEndCallback)(void *user, long length), unsigned long now);
+
+/**
+ * Start transmitting a YMODEM batch, waiting for the receiver to synchronise
+ * @param engine The engine
+ * @param session As for xmodemEngineInitReceive
+ * @param nextFileCallback As for xmodemTransmitBatchEx
+ * @param getBufferCallback As for xmodemTransmitBatchEx
+ * @param now The current time, in ms
+ */
+void xmodemEngineInitTransmitBatch(xmodemEngine *engine, xmodemSession const *session,
+                                   int (*nextFileCallback)(void *user, char const **name, long *size),
+                                   unsigned char const * (*getBufferCallback)(void *user, int *size),
+                                   unsigned long now);
+
+/**
+ * Push received bytes into the engine
+ * @param engine The engine
+ * @param data The received bytes
+ * @param len The number of received bytes
+ * @return The number of bytes consumed, fewer than len only once the transfer is done
+ */
+int xmodemEngineFeed(xmodemEngine *engine, unsigned char const *data, int len);
+
+/**
+ * Get a buffer to receive bytes into directly, avoiding a copy. Reading more bytes than returned could wait for input
+ * that will not arrive until the engine has sent a response.
+ * @param engine The engine
+ * @param buf Set to the buffer to read into
+ * @return The number of bytes the engine can take now, 0 once the transfer is done
+ */
+int xmodemEngineInputBuffer(xmodemEngine *engine, unsigned char **buf);
+
+/**
+ * Report bytes read into the buffer returned by xmodemEngineInputBuffer
+ * @param engine The engine
+ * @param len The number of bytes read
+ */
+void xmodemEngineInputReceived(xmodemEngine *engine, int len);
+
+/**
+ * Get the next bytes to send
+ * @param engine The engine
+ * @param data Set to the bytes to send, valid until the engine is next called
+ * @return The number of bytes to send, 0 if there are none
+ */
+int xmodemEnginePollOutput(xmodemEngine *engine, unsigned char const **data);
+
+/**
+ * Report bytes from xmodemEnginePollOutput as sent. Timeouts waiting for a response start once all output is sent.
+ * @param engine The engine
+ * @param len The number of bytes sent
+ */
+void xmodemEngineOutputSent(xmodemEngine *engine, int len);
+
+/**
+ * Advance the engine's clock and handle an expired timeout
+ * @param engine The engine
+ * @param now The current time, in ms
+ */
+void xmodemEngineTick(xmodemEngine *engine, unsigned long now);
+
+/**
+ * End the transfer at once, dropping any output not yet sent, such as when the link has hung up
+ * @param engine The engine
+ * @param result The result, such as xmodemErrorLinkFailed
+ */
+void xmodemEngineAbort(xmodemEngine *engine, int result);
+
+/**
+ * Get the time until the engine next needs xmodemEngineTick
+ * @param engine The engine
+ * @return The time in ms, or negative if no timeout is running (output is pending or the transfer is done)
+ */
+long xmodemEngineTimeout(xmodemEngine const *engine);
+
+/**
+ * @param engine The engine
+ * @return Nonzero once the transfer has finished and all output has been sent
+ */
+int xmodemEngineDone(xmodemEngine const *engine);
+
+/**
+ * @param engine The engine
+ * @return The statistics of the transfer so far
+ */
+xmodemStats const *xmodemEngineStats(xmodemEngine const *engine);
+
+/**
+ * @param engine The engine
+ * @return Once done, the result as returned by the matching blocking function, such as xmodemReceiveEx
+ */
+int xmodemEngineResult(xmodemEngine const *engine);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,522 @@
+//
+// Header-only C++17 XMODEM transmitter and receiver, with the block size, check and I/O fixed at compile time
+//
+
+#ifndef XMODEM_HPP
+#define XMODEM_HPP
+
+#include <cstring>
+#include "xmodem.h"
+
+/*
+ * The plain XMODEM protocol of xmodem.c, with the same packets, responses, timeouts and retry limits and the same
+ * results, for code that knows its link when it is compiled. The packet loops are instantiated for each block size
+ * and check, so the CRC, from a table built at compile time, runs over a constant length, and the I/O is a policy
+ * class whose calls inline rather than going through function pointers. Streaming, compression, resume and YMODEM
+ * batches are left to the C engine.
+ *
+ * An I/O policy has the members
+ *     int read(unsigned char *buf, int len, unsigned short timeout);
+ *     void write(unsigned char const *buf, int len);
+ * with read returning the number of bytes received, up to len, or 0 or negative if none arrived within timeout ms,
+ * as the inBlock and outBlock of a session do.
+ *
+ * The application buffers come from callables shaped like the getBufferCallback of xmodemTransmit and xmodemReceive:
+ *     unsigned char const *source(int *size);  // NULL or a size of 0 at the end of the data
+ *     unsigned char *sink(int *size);          // NULL when there is no more room
+ *
+ *     xmodemSession session;
+ *     xmodemSessionInit(&session);
+ *     int sent = xmodem::Transmitter<1024, SerialIo>(session, io).run(source);
+ *     int received = xmodem::Receiver<xmodem::Check::crc, SerialIo>(session, io).run(sink);
+ *
+ * Only the timeouts and retry limits of the session are used.
+ */
+
+namespace xmodem {
+
+/** The check on each packet: the CRC-16 asked for with 'C', or the 8 bit checksum asked for with NAK */
+enum class Check { crc, checksum };
+
+namespace detail {
+
+constexpr unsigned char SOH = 0x01;
+constexpr unsigned char STX = 0x02;
+constexpr unsigned char EOT = 0x04;
+constexpr unsigned char ACK = 0x06;
+constexpr unsigned char NAK = 0x15;
+constexpr unsigned char CAN = 0x18;
+constexpr unsigned char CTRLZ = 0x1A;
+
+constexpr unsigned char cancelSequence[] = { CAN, CAN, CAN };
+
+/* the CRC-16/XMODEM of each byte value, polynomial 0x1021 */
+struct CrcTable {
+    unsigned short entries[256];
+
+    constexpr CrcTable() : entries() {
+        for (int i = 0; i < 256; ++i) {
+            unsigned short crc = (unsigned short)(i << 8);
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (unsigned short)(crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1);
+            }
+            entries[i] = crc;
+        }
+    }
+};
+
+inline constexpr CrcTable crcTable{};
+
+static_assert(crcTable.entries[1] == 0x1021 && crcTable.entries[0x80] == 0x9188 && crcTable.entries[0xff] == 0x1ef0,
+              "CRC table does not match crc16.c");
+
+template <Check C>
+struct Checker;
+
+template <>
+struct Checker<Check::crc> {
+    static constexpr int size = 2;
+    static constexpr unsigned char request = 'C';
+
+    unsigned short value = 0;
+
+    void add(unsigned char c) {
+        value = (unsigned short)((value << 8) ^ crcTable.entries[((value >> 8) ^ c) & 0xff]);
+    }
+    void put(unsigned char *trailer) const {
+        trailer[0] = (unsigned char)(value >> 8);
+        trailer[1] = (unsigned char)value;
+    }
+    bool matches(unsigned char const *trailer) const {
+        return trailer[0] == (unsigned char)(value >> 8) && trailer[1] == (unsigned char)value;
+    }
+};
+
+template <>
+struct Checker<Check::checksum> {
+    static constexpr int size = 1;
+    static constexpr unsigned char request = NAK;
+
+    unsigned char value = 0;
+
+    void add(unsigned char c) {
+        value = (unsigned char)(value + c);
+    }
+    void put(unsigned char *trailer) const {
+        trailer[0] = value;
+    }
+    bool matches(unsigned char const *trailer) const {
+        return trailer[0] == value;
+    }
+};
+
+/* the check over len bytes, copying them to dst if set; a constant len lets the loop unroll */
+template <typename Checker>
+inline void checkRun(Checker &check, unsigned char *dst, unsigned char const *src, int len) {
+    for (int i = 0; i < len; ++i) {
+        unsigned char c = src[i];
+        if (dst) dst[i] = c;
+        check.add(c);
+    }
+}
+
+/* the length of the padding at the end of the last packet, made of CTRLZ optionally followed by NULs, as in xmodem.c */
+inline int padding(unsigned char const *buf, int sz) {
+    int i = sz - 1;
+    while (i >= 0 && buf[i] == 0) --i;
+    if (i < 0) return sz;
+    if (buf[i] != CTRLZ) return 0;
+    while (i >= 0 && buf[i] == CTRLZ) --i;
+    return sz - i - 1;
+}
+
+/* the blocking I/O common to both ends */
+template <typename Io>
+class Link {
+protected:
+    Link(xmodemSession const &session, Io &io) : session(session), io(io) {}
+
+    /* a byte, or -1 if none arrived within timeout */
+    int readByte(unsigned short timeout) {
+        unsigned char c;
+        return io.read(&c, 1, timeout) > 0 ? c : -1;
+    }
+
+    void writeByte(unsigned char c) {
+        io.write(&c, 1);
+    }
+
+    void cancel() {
+        io.write(cancelSequence, sizeof(cancelSequence));
+    }
+
+    /* discard input until the line has been quiet for flushTimeout, then end with result */
+    int flush(int result) {
+        unsigned char discard[64];
+        while (io.read(discard, sizeof(discard), session.flushTimeout) > 0) {
+        }
+        return result;
+    }
+
+    xmodemSession const &session;
+    Io &io;
+};
+
+} // namespace detail
+
+/**
+ * Sends BlockSize byte packets, with whichever check the receiver asks for
+ */
+template <int BlockSize, typename Io>
+class Transmitter : detail::Link<Io> {
+    static_assert(BlockSize == 128 || BlockSize == 1024, "XMODEM packets are 128 or 1024 bytes");
+
+    using Base = detail::Link<Io>;
+    using Base::session;
+    using Base::io;
+
+public:
+    /**
+     * @param session The timeouts and retry limits
+     * @param io The link, which must outlive the transmitter
+     */
+    Transmitter(xmodemSession const &session, Io &io) : Base(session, io) {}
+
+    /**
+     * Transmit data
+     * @param source Returns each application buffer in turn, as for xmodemTransmit
+     * @return If positive, the size of data sent; if negative, a xmodemError
+     */
+    template <typename Source>
+    int run(Source &&source) {
+        using namespace detail;
+        for (int retry = 0; retry < session.syncRetries; ++retry) {
+            switch (this->readByte(session.syncTimeout)) {
+            case 'C':
+                return send<Check::crc>(source);
+            case NAK:
+                return send<Check::checksum>(source);
+            case CAN:
+                if (this->readByte(session.byteTimeout) == CAN) {
+                    this->writeByte(ACK);
+                    return this->flush(xmodemErrorCancelledByRemote);
+                }
+                break;
+            default:
+                break;
+            }
+        }
+        this->cancel();
+        return this->flush(xmodemErrorNoSync);
+    }
+
+private:
+    /* fill and seal a packet with the next data from source, returns the number of data bytes, 0 at the end */
+    template <Check C, typename Source>
+    int fill(Source &source, unsigned char packetno) {
+        detail::Checker<C> check;
+        unsigned char *payload = frame + 3;
+        int data = 0;
+        while (data < BlockSize) {
+            if (len == srcsz) {
+                src = source(&srcsz);
+                if (src == nullptr) srcsz = 0;
+                len = 0;
+                if (srcsz == 0) break;
+            }
+            if (data == 0 && srcsz - len >= BlockSize) {
+                /* the common case, a whole packet from one buffer */
+                detail::checkRun(check, payload, src + len, BlockSize);
+                len += BlockSize;
+                data = BlockSize;
+                break;
+            }
+            int c = srcsz - len < BlockSize - data ? srcsz - len : BlockSize - data;
+            detail::checkRun(check, payload + data, src + len, c);
+            len += c;
+            data += c;
+        }
+        if (data == 0) return 0;
+        if (data < BlockSize) {
+            std::memset(payload + data, detail::CTRLZ, BlockSize - data);
+            detail::checkRun(check, (unsigned char *)nullptr, payload + data, BlockSize - data);
+        }
+        frame[0] = BlockSize == 1024 ? detail::STX : detail::SOH;
+        frame[1] = packetno;
+        frame[2] = (unsigned char)~packetno;
+        check.put(payload + BlockSize);
+        return data;
+    }
+
+    template <Check C, typename Source>
+    int send(Source &source) {
+        using namespace detail;
+        constexpr int frameLen = BlockSize + 3 + Checker<C>::size;
+        unsigned char packetno = 1;
+        int total = 0, data;
+
+        while ((data = fill<C>(source, packetno)) > 0) {
+            total += data;
+            for (int retry = 0; ; ++retry) {
+                if (retry >= session.maxRetrans) {
+                    this->cancel();
+                    return this->flush(xmodemErrorTransmitError);
+                }
+                io.write(frame, frameLen);
+                int c = this->readByte(session.ackTimeout);
+                if (c == ACK) break;
+                if (c == CAN && this->readByte(session.byteTimeout) == CAN) {
+                    this->writeByte(ACK);
+                    return this->flush(xmodemErrorCancelledByRemote);
+                }
+            }
+            ++packetno;
+        }
+        for (int retry = 0; retry < 10; ++retry) {
+            this->writeByte(EOT);
+            if (this->readByte(session.ackTimeout) == ACK) {
+                return this->flush(total);
+            }
+        }
+        return this->flush(xmodemErrorUnexpectedResponse);
+    }
+
+    unsigned char frame[BlockSize + 5];
+    unsigned char const *src = nullptr;
+    int srcsz = 0, len = 0;
+};
+
+/**
+ * Receives packets of up to MaxBlockSize bytes, asking for check C. A receiver asking for the CRC falls back to the
+ * checksum after session.syncRetries unanswered requests, as xmodemReceive does. With a MaxBlockSize of 128, 1K
+ * packets are NAKed, as with XMODEM_128_ONLY.
+ */
+template <Check C, typename Io, int MaxBlockSize = XMODEM_MAX_BLOCK_SIZE>
+class Receiver : detail::Link<Io> {
+    static_assert(MaxBlockSize == 128 || MaxBlockSize == 1024, "XMODEM packets are 128 or 1024 bytes");
+
+    using Base = detail::Link<Io>;
+    using Base::session;
+    using Base::io;
+
+public:
+    /**
+     * @param session The timeouts and retry limits
+     * @param io The link, which must outlive the receiver
+     */
+    Receiver(xmodemSession const &session, Io &io) : Base(session, io) {}
+
+    /**
+     * Receive data
+     * @param sink Returns each application buffer in turn, as for xmodemReceive
+     * @return If 0 or positive, the length of received data. If negative, a xmodemError
+     */
+    template <typename Sink>
+    int run(Sink &&sink) {
+        using namespace detail;
+        unsigned char trychar = Checker<C>::request;
+        int retry = 0;
+        for (;;) {
+            if (retry >= session.syncRetries) {
+                if (trychar != 'C') {
+                    return cancelled(xmodemErrorNoSync);
+                }
+                trychar = NAK;
+                retry = 0;
+            }
+            this->writeByte(trychar);
+            int c = this->readByte(session.syncTimeout);
+            if (startByte(c)) {
+                packet[0] = (unsigned char)c;
+                return start(sink, trychar, 1);
+            }
+            if (c == STX) {
+                /* no room for a 1K packet: drain it and NAK, so an adaptive transmitter falls back to 128 bytes */
+                if (resync()) {
+                    return start(sink, trychar, 3);
+                }
+                this->writeByte(NAK);
+                retry = 0;
+                continue;
+            }
+            if (c == EOT) {
+                return acknowledged(xmodemErrorUnexpectedResponse);
+            }
+            if (c == CAN && this->readByte(session.byteTimeout) == CAN) {
+                return acknowledged(xmodemErrorCancelledByRemote);
+            }
+            ++retry;
+        }
+    }
+
+private:
+    enum class State { packet, wait, resync };
+
+    static bool startByte(int c) {
+        return c == detail::SOH || (MaxBlockSize == 1024 && c == detail::STX);
+    }
+
+    /* whether a header names the expected packet, or the one before whose acknowledgement may have been lost */
+    bool headerValid() const {
+        unsigned char behind = (unsigned char)(packetno - packet[1]);
+        return packet[1] == (unsigned char)~packet[2] && (behind == 0 || behind == 1);
+    }
+
+    /* the first packet, with the check asked for by trychar */
+    template <typename Sink>
+    int start(Sink &sink, unsigned char trychar, int pos) {
+        if constexpr (C == Check::crc) {
+            if (trychar == detail::NAK) return receive<Check::checksum>(sink, pos);
+        }
+        return receive<C>(sink, pos);
+    }
+
+    /*
+     * drain the rest of a bad packet until the line is quiet, returns false then. A header for the expected packet or
+     * the one before restarts reception at once, returning true with it in packet.
+     */
+    bool resync() {
+        int c, seen = 0;
+        while ((c = this->readByte(session.flushTimeout)) >= 0) {
+            packet[0] = packet[1];
+            packet[1] = packet[2];
+            packet[2] = (unsigned char)c;
+            if (seen < 3) ++seen;
+            if (seen == 3 && startByte(packet[0]) && headerValid()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* the rest of a packet whose first pos bytes are in, returns false if the line goes quiet first */
+    bool complete(int pos, int need) {
+        while (pos < need) {
+            int n = io.read(packet + pos, need - pos, session.byteTimeout);
+            if (n <= 0) return false;
+            pos += n;
+        }
+        return true;
+    }
+
+    template <Check K, int BlockSize>
+    bool verify() const {
+        detail::Checker<K> check;
+        detail::checkRun(check, (unsigned char *)nullptr, packet + 3, BlockSize);
+        return check.matches(packet + 3 + BlockSize);
+    }
+
+    /* copy a packet into the application buffers, returns false if they are full */
+    template <typename Sink>
+    bool store(Sink &sink, unsigned char const *buf, int n) {
+        while (n > 0) {
+            if (len >= destsz) {
+                dest = sink(&destsz);
+                len = 0;
+                if (dest == nullptr || destsz == 0) return false;
+            }
+            int c = destsz - len < n ? destsz - len : n;
+            std::memcpy(dest + len, buf, c);
+            buf += c;
+            n -= c;
+            len += c;
+        }
+        return true;
+    }
+
+    int acknowledged(int result) {
+        result = this->flush(result);
+        this->writeByte(detail::ACK);
+        return result;
+    }
+
+    int cancelled(int result) {
+        result = this->flush(result);
+        this->cancel();
+        return result;
+    }
+
+    /* the packets from the first, whose first pos bytes are in packet */
+    template <Check K, typename Sink>
+    int receive(Sink &sink, int pos) {
+        using namespace detail;
+        constexpr int trailer = Checker<K>::size;
+        State state = State::packet;
+        int retry = 0, retrans = session.maxRetrans;
+        long total = 0;
+        int pad = 0;
+
+        for (;;) {
+            switch (state) {
+            case State::packet: {
+                int bufsz = packet[0] == STX ? 1024 : 128;
+                if (!complete(pos, bufsz + 3 + trailer) || !headerValid() ||
+                    !(bufsz == 1024 ? verify<K, MaxBlockSize>() : verify<K, 128>())) {
+                    state = State::resync;
+                    break;
+                }
+                if (packet[1] == packetno) {
+                    if (!store(sink, packet + 3, bufsz)) {
+                        this->cancel();
+                        return cancelled(xmodemErrorBufferFull);
+                    }
+                    total += bufsz;
+                    pad = padding(packet + 3, bufsz);
+                    ++packetno;
+                    retrans = session.maxRetrans + 1;
+                }
+                if (--retrans <= 0) {
+                    return cancelled(xmodemErrorTooManyRetries);
+                }
+                this->writeByte(ACK);
+                retry = 0;
+                state = State::wait;
+                break;
+            }
+            case State::wait: {
+                if (retry >= session.syncRetries) {
+                    return cancelled(xmodemErrorNoSync);
+                }
+                int c = this->readByte(session.syncTimeout);
+                if (startByte(c)) {
+                    packet[0] = (unsigned char)c;
+                    pos = 1;
+                    state = State::packet;
+                } else if (c == EOT) {
+                    return acknowledged(total - pad == 0 ? xmodemErrorUnexpectedResponse : (int)(total - pad));
+                } else if (c == CAN) {
+                    if (this->readByte(session.byteTimeout) == CAN) {
+                        return acknowledged(xmodemErrorCancelledByRemote);
+                    }
+                    ++retry;
+                } else if (c < 0) {
+                    ++retry;
+                } else {
+                    /* the start of a packet was lost or corrupted */
+                    state = State::resync;
+                }
+                break;
+            }
+            case State::resync:
+                if (resync()) {
+                    pos = 3;
+                    state = State::packet;
+                } else {
+                    this->writeByte(NAK);
+                    retry = 0;
+                    state = State::wait;
+                }
+                break;
+            }
+        }
+    }
+
+    unsigned char packet[MaxBlockSize + 5];
+    unsigned char packetno = 1;
+    unsigned char *dest = nullptr;
+    int destsz = 0, len = 0;
+};
+
+} // namespace xmodem
+
+#endif //XMODEM_HPP
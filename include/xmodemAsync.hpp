@@ -0,0 +1,192 @@
+//
+// C++20 coroutine transfers: co_await xmodem::transmit(stream, session, callback)
+//
+
+#ifndef XMODEM_ASYNC_HPP
+#define XMODEM_ASYNC_HPP
+
+#include <concepts>
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include "xmodem.h"
+
+/*
+ * The transfers of xmodemTransmitEx and xmodemReceiveEx as coroutines, which suspend while waiting for input or for
+ * room to write rather than blocking a thread, so a few threads can run thousands of transfers. They drive an
+ * xmodemEngine as the blocking functions do, through a stream with the members
+ *     Awaitable<int> read(unsigned char *buf, int len, long timeout);
+ *     Awaitable<int> write(unsigned char const *buf, int len);
+ *     unsigned long now();
+ * read completing with the number of bytes received, up to len, or 0 if none arrived within timeout ms (negative for
+ * no timeout), and write with the number of bytes written, or negative if the stream has failed, which ends the
+ * transfer with xmodemErrorLinkFailed. The awaitables may be anything a coroutine can co_await, so a stream can wrap
+ * the completion handlers of an asio socket or serial port as well as the event loop of host/xmodemEventLoop.hpp.
+ * now is the time in ms.
+ *
+ * The transfer runs in the thread that resumes it, which calls the buffer callbacks and any session callbacks.
+ */
+
+namespace xmodem {
+
+/**
+ * A coroutine completing with a T. It starts when first awaited, or on start(), and is destroyed with the Task.
+ */
+template <typename T>
+class Task {
+public:
+    struct promise_type {
+        T value{};
+        std::coroutine_handle<> continuation = std::noop_coroutine();
+
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+        auto final_suspend() noexcept {
+            /* resume the awaiting coroutine, if any, without growing the stack */
+            struct Final {
+                bool await_ready() noexcept {
+                    return false;
+                }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                    return h.promise().continuation;
+                }
+                void await_resume() noexcept {}
+            };
+            return Final{};
+        }
+        void return_value(T v) {
+            value = std::move(v);
+        }
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+    Task(Task &&other) noexcept : coro(std::exchange(other.coro, nullptr)) {}
+    Task &operator=(Task &&other) noexcept {
+        std::swap(coro, other.coro);
+        return *this;
+    }
+    Task(Task const &) = delete;
+    Task &operator=(Task const &) = delete;
+    ~Task() {
+        if (coro) coro.destroy();
+    }
+
+    bool await_ready() const noexcept {
+        return coro.done();
+    }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        coro.promise().continuation = awaiting;
+        return coro;
+    }
+    T await_resume() {
+        return std::move(coro.promise().value);
+    }
+
+    /** Run the coroutine up to its first suspension, for a transfer nothing awaits */
+    void start() {
+        coro.resume();
+    }
+
+    /** @return Whether the coroutine has completed */
+    bool done() const {
+        return coro.done();
+    }
+
+    /** @return The value the coroutine completed with, once done */
+    T const &result() const {
+        return coro.promise().value;
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> coro) : coro(coro) {}
+
+    std::coroutine_handle<promise_type> coro;
+};
+
+template <typename S>
+concept Stream = requires(S &s, unsigned char *in, unsigned char const *out, int len, long timeout) {
+    s.read(in, len, timeout);
+    s.write(out, len);
+    { s.now() } -> std::convertible_to<unsigned long>;
+};
+
+namespace detail {
+
+/* drive an engine with a stream, as run() in xmodem.c does with the blocking I/O functions */
+template <Stream S>
+Task<int> run(S &stream, xmodemEngine &e) {
+    unsigned char const *out;
+    unsigned char *in;
+    int n;
+
+    for (;;) {
+        while ((n = xmodemEnginePollOutput(&e, &out)) > 0) {
+            int sent = co_await stream.write(out, n);
+            xmodemEngineTick(&e, stream.now());
+            if (sent < 0) {
+                /* the stream has failed, so retrying would only wait out the timeouts */
+                xmodemEngineAbort(&e, xmodemErrorLinkFailed);
+                break;
+            }
+            /* what a short write leaves goes out on the next pass, once the stream has waited for room again */
+            xmodemEngineOutputSent(&e, sent);
+        }
+        if (xmodemEngineDone(&e)) {
+            if (e.session->stats) {
+                *e.session->stats = *xmodemEngineStats(&e);
+            }
+            co_return xmodemEngineResult(&e);
+        }
+        long timeout = xmodemEngineTimeout(&e);
+        n = xmodemEngineInputBuffer(&e, &in);
+        n = co_await stream.read(in, n, timeout);
+        if (n > 0) {
+            xmodemEngineInputReceived(&e, n);
+        }
+        xmodemEngineTick(&e, stream.now());
+    }
+}
+
+} // namespace detail
+
+/**
+ * Transmit data
+ * @param stream The link, which must outlive the transfer
+ * @param session The timeouts, retry limits and callbacks, as for xmodemTransmitEx; the I/O functions are not used.
+ *                Must outlive the transfer.
+ * @param getBufferCallback As for xmodemTransmitEx
+ * @return A task completing with the size of data sent, or a negative xmodemError
+ */
+template <Stream S>
+Task<int> transmit(S &stream, xmodemSession const &session,
+                   unsigned char const * (*getBufferCallback)(void *user, int *size)) {
+    xmodemEngine engine;
+    xmodemEngineInitTransmit(&engine, &session, getBufferCallback, stream.now());
+    co_return co_await detail::run(stream, engine);
+}
+
+/**
+ * Receive data
+ * @param stream The link, which must outlive the transfer
+ * @param session The timeouts, retry limits and callbacks, as for xmodemReceiveEx; the I/O functions are not used.
+ *                Must outlive the transfer.
+ * @param getBufferCallback As for xmodemReceiveEx
+ * @return A task completing with the length of data received, or a negative xmodemError
+ */
+template <Stream S>
+Task<int> receive(S &stream, xmodemSession const &session,
+                  unsigned char * (*getBufferCallback)(void *user, int *size)) {
+    xmodemEngine engine;
+    xmodemEngineInitReceive(&engine, &session, getBufferCallback, stream.now());
+    co_return co_await detail::run(stream, engine);
+}
+
+} // namespace xmodem
+
+#endif //XMODEM_ASYNC_HPP
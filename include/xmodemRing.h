@@ -0,0 +1,131 @@
+//
+// A lock-free single-producer single-consumer byte ring, for passing UART data between interrupt handlers and a
+// transfer, with I/O functions for a session on top of it
+//
+
+#ifndef XMODEM_RING_H
+#define XMODEM_RING_H
+
+#include "xmodem.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * One side only pushes and the other only pops, such as a receive interrupt pushing and xmodemReceiveEx popping, so
+ * neither needs a lock or to disable interrupts. Each index is written by one side alone and published with a
+ * release store once the bytes it covers are in place. With GCC or Clang the indices use the __atomic builtins, so
+ * the ring also works between threads on separate cores; other compilers get volatile accesses, which are enough
+ * between an interrupt handler and the code it interrupts on a single core.
+ */
+
+#ifndef XMODEM_RING_OUTPUT_WAIT
+#define XMODEM_RING_OUTPUT_WAIT 10 /* ms passed to the wait hook while output waits for room */
+#endif
+
+/**
+ * A ring over a buffer of the caller's. The fields are private.
+ */
+typedef struct xmodemRing {
+    unsigned char *buf;
+    unsigned int mask;
+    /* free running; head is written by the producer only, tail by the consumer only */
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    /** Bytes refused by xmodemRingPushByte as the ring was full, counted by the producer */
+    volatile unsigned long overruns;
+} xmodemRing;
+
+/**
+ * Initialise an empty ring. Not safe while either side is using it.
+ * @param ring The ring
+ * @param buf The storage
+ * @param size The size of buf, a power of two
+ * @return 0, or -1 if size is not a power of two
+ */
+int xmodemRingInit(xmodemRing *ring, unsigned char *buf, unsigned int size);
+
+/**
+ * Producer: add bytes, as many as there is room for
+ * @return The number of bytes added
+ */
+int xmodemRingPush(xmodemRing *ring, unsigned char const *data, int len);
+
+/**
+ * Producer: add a byte, such as from a receive interrupt
+ * @return 1, or 0 if the ring is full and the byte was dropped and counted in overruns
+ */
+int xmodemRingPushByte(xmodemRing *ring, unsigned char c);
+
+/**
+ * Consumer: take bytes, as many as there are up to len
+ * @return The number of bytes taken
+ */
+int xmodemRingPop(xmodemRing *ring, unsigned char *buf, int len);
+
+/**
+ * Consumer: take a byte, such as for a transmit interrupt
+ * @return 1, or 0 if the ring is empty
+ */
+int xmodemRingPopByte(xmodemRing *ring, unsigned char *c);
+
+/**
+ * @return The number of bytes in the ring, exact for the consumer and a lower bound for the producer
+ */
+unsigned int xmodemRingCount(xmodemRing const *ring);
+
+/**
+ * @return The room in the ring, exact for the producer and a lower bound for the consumer
+ */
+unsigned int xmodemRingSpace(xmodemRing const *ring);
+
+/**
+ * The rings of a UART and how to wait on them, for a session's I/O functions. Pass it as the session user pointer,
+ * which the buffer callbacks also get, so an application wanting its own state there can put this at its start.
+ */
+typedef struct xmodemRingLink {
+    /** Filled by the receive interrupt, emptied by the transfer */
+    xmodemRing *rx;
+    /** Filled by the transfer, emptied by the transmit interrupt */
+    xmodemRing *tx;
+    /**
+     * Wait until woken, such as by an interrupt or a semaphore the interrupt gives, or until timeout ms have passed.
+     * Called while input is awaited with the rest of its timeout, and while output waits for room. Required unless
+     * the session has a clock: without it input returns at once, and output spins until there is room.
+     * @param user The user pointer of the link
+     * @param timeout The longest wait, in ms
+     * @return The time that passed, in ms
+     */
+    unsigned short (*wait)(void *user, unsigned short timeout);
+    /**
+     * Optional: called once output has been added to tx, to start the transmitter, such as by enabling the
+     * transmit interrupt
+     * @param user The user pointer of the link
+     */
+    void (*kick)(void *user);
+    /** Passed to wait and kick */
+    void *user;
+} xmodemRingLink;
+
+/**
+ * Set the I/O functions and user pointer of a session to use a link. Set the session clock first if the link has no
+ * wait hook: the blocking transfers keep time by the timeouts they wait out, so without either each empty poll of the
+ * ring would count as a whole timeout passing, and the retries would run out before the UART delivers anything.
+ * @param session The session
+ * @param link The link, which must outlive the transfers
+ * @return 0, or -1 if the link has no wait hook and the session no clock
+ */
+int xmodemRingSession(xmodemSession *session, xmodemRingLink *link);
+
+/* the I/O functions of xmodemSession over a link, which is the session user pointer */
+int xmodemRingInByte(void *link, unsigned short timeout);
+void xmodemRingOutByte(void *link, unsigned char c);
+int xmodemRingInBlock(void *link, unsigned char *buf, int len, unsigned short timeout);
+void xmodemRingOutBlock(void *link, unsigned char const *buf, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //XMODEM_RING_H
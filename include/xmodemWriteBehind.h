@@ -0,0 +1,120 @@
+//
+// A write-behind receive pipeline: received buffers are committed to storage asynchronously while reception goes on
+//
+
+#ifndef XMODEM_WRITE_BEHIND_H
+#define XMODEM_WRITE_BEHIND_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A receiver asks for its next buffer once the last is full, and acknowledges the packet once it is stored, so an
+ * application writing each buffer to flash within getBufferCallback holds up the transmitter for the whole erase and
+ * program time. Here the receiver takes buffers in turn from a set of equal ones instead. Each full buffer is handed
+ * to a commit callback, which starts writing it and returns at once, and the next buffer is returned straight away.
+ * Once a write completes, xmodemWriteBehindDone frees its buffer, from another thread or an interrupt. The receiver
+ * only waits when the next buffer is still being written, so the writes overlap reception.
+ *
+ *     xmodemWriteBehindInit(&wb, storage, 4096, 4);
+ *     wb.commit = startFlashWrite;       // calls xmodemWriteBehindDone from the flash done interrupt
+ *     result = xmodemReceiveEx(&session, getBuffer);  // getBuffer returns xmodemWriteBehindGetBuffer(&wb, size)
+ *     xmodemWriteBehindEnd(&wb, result >= 0 ? result : lastCheckpoint);
+ *     if (xmodemWriteBehindSync(&wb) < 0) ...
+ *
+ * Buffers of a multiple of the block size keep packets from spanning buffers, so the padding of the last packet
+ * stays in the last buffer, which is committed with the length of the data alone.
+ */
+
+#ifndef XMODEM_WRITE_BEHIND_MAX_BUFFERS
+#define XMODEM_WRITE_BEHIND_MAX_BUFFERS 8
+#endif
+
+#ifndef XMODEM_WRITE_BEHIND_WAIT
+#define XMODEM_WRITE_BEHIND_WAIT 10 /* ms passed to the wait hook while waiting for a buffer */
+#endif
+
+typedef struct xmodemWriteBehind {
+    /**
+     * Start writing a buffer, such as by queueing a flash write, and return. Call xmodemWriteBehindDone once it is
+     * written, which may also be from within commit.
+     * @param user The user pointer
+     * @param buf The buffer, which is not used again until done
+     * @param len The length of data in it
+     * @param offset The offset of the data from the start of the first buffer of the stream or file
+     */
+    void (*commit)(void *user, unsigned char *buf, int len, long offset);
+    /**
+     * Optional: wait until woken, such as by the interrupt that completes a write, or until timeout ms have passed.
+     * Without it the receiver spins while every buffer is being written.
+     * @return The time that passed, in ms
+     */
+    unsigned short (*wait)(void *user, unsigned short timeout);
+    /** Passed to commit and wait */
+    void *user;
+    /**
+     * Optional: the longest wait for a buffer, in ms as the wait hook reports, after which the transfer is cancelled;
+     * 0 for no limit
+     */
+    unsigned long waitLimit;
+
+    /* private */
+    unsigned char *storage;
+    int bufsz;
+    int count;
+    int next;
+    int current;
+    long handed;
+    volatile int failed;
+    volatile unsigned char busy[XMODEM_WRITE_BEHIND_MAX_BUFFERS];
+} xmodemWriteBehind;
+
+/**
+ * Initialise a pipeline with no callbacks
+ * @param wb The pipeline
+ * @param storage count buffers of size bytes each, one after another
+ * @param size The size of each buffer
+ * @param count The number of buffers, from 1 to XMODEM_WRITE_BEHIND_MAX_BUFFERS; 2 or more to overlap writes
+ * @return 0, or -1 if size or count is out of range
+ */
+int xmodemWriteBehindInit(xmodemWriteBehind *wb, unsigned char *storage, int size, int count);
+
+/**
+ * The receive getBufferCallback: commits the buffer the receiver has filled, if any, and returns the next, waiting
+ * for its write to complete if need be.
+ * @param writeBehind The pipeline
+ * @param size Set to the size of the buffer
+ * @return The buffer, or NULL if a write has failed or waitLimit has passed, which cancels the transfer
+ */
+unsigned char *xmodemWriteBehindGetBuffer(void *writeBehind, int *size);
+
+/**
+ * Note that a write is complete, freeing its buffer. Safe from another thread or an interrupt.
+ * @param wb The pipeline
+ * @param buf The buffer passed to commit
+ * @param failed Non-zero if the write failed, which cancels the transfer at its next buffer
+ */
+void xmodemWriteBehindDone(xmodemWriteBehind *wb, unsigned char *buf, int failed);
+
+/**
+ * Commit the data in the last buffer of a stream, and start afresh for the next. Call once xmodemReceiveEx returns,
+ * or from the fileEndCallback of each file of a batch.
+ * @param wb The pipeline
+ * @param length The length of the stream: the result of xmodemReceiveEx less any resumeFrom, the file length passed
+ *               to fileEndCallback, or after a failure the offset of the last checkpoint less any resumeFrom
+ */
+void xmodemWriteBehindEnd(xmodemWriteBehind *wb, long length);
+
+/**
+ * Wait for the writes in progress to complete, within waitLimit
+ * @param wb The pipeline
+ * @return 0 if every write completed, -1 if one failed or waitLimit passed
+ */
+int xmodemWriteBehindSync(xmodemWriteBehind *wb);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //XMODEM_WRITE_BEHIND_H
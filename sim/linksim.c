@@ -0,0 +1,198 @@
+/*
+ * A simulated serial link for driving transfer engines in virtual time.
+ *
+ * Each direction sends bytes one after another at the line rate from a
+ * transmit FIFO. Output is taken from an engine as the FIFO has room, so
+ * an engine's timeouts start about when its last bytes go on the line, as
+ * with a real UART. Bytes may be lost or have a bit flipped, from a seeded
+ * generator, and arrive after the latency. Time jumps from one event to
+ * the next, so a run takes no longer than the work it does.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "linksim.h"
+
+#define LINKSIM_DEFAULT_FIFO 16
+
+/* xorshift64* */
+static unsigned long long rngNext(unsigned long long *state)
+{
+    unsigned long long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double rngUniform(unsigned long long *state)
+{
+    return (rngNext(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void channelInit(linksimChannel *ch, linksimConfig const *config, unsigned long long seed)
+{
+    memset(ch, 0, sizeof(*ch));
+    ch->config = *config;
+    if (ch->config.fifo <= 0) {
+        ch->config.fifo = LINKSIM_DEFAULT_FIFO;
+    }
+    ch->byteTime = config->baud ? 10000000ULL / config->baud : 0;
+    ch->rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+static void push(linksimChannel *ch, unsigned long long arrival, unsigned char c)
+{
+    if (ch->count == ch->capacity) {
+        int capacity = ch->capacity ? ch->capacity * 2 : 4096;
+        linksimByte *queue = malloc(capacity * sizeof(*queue));
+        int i;
+        for (i = 0; i < ch->count; ++i) {
+            queue[i] = ch->queue[(ch->head + i) % ch->capacity];
+        }
+        free(ch->queue);
+        ch->queue = queue;
+        ch->capacity = capacity;
+        ch->head = 0;
+    }
+    ch->queue[(ch->head + ch->count) % ch->capacity].arrival = arrival;
+    ch->queue[(ch->head + ch->count) % ch->capacity].c = c;
+    ++ch->count;
+}
+
+/* the bytes in the FIFO that have not yet gone on the line */
+static int fifoUsed(linksimChannel const *ch, unsigned long long now)
+{
+    if (ch->byteTime == 0 || ch->busyUntil <= now) {
+        return 0;
+    }
+    return (int)((ch->busyUntil - now + ch->byteTime - 1) / ch->byteTime);
+}
+
+/* move output from an engine into the FIFO as far as it has room */
+static int pump(linksim *sim, linksimChannel *ch, xmodemEngine *e)
+{
+    unsigned char const *data;
+    int n, room, i, moved = 0;
+
+    while ((n = xmodemEnginePollOutput(e, &data)) > 0 && (room = ch->config.fifo - fifoUsed(ch, sim->now)) > 0) {
+        if (n > room) n = room;
+        for (i = 0; i < n; ++i) {
+            unsigned char c = data[i];
+            ch->busyUntil = (ch->busyUntil > sim->now ? ch->busyUntil : sim->now) + ch->byteTime;
+            ++ch->counts.bytes;
+            if (ch->config.lossRate > 0 && rngUniform(&ch->rng) < ch->config.lossRate) {
+                ++ch->counts.lost;
+                continue;
+            }
+            if (ch->config.corruptRate > 0 && rngUniform(&ch->rng) < ch->config.corruptRate) {
+                c ^= 1 << (rngNext(&ch->rng) % 8);
+                ++ch->counts.corrupted;
+            }
+            push(ch, ch->busyUntil + ch->config.latency * 1000ULL, c);
+        }
+        xmodemEngineOutputSent(e, n);
+        moved += n;
+    }
+    return moved;
+}
+
+/* feed an engine the bytes that have arrived; those arriving after it is done are dropped */
+static int deliver(linksim *sim, linksimChannel *ch, xmodemEngine *e)
+{
+    unsigned char buf[256];
+    int n = 0, moved = 0;
+
+    while (ch->count > 0 && ch->queue[ch->head].arrival <= sim->now) {
+        buf[n++] = ch->queue[ch->head].c;
+        ch->head = (ch->head + 1) % ch->capacity;
+        --ch->count;
+        if (n == (int)sizeof(buf)) {
+            xmodemEngineFeed(e, buf, n);
+            moved += n;
+            n = 0;
+        }
+    }
+    if (n > 0) {
+        xmodemEngineFeed(e, buf, n);
+        moved += n;
+    }
+    return moved;
+}
+
+void linksimInit(linksim *sim, linksimConfig const *aToB, linksimConfig const *bToA, unsigned long seed)
+{
+    memset(sim, 0, sizeof(*sim));
+    channelInit(&sim->channel[0], aToB, seed);
+    channelInit(&sim->channel[1], bToA, ~(unsigned long long)seed);
+}
+
+void linksimFree(linksim *sim)
+{
+    free(sim->channel[0].queue);
+    free(sim->channel[1].queue);
+    sim->channel[0].queue = sim->channel[1].queue = NULL;
+    sim->channel[0].capacity = sim->channel[1].capacity = 0;
+    sim->channel[0].count = sim->channel[1].count = 0;
+}
+
+int linksimRun(linksim *sim, xmodemEngine *a, xmodemEngine *b, unsigned long limit)
+{
+    xmodemEngine *engine[2];
+    unsigned long long end = sim->now + limit * 1000ULL, next, t;
+    unsigned char const *data;
+    int i, progress;
+    long timeout;
+
+    engine[0] = a;
+    engine[1] = b;
+    for (;;) {
+        do {
+            progress = 0;
+            for (i = 0; i < 2; ++i) {
+                progress |= deliver(sim, &sim->channel[i], engine[1 - i]) > 0;
+                progress |= pump(sim, &sim->channel[i], engine[i]) > 0;
+            }
+        } while (progress);
+        if (xmodemEngineDone(a) && xmodemEngineDone(b)) {
+            return 0;
+        }
+
+        /* jump to the next event: a timeout, an arrival or room in a FIFO for pending output */
+        next = ULLONG_MAX;
+        for (i = 0; i < 2; ++i) {
+            linksimChannel *ch = &sim->channel[i];
+            if ((timeout = xmodemEngineTimeout(engine[i])) >= 0) {
+                t = ((unsigned long long)linksimNow(sim) + timeout) * 1000ULL;
+                if (t <= sim->now) t = sim->now + 1;
+                if (t < next) next = t;
+            }
+            if (ch->count > 0 && ch->queue[ch->head].arrival < next) {
+                next = ch->queue[ch->head].arrival;
+            }
+            if (xmodemEnginePollOutput(engine[i], &data) > 0) {
+                t = ch->busyUntil - (ch->config.fifo - 1) * ch->byteTime;
+                if (t < next) next = t;
+            }
+        }
+        if (next == ULLONG_MAX || next > end) {
+            sim->now = end;
+            return -1;
+        }
+        sim->now = next;
+        xmodemEngineTick(a, linksimNow(sim));
+        xmodemEngineTick(b, linksimNow(sim));
+    }
+}
+
+unsigned long linksimNow(linksim const *sim)
+{
+    return (unsigned long)(sim->now / 1000);
+}
+
+linksimCounts const *linksimGetCounts(linksim const *sim, int direction)
+{
+    return &sim->channel[direction].counts;
+}
@@ -0,0 +1,105 @@
+//
+// A simulated serial link for driving transfer engines in virtual time
+//
+
+#ifndef LINKSIM_H
+#define LINKSIM_H
+
+#include "xmodem.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The properties of one direction of a link
+ */
+typedef struct linksimConfig {
+    /** Line rate in bits per second, with 10 bits per byte; 0 for a link that takes no time to send */
+    unsigned long baud;
+    /** Time for a byte to arrive once it has been sent, in ms */
+    unsigned long latency;
+    /** Bytes the sender's transmit FIFO holds. Output counts as sent once it is in the FIFO; 0 for 16 */
+    int fifo;
+    /** Probability of each byte being lost */
+    double lossRate;
+    /** Probability of each byte arriving with one bit flipped */
+    double corruptRate;
+} linksimConfig;
+
+/**
+ * The counts of one direction of a link
+ */
+typedef struct linksimCounts {
+    long bytes;
+    long lost;
+    long corrupted;
+} linksimCounts;
+
+typedef struct linksimByte {
+    unsigned long long arrival; /* us */
+    unsigned char c;
+} linksimByte;
+
+typedef struct linksimChannel {
+    linksimConfig config;
+    unsigned long long byteTime; /* us */
+    unsigned long long busyUntil; /* us, when the last byte accepted has been sent */
+    unsigned long long rng;
+    linksimByte *queue;
+    int capacity, head, count;
+    linksimCounts counts;
+} linksimChannel;
+
+/**
+ * A link between two engines. The fields are private.
+ */
+typedef struct linksim {
+    linksimChannel channel[2];
+    unsigned long long now; /* us */
+} linksim;
+
+/**
+ * Set up a link
+ * @param sim The link
+ * @param aToB The direction from the first engine to the second
+ * @param bToA The direction from the second engine to the first
+ * @param seed Seeds the loss and corruption, so a run can be repeated exactly
+ */
+void linksimInit(linksim *sim, linksimConfig const *aToB, linksimConfig const *bToA, unsigned long seed);
+
+/**
+ * Free the memory held by a link
+ * @param sim The link
+ */
+void linksimFree(linksim *sim);
+
+/**
+ * Run two engines connected by the link until both are done. The engines must have been initialised with the link's
+ * current time, linksimNow.
+ * @param sim The link
+ * @param a The engine sending over aToB
+ * @param b The engine sending over bToA
+ * @param limit The longest to run for, in ms of virtual time
+ * @return 0 once both engines are done, negative if the limit was reached first
+ */
+int linksimRun(linksim *sim, xmodemEngine *a, xmodemEngine *b, unsigned long limit);
+
+/**
+ * @param sim The link
+ * @return The virtual time, in ms
+ */
+unsigned long linksimNow(linksim const *sim);
+
+/**
+ * @param sim The link
+ * @param direction 0 for aToB, 1 for bToA
+ * @return The counts of that direction
+ */
+linksimCounts const *linksimGetCounts(linksim const *sim, int direction);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //LINKSIM_H
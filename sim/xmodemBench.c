@@ -0,0 +1,148 @@
+/*
+ * Throughput benchmark: transfers over a simulated link for each transmit
+ * block size across a grid of byte error rates and payload sizes, reporting
+ * goodput in virtual time, retries, and the wall time the run took.
+ *
+ *   xmodemBench [baud [latency_ms [seed]]]
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "linksim.h"
+
+struct buffer {
+    unsigned char *data;
+    int size;
+    int offset;
+};
+
+static unsigned char const *getTxBuffer(void *user, int *size)
+{
+    struct buffer *b = user;
+    if (b->offset == b->size) {
+        return NULL;
+    }
+    *size = b->size - b->offset;
+    b->offset = b->size;
+    return b->data;
+}
+
+static unsigned char *getRxBuffer(void *user, int *size)
+{
+    struct buffer *b = user;
+    if (b->offset == b->size) {
+        return NULL;
+    }
+    *size = b->size - b->offset;
+    b->offset = b->size;
+    return b->data;
+}
+
+static double wallMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct { int blockSize; int adaptive; int adaptiveTimeouts; int compress; char const *name; } modes[] = {
+        { 128, 0, 0, 0, "128" },
+        { 1024, 0, 0, 0, "1K" },
+        { 1024, 1, 0, 0, "1K adaptive" },
+        { 128, 0, 1, 0, "128 rtt" },
+        { 1024, 1, 1, 0, "1K adp rtt" },
+        { 1024, 1, 1, 1, "1K lz" },
+    };
+    static lzEncoder encoder;
+    static lzDecoder decoder;
+    static const double errorRates[] = { 0, 1e-5, 1e-4, 1e-3, 3e-3 };
+    static const int payloads[] = { 4096, 65536, 1048576 };
+    linksimConfig config;
+    unsigned long seed;
+    unsigned i, j, k;
+    int n, maxPayload = 0;
+    unsigned char *data, *output;
+
+    memset(&config, 0, sizeof(config));
+    config.baud = argc > 1 ? strtoul(argv[1], NULL, 0) : 115200;
+    config.latency = argc > 2 ? strtoul(argv[2], NULL, 0) : 2;
+    seed = argc > 3 ? strtoul(argv[3], NULL, 0) : 1;
+
+    for (k = 0; k < sizeof(payloads) / sizeof(payloads[0]); ++k) {
+        if (payloads[k] > maxPayload) maxPayload = payloads[k];
+    }
+    data = malloc(maxPayload);
+    output = malloc(maxPayload + 1024);
+    for (n = 0; n < maxPayload; ++n) {
+        data[n] = (unsigned char)(n * 13 + 5);
+    }
+
+    printf("%lu baud, %lu ms latency, seed %lu\n", config.baud, config.latency, seed);
+    printf("%-12s %9s %9s %8s %10s %11s %6s %8s %11s %9s\n", "block", "errors", "payload", "result",
+           "virtual s", "goodput B/s", "naks", "timeouts", "resent", "wall ms");
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+        for (j = 0; j < sizeof(errorRates) / sizeof(errorRates[0]); ++j) {
+            for (k = 0; k < sizeof(payloads) / sizeof(payloads[0]); ++k) {
+                struct buffer tx = { data, payloads[k], 0 };
+                struct buffer rx = { output, payloads[k] + 1024, 0 };
+                xmodemSession sendSession, receiveSession;
+                xmodemEngine sender, receiver;
+                linksimConfig lossy = config;
+                xmodemStats const *stats;
+                linksim sim;
+                double wall;
+                long goodput;
+                int result;
+
+                lossy.corruptRate = errorRates[j];
+                linksimInit(&sim, &lossy, &lossy, seed);
+                xmodemSessionInit(&sendSession);
+                sendSession.user = &tx;
+                sendSession.blockSize = modes[i].blockSize;
+                sendSession.adaptiveBlockSize = modes[i].adaptive;
+                sendSession.adaptiveTimeouts = modes[i].adaptiveTimeouts;
+                xmodemSessionInit(&receiveSession);
+                receiveSession.user = &rx;
+                receiveSession.adaptiveTimeouts = modes[i].adaptiveTimeouts;
+                if (modes[i].adaptiveTimeouts) {
+                    sendSession.baud = receiveSession.baud = config.baud;
+                }
+                if (modes[i].compress) {
+                    sendSession.encoder = &encoder;
+                    receiveSession.decoder = &decoder;
+                }
+
+                wall = wallMs();
+                xmodemEngineInitTransmit(&sender, &sendSession, getTxBuffer, linksimNow(&sim));
+                xmodemEngineInitReceive(&receiver, &receiveSession, getRxBuffer, linksimNow(&sim));
+                if (linksimRun(&sim, &sender, &receiver, 24UL * 3600 * 1000) < 0) {
+                    result = -100;
+                } else {
+                    result = xmodemEngineResult(&receiver);
+                    if (result == payloads[k] && memcmp(output, data, payloads[k]) != 0) {
+                        result = -101;
+                    }
+                }
+                wall = wallMs() - wall;
+                stats = xmodemEngineStats(&sender);
+                /* a compressing transmitter counts the compressed data, so take the receiver's goodput */
+                goodput = xmodemEngineStats(modes[i].compress ? &receiver : &sender)->goodput;
+
+                printf("%-12s %9g %9d %8s %10.2f %11ld %6d %8d %11ld %9.1f\n", modes[i].name, errorRates[j],
+                       payloads[k], result == payloads[k] ? "ok" : "FAILED", linksimNow(&sim) / 1e3,
+                       result == payloads[k] ? goodput : 0L, stats->naks, stats->timeouts,
+                       stats->retransmittedBytes, wall);
+                linksimFree(&sim);
+            }
+        }
+    }
+    free(data);
+    free(output);
+    return 0;
+}
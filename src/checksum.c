@@ -0,0 +1,195 @@
+/*
+ * The 8 bit additive checksum of XMODEM packets.
+ *
+ * The checksum is the sum of the bytes modulo 256, so the vector
+ * implementations add 16 or 32 bytes at a time in byte lanes, whose
+ * wrapping loses nothing, and only sum the lanes at the end. Each has a
+ * form that also stores what it loads, so a packet can be copied and
+ * checked in one pass.
+ *
+ * Define CHECKSUM_NO_SIMD to build only the byte-at-a-time loop.
+ */
+
+#include <stddef.h>
+#include "../include/checksum.h"
+
+unsigned char checksum8_bytewise(unsigned char cks, const unsigned char *buf, int len)
+{
+    int i;
+    for (i = 0; i < len; ++i) {
+        cks += buf[i];
+    }
+    return cks;
+}
+
+static unsigned char checksum8_copy_bytewise(unsigned char cks, unsigned char *dst, const unsigned char *buf, int len)
+{
+    int i;
+    unsigned char c;
+    for (i = 0; i < len; ++i) {
+        c = buf[i];
+        dst[i] = c;
+        cks += c;
+    }
+    return cks;
+}
+
+#if !defined(CHECKSUM_NO_SIMD) && (defined(__GNUC__) || defined(__clang__))
+#if defined(__x86_64__)
+#define CHECKSUM_X86
+#elif defined(__ARM_NEON)
+#define CHECKSUM_NEON
+#endif
+#endif
+
+#if defined(CHECKSUM_X86) || defined(CHECKSUM_NEON)
+
+/* the checksum continued over buf[i] to buf[len - 1], copying them to dst if set */
+static unsigned char checksum8_tail(unsigned char cks, unsigned char *dst, const unsigned char *buf, int i, int len)
+{
+    if (dst) {
+        return checksum8_copy_bytewise(cks, dst + i, buf + i, len - i);
+    }
+    return checksum8_bytewise(cks, buf + i, len - i);
+}
+
+#endif
+
+#ifdef CHECKSUM_X86
+
+#include <immintrin.h>
+
+/* SSE2 is part of x86-64 */
+static unsigned char checksum8_sse2(unsigned char cks, unsigned char *dst, const unsigned char *buf, int i, int len)
+{
+    __m128i sum = _mm_setzero_si128();
+    __m128i x;
+
+    for (; len - i >= 16; i += 16) {
+        x = _mm_loadu_si128((const __m128i *)(buf + i));
+        if (dst) {
+            _mm_storeu_si128((__m128i *)(dst + i), x);
+        }
+        sum = _mm_add_epi8(sum, x);
+    }
+    /* the sum of absolute differences from zero adds the lanes of each half */
+    sum = _mm_sad_epu8(sum, _mm_setzero_si128());
+    cks += (unsigned char)(_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum)));
+    return checksum8_tail(cks, dst, buf, i, len);
+}
+
+__attribute__((target("avx2")))
+static unsigned char checksum8_avx2(unsigned char cks, unsigned char *dst, const unsigned char *buf, int len)
+{
+    __m256i sum = _mm256_setzero_si256();
+    __m256i x;
+    __m128i half;
+    int i;
+
+    for (i = 0; len - i >= 32; i += 32) {
+        x = _mm256_loadu_si256((const __m256i *)(buf + i));
+        if (dst) {
+            _mm256_storeu_si256((__m256i *)(dst + i), x);
+        }
+        sum = _mm256_add_epi8(sum, x);
+    }
+    half = _mm_sad_epu8(_mm_add_epi8(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1)),
+                        _mm_setzero_si128());
+    cks += (unsigned char)(_mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(half, half)));
+    /* the rest goes to code without VEX encoding, which is slow while the upper halves are in use */
+    _mm256_zeroupper();
+    return checksum8_sse2(cks, dst, buf, i, len);
+}
+
+static int avx2_available(void)
+{
+    /* relaxed atomics, as threads racing to fill it in all store the same value */
+    static int available = -1;
+    int a = __atomic_load_n(&available, __ATOMIC_RELAXED);
+    if (a < 0) {
+        __builtin_cpu_init();
+        a = __builtin_cpu_supports("avx2") ? 1 : 0;
+        __atomic_store_n(&available, a, __ATOMIC_RELAXED);
+    }
+    return a;
+}
+
+static unsigned char checksum8_vector(unsigned char cks, unsigned char *dst, const unsigned char *buf, int len)
+{
+    if (len >= 64 && avx2_available()) {
+        return checksum8_avx2(cks, dst, buf, len);
+    }
+    return checksum8_sse2(cks, dst, buf, 0, len);
+}
+
+int checksum8_simd_available(void)
+{
+    return 1;
+}
+
+#elif defined(CHECKSUM_NEON)
+
+#include <arm_neon.h>
+
+static unsigned char checksum8_vector(unsigned char cks, unsigned char *dst, const unsigned char *buf, int len)
+{
+    uint8x16_t sum = vdupq_n_u8(0);
+    uint8x16_t x;
+    uint64x2_t lanes;
+    int i;
+
+    for (i = 0; len - i >= 16; i += 16) {
+        x = vld1q_u8(buf + i);
+        if (dst) {
+            vst1q_u8(dst + i, x);
+        }
+        sum = vaddq_u8(sum, x);
+    }
+    lanes = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(sum)));
+    cks += (unsigned char)(vgetq_lane_u64(lanes, 0) + vgetq_lane_u64(lanes, 1));
+    return checksum8_tail(cks, dst, buf, i, len);
+}
+
+int checksum8_simd_available(void)
+{
+    return 1;
+}
+
+#else
+
+int checksum8_simd_available(void)
+{
+    return 0;
+}
+
+#endif
+
+unsigned char checksum8_simd(unsigned char cks, const unsigned char *buf, int len)
+{
+#if defined(CHECKSUM_X86) || defined(CHECKSUM_NEON)
+    return checksum8_vector(cks, NULL, buf, len);
+#else
+    return checksum8_bytewise(cks, buf, len);
+#endif
+}
+
+unsigned char checksum8(unsigned char cks, const unsigned char *buf, int len)
+{
+#if defined(CHECKSUM_X86) || defined(CHECKSUM_NEON)
+    /* a few bytes at a time, as they arrive, are quicker without the vector set up */
+    if (len >= 16) {
+        return checksum8_vector(cks, NULL, buf, len);
+    }
+#endif
+    return checksum8_bytewise(cks, buf, len);
+}
+
+unsigned char checksum8_copy(unsigned char cks, unsigned char *dst, const unsigned char *src, int len)
+{
+#if defined(CHECKSUM_X86) || defined(CHECKSUM_NEON)
+    if (len >= 16) {
+        return checksum8_vector(cks, dst, src, len);
+    }
+#endif
+    return checksum8_copy_bytewise(cks, dst, src, len);
+}
@@ -0,0 +1,228 @@
+/*
+ * A small streaming LZSS codec for compressing transfers.
+ *
+ * The compressor keeps recent input in a buffer with hash chains over it,
+ * finding the longest match within the window, and slides the buffer down
+ * once it fills. The decompressor needs only the window of recent output,
+ * so it suits a receiver with little memory.
+ */
+
+#include <string.h>
+#include "../include/lz.h"
+
+#define LZ_MAX_CHAIN 32 /* candidates tried for each match */
+
+static int hash(unsigned char const *p)
+{
+    return ((p[0] << 6) ^ (p[1] << 3) ^ p[2]) & (LZ_HASH_SIZE - 1);
+}
+
+void lzEncoderInit(lzEncoder *z)
+{
+    int i;
+    z->pos = z->end = 0;
+    for (i = 0; i < LZ_HASH_SIZE; ++i) {
+        z->head[i] = -1;
+    }
+    z->groupLen = 1;
+    z->group[0] = 0;
+    z->groupItems = z->groupOff = 0;
+    z->ended = 0;
+    z->in = 0;
+}
+
+/* keep only the window before pos, moving the positions in the chains with it */
+static void slide(lzEncoder *z)
+{
+    int shift = z->pos - LZ_WINDOW;
+    int i;
+    if (shift <= 0) {
+        return;
+    }
+    memmove(z->buf, z->buf + shift, z->end - shift);
+    memmove(z->prev, z->prev + shift, (z->end - shift) * sizeof(z->prev[0]));
+    for (i = 0; i < LZ_HASH_SIZE; ++i) {
+        z->head[i] = z->head[i] >= shift ? (short)(z->head[i] - shift) : -1;
+    }
+    for (i = 0; i < z->end - shift; ++i) {
+        z->prev[i] = z->prev[i] >= shift ? (short)(z->prev[i] - shift) : -1;
+    }
+    z->pos -= shift;
+    z->end -= shift;
+}
+
+int lzEncoderPut(lzEncoder *z, unsigned char const *in, int len)
+{
+    if (z->end + len > LZ_ENCODER_BUFFER) {
+        slide(z);
+    }
+    if (len > LZ_ENCODER_BUFFER - z->end) {
+        len = LZ_ENCODER_BUFFER - z->end;
+    }
+    memcpy(z->buf + z->end, in, len);
+    z->end += len;
+    z->in += len;
+    return len;
+}
+
+static void insert(lzEncoder *z, int pos)
+{
+    int h;
+    if (pos + LZ_MIN_MATCH > z->end) {
+        return;
+    }
+    h = hash(z->buf + pos);
+    z->prev[pos] = z->head[h];
+    z->head[h] = (short)pos;
+}
+
+/* the longest match for the data at pos within the window, returns its length, 0 if none */
+static int longest(lzEncoder const *z, int *offset)
+{
+    int avail = z->end - z->pos;
+    int best = 0, chain = LZ_MAX_CHAIN;
+    int cand, n;
+    unsigned char const *p = z->buf + z->pos;
+
+    if (avail < LZ_MIN_MATCH) {
+        return 0;
+    }
+    if (avail > LZ_MAX_MATCH) {
+        avail = LZ_MAX_MATCH;
+    }
+    for (cand = z->head[hash(p)]; cand >= 0 && z->pos - cand < LZ_WINDOW && chain-- > 0; cand = z->prev[cand]) {
+        unsigned char const *q = z->buf + cand;
+        for (n = 0; n < avail && p[n] == q[n]; ++n) {
+        }
+        if (n > best) {
+            best = n;
+            *offset = z->pos - cand;
+            if (n == avail) {
+                break;
+            }
+        }
+        if (z->prev[cand] >= cand) {
+            break;
+        }
+    }
+    return best >= LZ_MIN_MATCH ? best : 0;
+}
+
+static void item(lzEncoder *z, int literal, unsigned char b0, unsigned char b1)
+{
+    if (literal) {
+        z->group[0] |= 1 << z->groupItems;
+        z->group[z->groupLen++] = b0;
+    } else {
+        z->group[z->groupLen++] = b0;
+        z->group[z->groupLen++] = b1;
+    }
+    ++z->groupItems;
+}
+
+int lzEncoderGet(lzEncoder *z, unsigned char *out, int len, int final)
+{
+    int n = 0, c, offset = 0, match;
+
+    for (;;) {
+        /* a group goes out once its flag byte is complete */
+        if (z->groupItems == 8 || (z->ended && z->groupLen > 1)) {
+            c = z->groupLen - z->groupOff;
+            if (c > len - n) c = len - n;
+            memcpy(out + n, z->group + z->groupOff, c);
+            n += c;
+            z->groupOff += c;
+            if (z->groupOff < z->groupLen) {
+                return n;
+            }
+            z->group[0] = 0;
+            z->groupLen = 1;
+            z->groupItems = z->groupOff = 0;
+        }
+        if (z->ended || n == len) {
+            return n;
+        }
+        if (z->end - z->pos < (final ? 1 : LZ_MAX_MATCH)) {
+            if (!final) {
+                return n;
+            }
+            item(z, 0, 0, 0);
+            z->ended = 1;
+            continue;
+        }
+        match = longest(z, &offset);
+        if (match) {
+            item(z, 0, (unsigned char)offset, (unsigned char)((offset >> 8) | (match - LZ_MIN_MATCH) << 2));
+        } else {
+            match = 1;
+            item(z, 1, z->buf[z->pos], 0);
+        }
+        while (match-- > 0) {
+            insert(z, z->pos++);
+        }
+    }
+}
+
+void lzDecoderInit(lzDecoder *d)
+{
+    memset(d, 0, sizeof(*d));
+}
+
+int lzDecode(lzDecoder *d, unsigned char const *in, int inLen, int *used, unsigned char *out, int outLen)
+{
+    int i = 0, o = 0;
+    unsigned char c;
+
+    while (!d->done) {
+        while (d->remaining > 0 && o < outLen) {
+            c = d->window[(d->pos - d->offset) & (LZ_WINDOW - 1)];
+            out[o++] = c;
+            d->window[d->pos] = c;
+            d->pos = (d->pos + 1) & (LZ_WINDOW - 1);
+            --d->remaining;
+        }
+        if (d->remaining > 0 || i == inLen) {
+            break;
+        }
+        if (d->items == 0) {
+            d->flags = in[i++];
+            d->items = 8;
+        } else if (d->flags & 1) {
+            if (o == outLen) {
+                break;
+            }
+            c = in[i++];
+            out[o++] = c;
+            d->window[d->pos] = c;
+            d->pos = (d->pos + 1) & (LZ_WINDOW - 1);
+            d->flags >>= 1;
+            --d->items;
+        } else if (!d->haveFirst) {
+            d->first = in[i++];
+            d->haveFirst = 1;
+        } else {
+            c = in[i++];
+            d->haveFirst = 0;
+            d->flags >>= 1;
+            --d->items;
+            d->offset = d->first | (c & 3) << 8;
+            d->remaining = (c >> 2) + LZ_MIN_MATCH;
+            if (d->offset == 0) {
+                d->remaining = 0;
+                d->done = 1;
+            }
+        }
+    }
+    *used = i;
+    return o;
+}
+
+int lzDecoderPending(lzDecoder const *d)
+{
+    return d->remaining > 0;
+}
+
+int lzDecoderDone(lzDecoder const *d)
+{
+    return d->done;
+}
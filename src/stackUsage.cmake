@@ -0,0 +1,19 @@
+# Prints the stack frames of 64 bytes or more of the public functions, from the -fstack-usage output under
+# STACK_USAGE_DIR
+file(GLOB_RECURSE usageFiles "${STACK_USAGE_DIR}/*.su")
+if(NOT usageFiles)
+    message("  no stack usage: needs GCC or Clang")
+    return()
+endif()
+foreach(usageFile ${usageFiles})
+    file(STRINGS "${usageFile}" lines REGEX ":(xmodem|lz)[A-Za-z]*\t")
+    foreach(line ${lines})
+        string(REGEX REPLACE "^.*:([A-Za-z]+)\t([0-9]+)\t([a-z,]+)$" "\\1;\\2;\\3" fields "${line}")
+        list(GET fields 0 function)
+        list(GET fields 1 bytes)
+        list(GET fields 2 kind)
+        if(bytes GREATER 63)
+            message("  ${function}: ${bytes} bytes of stack (${kind})")
+        endif()
+    endforeach()
+endforeach()
@@ -26,15 +26,38 @@
  */
 
 /* this code needs standard functions memcpy() and memset()
-   and input/output functions _inbyte() and _outbyte().
+   and input/output functions, supplied per transfer in an xmodemSession:
 
-   the prototypes of the input/output functions are:
-     int xmodemInByte(unsigned short timeout); // msec timeout
-     void xmodemOutByte(int c);
+     int inByte(void *user, unsigned short timeout); // msec timeout
+     void outByte(void *user, unsigned char c);
+
+   optionally, inBlock() and outBlock() may be provided to move a whole
+   frame per call; the byte functions are used when they are NULL:
+     int inBlock(void *user, unsigned char *buf, int len, unsigned short timeout);
+     void outBlock(void *user, unsigned char const *buf, int len);
+
+   xmodemReceive() and xmodemTransmit() use the global xmodemInByte(),
+   xmodemOutByte(), xmodemInBlock() and xmodemOutBlock() functions instead.
+
+   the protocol itself is a non-blocking engine (xmodemEngine) which is fed
+   received bytes, polled for output and ticked with the current time; the
+   blocking functions drive an engine with the I/O functions, keeping time
+   by adding up the timeouts that expire.
+
+   the batch functions speak YMODEM: each file is preceded by packet 0,
+   carrying its name and length as NUL terminated strings, and an empty
+   packet 0 ends the batch.
+
+   compression is asked for with 'Z' in place of 'C', or 'V' in place of
+   'W' to stream as well. The packets then carry an LZSS stream (lz.h)
+   in place of the data, which is ended by its own end marker rather than
+   by padding, and a new stream starts with each file.
 
  */
 
 #include <memory.h>
+#include <string.h>
+#include "../include/checksum.h"
 #include "../include/crc16.h"
 #include "../include/xmodem.h"
 
@@ -51,10 +74,34 @@
 #define XMODEM_BUFF_SIZE_NORMAL 128
 #define XMODEM_BUFF_SIZE_1K 1024
 
-#ifdef XMODEM_TRANSMIT_1K
-#define XMODEM_TRANSMIT_BUFFER_SIZE XMODEM_BUFF_SIZE_1K
-#else
-#define XMODEM_TRANSMIT_BUFFER_SIZE XMODEM_BUFF_SIZE_NORMAL
+#ifndef XMODEM_STREAM_SYNC_RETRIES
+#define XMODEM_STREAM_SYNC_RETRIES 3 /* streaming requests before falling back to plain XMODEM */
+#endif
+
+#define XMODEM_STREAM_MAX_WINDOW 127 /* packet numbers must identify a packet within twice the window */
+
+#ifndef XMODEM_COMPRESS_SYNC_RETRIES
+#define XMODEM_COMPRESS_SYNC_RETRIES 3 /* compression requests before asking for plain packets */
+#endif
+
+#ifndef XMODEM_RESUME_SYNC_RETRIES
+#define XMODEM_RESUME_SYNC_RETRIES 3 /* unanswered resume requests before receiving everything again */
+#endif
+
+#ifndef XMODEM_ADAPTIVE_FALLBACK_RETRIES
+#define XMODEM_ADAPTIVE_FALLBACK_RETRIES 2 /* failed attempts at a 1K packet before falling back to 128 bytes */
+#endif
+
+#ifndef XMODEM_ADAPTIVE_RECOVER_PACKETS
+#define XMODEM_ADAPTIVE_RECOVER_PACKETS 16 /* packets acknowledged first time before returning to 1K */
+#endif
+
+#ifndef XMODEM_ADAPTIVE_MIN_TIMEOUT
+#define XMODEM_ADAPTIVE_MIN_TIMEOUT 10 /* ms, the shortest timeout adaptiveTimeouts may choose */
+#endif
+
+#ifndef XMODEM_QUIET_BYTES
+#define XMODEM_QUIET_BYTES 4 /* byte times of silence that end a bad packet when the line rate is known */
 #endif
 
 #ifndef LOG_ENABLED
@@ -73,375 +120,1841 @@
 #define TXLOG(...)
 #endif
 
-/**
- * Get a received byte
- * @param timeout The timeout, in ms
- * @return The character received, or a negative number for failure
+int (*xmodemInByte)(unsigned short timeout);
+void (*xmodemOutByte)(unsigned char c);
+int (*xmodemInBlock)(unsigned char *buf, int len, unsigned short timeout);
+void (*xmodemOutBlock)(unsigned char const *buf, int len);
+
+static const unsigned char cancelSequence[] = { CAN, CAN, CAN };
+
+void xmodemSessionInit(xmodemSession *session)
+{
+    memset(session, 0, sizeof(*session));
+    session->syncTimeout = DLY_1S << 1;
+    session->ackTimeout = DLY_1S << 1;
+    session->byteTimeout = DLY_1S;
+    session->flushTimeout = (DLY_1S * 3) >> 1;
+    session->syncRetries = 16;
+    session->maxRetrans = XMODEM_MAXRETRANS;
+#ifdef XMODEM_TRANSMIT_1K
+    session->blockSize = XMODEM_BUFF_SIZE_1K;
+#else
+    session->blockSize = XMODEM_BUFF_SIZE_NORMAL;
+#endif
+}
+
+static void outblock(xmodemSession const *s, unsigned char const *buf, int len)
+{
+    if (s->outBlock) {
+        s->outBlock(s->user, buf, len);
+        return;
+    }
+    while (len-- > 0) {
+        s->outByte(s->user, *buf++);
+    }
+}
+
+static unsigned short checkInit(xmodemEngine const *e)
+{
+    return e->crc ? crc16_ccitt_init() : 0;
+}
+
+/* continue a CRC or checksum of packet data over len more bytes */
+static unsigned short checkBlock(xmodemEngine const *e, unsigned short check, const unsigned char *buf, int len)
+{
+    return e->crc ? crc16_ccitt_update(check, buf, len) : checksum8((unsigned char)check, buf, len);
+}
+
+/* copy len bytes of packet data, continuing a CRC or checksum over them in the same pass */
+static unsigned short checkCopy(xmodemEngine const *e, unsigned short check, unsigned char *dst,
+                                const unsigned char *src, int len)
+{
+    return e->crc ? crc16_ccitt_copy(check, dst, src, len) : checksum8_copy((unsigned char)check, dst, src, len);
+}
+
+/* add newly received packet bytes [from, to) to the running CRC or checksum of the data */
+static void checkUpdate(xmodemEngine *e, int from, int to)
+{
+    if (from < 3) from = 3;
+    if (to > 3 + e->bufsz) to = 3 + e->bufsz;
+    if (to <= from) {
+        return;
+    }
+    e->check = checkBlock(e, e->check, e->payload + (from - 3), to - from);
+}
+
+static int check(xmodemEngine const *e)
+{
+    const unsigned char *trailer = e->xbuff + 3 + e->bufsz;
+    if (e->crc) {
+        return crc16_ccitt_final(e->check) == (unsigned short)((trailer[0]<<8)+trailer[1]);
+    }
+    return e->check == trailer[0];
+}
+
+/* engine states */
+enum {
+    stateDone,
+    stateFlush,
+    stateRxSync,
+    stateRxCancel,
+    stateRxPacket,
+    stateRxHunt,
+    stateRxResync,
+    stateRxResume,
+    stateTxSync,
+    stateTxResume,
+    stateTxSyncCancel,
+    stateTxAck,
+    stateTxAckCancel,
+    stateTxEot,
+    stateTxStream
+};
+
+/* what to do once the input has been flushed */
+enum {
+    afterFlushDone,
+    afterFlushAckDone,
+    afterFlushCancelDone
+};
+
+static int outputPending(xmodemEngine const *e)
+{
+    return e->ctlLen > e->ctlOff || e->frameLen > e->frameOff;
+}
+
+static void queue(xmodemEngine *e, unsigned char const *buf, int len)
+{
+    if (e->ctlOff > 0) {
+        memmove(e->ctl, e->ctl + e->ctlOff, e->ctlLen - e->ctlOff);
+        e->ctlLen -= e->ctlOff;
+        e->ctlOff = 0;
+    }
+    while (len-- > 0 && e->ctlLen < (int)sizeof(e->ctl)) {
+        e->ctl[e->ctlLen++] = *buf++;
+    }
+}
+
+static void queueByte(xmodemEngine *e, unsigned char c)
+{
+    queue(e, &c, 1);
+}
+
+/* the deadline of a wait starts once all output has been sent */
+static void arm(xmodemEngine *e)
+{
+    if (e->state != stateDone && !outputPending(e)) {
+        e->deadline = e->now + e->wait;
+        e->armed = 1;
+        e->armedAt = e->now;
+    }
+}
+
+/* Jacobson's estimator over the round trips since the wait was armed, kept in eighths of a ms */
+static void rttSample(xmodemEngine *e)
+{
+    long m = (long)(e->now - e->armedAt) * 8;
+    long err;
+    e->timing = 0;
+    if (!e->armed) {
+        return;
+    }
+    if (e->rttSamples++ == 0) {
+        e->srtt = m;
+        e->rttvar = m / 2;
+    } else {
+        err = m - e->srtt;
+        e->srtt += err / 8;
+        e->rttvar += ((err < 0 ? -err : err) - e->rttvar) / 4;
+    }
+    e->stats.rtt = (unsigned long)(e->srtt + 7) / 8;
+}
+
+/*
+ * a configured timeout, or with adaptive timeouts and a measured round trip some multiple of the usual
+ * srtt + 4 * rttvar within it. Waits for a response allow for the other end timing out on a packet and flushing.
  */
+static unsigned short timeout(xmodemEngine const *e, unsigned short configured, int multiple)
+{
+    long rto;
+    if (!e->session->adaptiveTimeouts || e->rttSamples == 0) {
+        return configured;
+    }
+    rto = (e->srtt + 4 * e->rttvar + 7) / 8;
+    if (rto < XMODEM_ADAPTIVE_MIN_TIMEOUT) {
+        rto = XMODEM_ADAPTIVE_MIN_TIMEOUT;
+    }
+    rto *= multiple;
+    return rto < configured ? (unsigned short)rto : configured;
+}
 
-int (*xmodemInByte)(unsigned short timeout);
-/**
- * Send a byte
- * @param c The byte to send
+/* with the line rate known, a few byte times of silence shows the other end has stopped sending */
+static unsigned short quiet(xmodemEngine const *e, unsigned short wait)
+{
+    unsigned long ms;
+    if (!e->session->baud) {
+        return wait;
+    }
+    /* rounded up, and a ms more as times are only known to the ms */
+    ms = (XMODEM_QUIET_BYTES * 10000UL + e->session->baud - 1) / e->session->baud + 1;
+    return ms < wait ? (unsigned short)ms : wait;
+}
+
+static void waitFor(xmodemEngine *e, int state, unsigned short timeout)
+{
+    e->state = state;
+    e->wait = timeout;
+    e->armed = 0;
+    arm(e);
+}
+
+static void progress(xmodemEngine *e)
+{
+    xmodemStats *st = &e->stats;
+    st->crc = e->crc;
+    st->elapsed = e->now - e->start;
+    st->goodput = 0;
+    if (st->elapsed) {
+        /* in parts, as dataBytes * 1000 may not fit in a long */
+        st->goodput = st->dataBytes / st->elapsed * 1000 + st->dataBytes % st->elapsed * 1000 / st->elapsed;
+    }
+    if (e->session->progress) {
+        e->session->progress(e->session->user, st);
+    }
+}
+
+static void finish(xmodemEngine *e, int result)
+{
+    e->result = result;
+    e->state = stateDone;
+    e->armed = 0;
+    progress(e);
+}
+
+static void flush(xmodemEngine *e, int after, int result)
+{
+    e->afterFlush = after;
+    e->result = result;
+    waitFor(e, stateFlush, quiet(e, timeout(e, e->session->flushTimeout, 1)));
+}
+
+static void rxSync(xmodemEngine *e);
+static void txSync(xmodemEngine *e);
+
+static void flushed(xmodemEngine *e)
+{
+    switch (e->afterFlush) {
+    case afterFlushAckDone:
+        queueByte(e, ACK);
+        break;
+    case afterFlushCancelDone:
+        queue(e, cancelSequence, sizeof(cancelSequence));
+        break;
+    default:
+        break;
+    }
+    finish(e, e->result);
+}
+
+/* find the length of the padding at the end of the last packet, made of CTRLZ optionally followed by NULs */
+static int padding(const unsigned char *buf, int sz)
+{
+    int i;
+    char foundctrlz = 0;
+    for(i = sz-1; i >= 0; i--) {
+        switch(buf[i]) {
+            case 0:
+                if(foundctrlz) {
+                    break;
+                }
+                continue;
+            case CTRLZ:
+                foundctrlz = 1;
+                continue;
+            default:
+                if(!foundctrlz) {
+                    // ctrlz not found, so assume whole buffer is data
+                    i = sz-1;
+                }
+                break;
+        }
+        break;
+    }
+    return sz - i - 1;
+}
+
+/* the request for the data: compressed and streaming as far as the session allows */
+static unsigned char rxRequest(xmodemEngine const *e)
+{
+    int stream = !e->batch && e->session->window > 1;
+    if (e->session->decoder) {
+        return stream ? 'V' : 'Z';
+    }
+    return stream ? 'W' : 'C';
+}
+
+static void rxSync(xmodemEngine *e)
+{
+    if (e->trychar == 'R' && !e->resumeHeard && e->retry >= XMODEM_RESUME_SYNC_RETRIES) {
+        /* not a transmitter that resumes: receive everything, discarding what is already held */
+        RXLOG("Resume not answered");
+        e->trychar = rxRequest(e);
+        e->skip = e->total;
+        e->retry = 0;
+    }
+    if (e->trychar == 'V' && e->retry >= XMODEM_COMPRESS_SYNC_RETRIES) {
+        e->trychar = 'Z';
+        e->retry = 0;
+    }
+    if (e->trychar == 'Z' && e->retry >= XMODEM_COMPRESS_SYNC_RETRIES) {
+        e->trychar = !e->batch && e->session->window > 1 ? 'W' : 'C';
+        e->retry = 0;
+    }
+    if (e->trychar == 'W' && e->retry >= XMODEM_STREAM_SYNC_RETRIES) {
+        e->trychar = 'C';
+        e->retry = 0;
+    }
+    if (e->retry >= e->session->syncRetries) {
+        if (e->trychar == 'C') {
+            e->trychar = NAK;
+            e->retry = 0;
+        } else {
+            RXLOG("No sync");
+            flush(e, afterFlushCancelDone, xmodemErrorNoSync);
+            return;
+        }
+    }
+    if (e->trychar) {
+        RXLOG("try 0x%02X", e->trychar);
+        queueByte(e, e->trychar);
+    }
+    waitFor(e, stateRxSync, e->session->syncTimeout);
+}
+
+/* the transmitter knows the resume request, so tell it where to resume from */
+static void rxResumeOffer(xmodemEngine *e)
+{
+    unsigned char offer[8];
+    int i;
+    RXLOG("Resume from %ld", e->total);
+    for (i = 0; i < 4; ++i) {
+        offer[i] = (unsigned char)(e->total >> (24 - 8 * i));
+        offer[i + 4] = ~offer[i];
+    }
+    e->resumeHeard = 1;
+    queue(e, offer, sizeof(offer));
+    waitFor(e, stateRxResume, timeout(e, e->session->ackTimeout, 3));
+}
+
+static void rxRetry(xmodemEngine *e)
+{
+    RXLOG("Retry %d", e->retry + 1);
+    e->timing = 0;
+    ++e->retry;
+    rxSync(e);
+}
+
+/* streaming responses carry the packet number, so the transmitter can go back to it */
+static void rxStreamRespond(xmodemEngine *e, unsigned char c, unsigned char packetno)
+{
+    unsigned char response[3];
+    response[0] = c;
+    response[1] = packetno;
+    response[2] = ~packetno;
+    if (c == ACK && e->ctlLen - e->ctlOff >= 3 && e->ctl[e->ctlLen - 3] == ACK) {
+        /* not sent yet, and superseded as acknowledgements are cumulative */
+        e->ctlLen -= 3;
+    }
+    queue(e, response, sizeof(response));
+}
+
+/* ask for the stream to restart at the expected packet, and hunt for its header amongst the packets already sent */
+static void rxStreamNak(xmodemEngine *e)
+{
+    RXLOG("NAK %d", e->packetno);
+    ++e->stats.naks;
+    rxStreamRespond(e, NAK, e->packetno);
+    e->pos = 0;
+    waitFor(e, stateRxHunt, e->session->syncTimeout);
+}
+
+/*
+ * drain the rest of a bad packet, NAKing it once the line is quiet. A header for the expected packet or the one
+ * before restarts reception at once, as the transmitter may have timed out and be sending it again.
  */
-void (*xmodemOutByte)(unsigned char c);
+static void rxReject(xmodemEngine *e)
+{
+    if (e->stream) {
+        rxStreamNak(e);
+        return;
+    }
+    e->pos = 0;
+    waitFor(e, stateRxResync, quiet(e, timeout(e, e->session->flushTimeout, 1)));
+}
 
-static int check(int crc, const unsigned char *buf, int sz)
+static void rxResynced(xmodemEngine *e)
 {
-	if (crc) {
-		unsigned short crc = crc16_ccitt(buf, sz);
-		unsigned short tcrc = (buf[sz]<<8)+buf[sz+1];
-		if (crc == tcrc)
-			return 1;
-	}
-	else {
-		int i;
-		unsigned char cks = 0;
-		for (i = 0; i < sz; ++i) {
-			cks += buf[i];
-		}
-		if (cks == buf[sz])
-		return 1;
-	}
+    RXLOG("NAK");
+    ++e->stats.naks;
+    queueByte(e, NAK);
+    e->retry = 0;
+    rxSync(e);
+}
 
-	return 0;
+/* whether a byte starts a packet this build can receive */
+static int rxStartByte(unsigned char c)
+{
+#ifdef XMODEM_128_ONLY
+    return c == SOH;
+#else
+    return c == SOH || c == STX;
+#endif
 }
 
-static void flushinput(void)
+/* whether a header names the expected packet, or one the transmitter may be repeating */
+static int rxHeaderValid(xmodemEngine const *e)
 {
-	while (xmodemInByte(((DLY_1S) * 3) >> 1) >= 0)
-		;
+    /* streaming transmitters may go back further than one packet */
+    unsigned char behind = (unsigned char)(e->packetno - e->xbuff[1]);
+    unsigned char complement = ~e->xbuff[2];
+    return e->xbuff[1] == complement &&
+           (behind == 0 || behind == 1 || (e->stream && behind <= XMODEM_STREAM_MAX_WINDOW));
 }
 
-int xmodemReceive(unsigned char * (*getBufferCallback)(int *size))
+/*
+ * once the header is in, choose where the payload goes: straight into the application buffer when it is the next
+ * packet and fits there whole, else into xbuff to be copied once checked. Only the data before e->len is committed,
+ * so a bad packet written in place is overwritten by its retransmission. A new buffer is only asked for by rxStore,
+ * once a packet is checked, so a bad packet takes no buffer and the application is not asked again after refusing;
+ * the first packet into each buffer is copied.
+ */
+static void rxPayloadTarget(xmodemEngine *e)
+{
+    e->payload = e->xbuff + 3;
+    if (e->xbuff[1] != e->packetno || e->xbuff[2] != (unsigned char)~e->packetno || (e->batch && e->packetno == 0)) {
+        return;
+    }
+    if ((e->size >= 0 && e->size - e->total < e->bufsz) || e->skip > 0 || e->compress) {
+        return;
+    }
+    if (e->destsz - e->len >= e->bufsz) {
+        e->payload = e->dest + e->len;
+    }
+}
+
+static void rxStart(xmodemEngine *e, int bufsz)
 {
-	unsigned char xbuff[1030]; /* 1024 for XModem 1k + 3 head chars + 2 crc + nul */
-	unsigned char *p;
-	int bufsz = XMODEM_BUFF_SIZE_NORMAL, crc = 0;
-	unsigned char trychar = 'C';
-	unsigned char packetno = 1;
-	int i, c, len = 0;
-	int retry, retrans = XMODEM_MAXRETRANS;
-	unsigned char *dest = NULL;
-	int destsz = 0;
-
-	for(;;) {
-		for( retry = 0; retry < 16; ++retry) {
-            if (trychar) {
-                RXLOG("try 0x%02X", trychar);
-                xmodemOutByte(trychar);
+    e->bufsz = bufsz;
+    e->need = e->bufsz + (e->crc ? 1 : 0) + 4;
+    e->check = checkInit(e);
+    e->payload = e->xbuff + 3;
+    if (e->pos >= 3) {
+        rxPayloadTarget(e);
+    }
+    RXLOG("Receiving packet %d", e->packetno);
+    waitFor(e, stateRxPacket, quiet(e, timeout(e, e->session->byteTimeout, 1)));
+}
+
+/* copy a packet into the application buffers, returns 0 if they are full */
+static int rxStore(xmodemEngine *e, const unsigned char *buf, int bufsz)
+{
+    int remainingBuffer = bufsz;
+    do {
+        if(e->len >= e->destsz) {
+            e->dest = e->getReceiveBuffer(e->session->user, &e->destsz);
+            e->len = 0;
+            if(e->dest == NULL || e->destsz == 0) {
+                return 0;
             }
-			if ((c = xmodemInByte((DLY_1S) << 1)) >= 0) {
-				switch (c) {
-				case SOH:
-                    RXLOG("SOH");
-					bufsz = XMODEM_BUFF_SIZE_NORMAL;
-					goto start_recv;
-				case STX:
-                    RXLOG("STX");
-					bufsz = XMODEM_BUFF_SIZE_1K;
-					goto start_recv;
-				case EOT:
-                    RXLOG("EOT");
-					flushinput();
-                    xmodemOutByte(ACK);
-                    // determine exact length by finding ctrlz character
-                    char foundctrlz = 0;
-                    for(i = bufsz-1; i >= 0; i--) {
-                        switch(xbuff[3+i]) {
-                            case 0:
-                                if(foundctrlz) {
-                                    break;
-                                }
-                                continue;
-                            case CTRLZ:
-                                foundctrlz = 1;
-                                continue;
-                            default:
-                                if(!foundctrlz) {
-                                    // ctrlz not found, so assume whole buffer is data
-                                    i = bufsz-1;
-                                }
-                                break;
-                        }
-                        break;
-                    }
-                    int totallen = i + 1 + (packetno - 2) * bufsz;
-                    if(totallen == 0) {
-                        return xmodemErrorUnexpectedResponse;
-                    }
-                    RXLOG("Found %d ctrlz/0, last packet length %d, total length %d", bufsz - i - 1, i + 1, totallen);
-					return totallen; /* normal end */
-				case CAN:
-                    RXLOG("CAN");
-					if ((c = xmodemInByte(DLY_1S)) == CAN) {
-						flushinput();
-                        xmodemOutByte(ACK);
-						return xmodemErrorCancelledByRemote;
-					}
-					break;
-				default:
-					break;
-				}
-			}
-            RXLOG("Retry %d", retry + 1);
-		}
-		if (trychar == 'C') { trychar = NAK; continue; }
-        RXLOG("No sync");
-		flushinput();
-        xmodemOutByte(CAN);
-        xmodemOutByte(CAN);
-        xmodemOutByte(CAN);
-		return xmodemErrorNoSync;
-
-    bufferFull:
-	    RXLOG("Buffer full packetno %d len %d", packetno, len);
-        xmodemOutByte(CAN);
-        xmodemOutByte(CAN);
-        xmodemOutByte(CAN);
-	    flushinput();
-        xmodemOutByte(CAN);
-        xmodemOutByte(CAN);
-        xmodemOutByte(CAN);
-        return xmodemErrorBufferFull;
-
-	start_recv:
-		if (trychar == 'C') crc = 1;
-		trychar = 0;
-		p = xbuff;
-		*p++ = c;
-        RXLOG("Receiving packet %d", packetno);
-		for (i = 0;  i < (bufsz+(crc?1:0)+3); ++i) {
-			if ((c = xmodemInByte(DLY_1S)) < 0) goto reject;
-			*p++ = c;
-		}
-
-		if (xbuff[1] == (unsigned char)(~xbuff[2]) && 
-			(xbuff[1] == packetno || xbuff[1] == (unsigned char)packetno-1) &&
-			check(crc, &xbuff[3], bufsz)) {
-			if (xbuff[1] == packetno)	{
-			    int remainingBuffer = bufsz;
-			    do {
-                    if(len >= destsz) {
-                        dest = getBufferCallback(&destsz);
-                        len = 0;
-                        if(dest == NULL || destsz == 0) {
-                            goto bufferFull;
-                        }
+        }
+        int lenToCopy = remainingBuffer;
+        if(lenToCopy > (e->destsz - e->len)) lenToCopy = e->destsz - e->len;
+        if(lenToCopy > 0) {
+            memcpy (e->dest + e->len, &buf[bufsz - remainingBuffer], lenToCopy);
+            remainingBuffer -= lenToCopy;
+            e->len += lenToCopy;
+        }
+    } while(remainingBuffer > 0);
+    return 1;
+}
+
+/*
+ * decompress a packet into the application buffers, up to the length of the file when it is known, returns the length
+ * of data stored or -1 if the buffers are full. A transmitter that compresses also resumes, so there is no data to skip.
+ */
+static int rxDecompress(xmodemEngine *e, const unsigned char *buf, int bufsz)
+{
+    lzDecoder *d = e->session->decoder;
+    long limit = e->size >= 0 ? e->size - e->total : -1;
+    int n = 0, used, room;
+
+    while (!lzDecoderDone(d) && (bufsz > 0 || lzDecoderPending(d)) && (limit < 0 || n < limit)) {
+        if (e->len >= e->destsz) {
+            e->dest = e->getReceiveBuffer(e->session->user, &e->destsz);
+            e->len = 0;
+            if (e->dest == NULL || e->destsz == 0) {
+                return -1;
+            }
+        }
+        room = e->destsz - e->len;
+        if (limit >= 0 && room > limit - n) room = (int)(limit - n);
+        room = lzDecode(d, buf, bufsz, &used, e->dest + e->len, room);
+        buf += used;
+        bufsz -= used;
+        e->len += room;
+        n += room;
+    }
+    return n;
+}
+
+/* YMODEM packet 0: the name and length of the next file, or an empty name at the end of the batch */
+static int rxHeader(xmodemEngine *e)
+{
+    char *name = (char *)&e->xbuff[3];
+    unsigned char *p, *end = &e->xbuff[3 + e->bufsz];
+
+    if (name[0] == 0) {
+        RXLOG("End of batch, %d files", e->files);
+        queueByte(e, ACK);
+        finish(e, e->files);
+        return 0;
+    }
+    end[-1] = 0;
+    p = (unsigned char *)name + strlen(name) + 1;
+    e->size = -1;
+    if (p < end && *p >= '0' && *p <= '9') {
+        for (e->size = 0; p < end && *p >= '0' && *p <= '9'; ++p) {
+            e->size = e->size * 10 + (*p - '0');
+        }
+    }
+    RXLOG("File %s, %ld bytes", name, e->size);
+    if (e->fileStart && e->fileStart(e->session->user, name, e->size)) {
+        RXLOG("File refused");
+        queue(e, cancelSequence, sizeof(cancelSequence));
+        flush(e, afterFlushCancelDone, xmodemErrorFileRefused);
+        return 0;
+    }
+    e->dest = NULL;
+    e->destsz = e->len = 0;
+    e->total = e->padding = 0;
+    return 1;
+}
+
+/* YMODEM: the first EOT is refused in case it was noise, the second ends the file */
+static void rxBatchEot(xmodemEngine *e)
+{
+    if (e->packetno == 0) {
+        /* the acknowledgement of the last file was lost */
+        queueByte(e, ACK);
+        e->trychar = e->compress ? 'Z' : 'C';
+        rxSync(e);
+        return;
+    }
+    if (!e->eot) {
+        e->eot = 1;
+        queueByte(e, NAK);
+        waitFor(e, stateRxSync, e->session->syncTimeout);
+        return;
+    }
+    RXLOG("File complete, %ld bytes", e->total - e->padding);
+    e->stats.dataBytes -= e->padding;
+    queueByte(e, ACK);
+    if (e->fileEnd) {
+        e->fileEnd(e->session->user, e->total - e->padding);
+    }
+    ++e->files;
+    e->eot = 0;
+    e->packetno = 0;
+    e->retry = 0;
+    e->retrans = e->session->maxRetrans;
+    e->trychar = e->compress ? 'Z' : 'C';
+    rxSync(e);
+}
+
+static void rxPacket(xmodemEngine *e)
+{
+    unsigned char *xbuff = e->xbuff;
+    int bufsz = e->bufsz;
+
+    ++e->stats.packets;
+    if (rxHeaderValid(e) && check(e)) {
+        if (xbuff[1] == e->packetno) {
+            if (e->batch && e->packetno == 0) {
+                if (!rxHeader(e)) {
+                    return;
+                }
+            } else {
+                /* with a known length, data past it is padding */
+                int n = bufsz;
+                /* after an unanswered resume request, data already held is discarded */
+                int skip = e->skip < bufsz ? (int)e->skip : bufsz;
+                if (e->compress) {
+                    n = rxDecompress(e, &xbuff[3], bufsz);
+                } else {
+                    if (e->size >= 0 && n > e->size - e->total) {
+                        n = (int)(e->size - e->total);
                     }
-			        int lenToCopy = remainingBuffer;
-			        if(lenToCopy > (destsz - len)) lenToCopy = destsz - len;
-			        if(lenToCopy > 0) {
-                        memcpy (dest + len, &xbuff[3 + (bufsz - remainingBuffer)], lenToCopy);
-                        remainingBuffer -= lenToCopy;
-                        len += lenToCopy;
+                    e->skip -= skip;
+                    n -= skip;
+                    if (e->payload != &xbuff[3]) {
+                        e->len += n; /* received in place */
+                    } else if (n > 0 && !rxStore(e, &xbuff[3 + skip], n)) {
+                        n = -1;
                     }
-			    } while(remainingBuffer > 0);
-                RXLOG("Packet %d success, %d", packetno, len);
-				++packetno;
-				retrans = XMODEM_MAXRETRANS + 1;
-			}
-			if (--retrans <= 0) {
+                }
+                if (n < 0) {
+                    RXLOG("Buffer full packetno %d len %d", e->packetno, e->len);
+                    queue(e, cancelSequence, sizeof(cancelSequence));
+                    flush(e, afterFlushCancelDone, xmodemErrorBufferFull);
+                    return;
+                }
+                e->total += n;
+                /* a compressed stream has its own end, so any padding is never decoded */
+                e->padding = e->size >= 0 || e->compress ? 0 : padding(e->payload, bufsz);
+                if (e->padding > n) e->padding = n;
+                e->stats.dataBytes += n;
+                progress(e);
+                if (e->session->checkpoint) {
+                    e->session->checkpoint(e->session->user, xbuff[1], e->total - e->padding);
+                }
+            }
+            RXLOG("Packet %d success, %d", e->packetno, e->len);
+            ++e->packetno;
+            e->retrans = e->session->maxRetrans;
+        } else {
+            ++e->stats.duplicates;
+            /* a go-back while streaming replays up to a window of packets already held, which the window bounds */
+            if (!e->stream && --e->retrans <= 0) {
                 RXLOG("Too many retries");
-				flushinput();
-                xmodemOutByte(CAN);
-                xmodemOutByte(CAN);
-                xmodemOutByte(CAN);
-				return xmodemErrorTooManyRetries;
-			}
-            RXLOG("ACK");
-            xmodemOutByte(ACK);
-			continue;
-		}
-	reject:
-        RXLOG("NAK");
-		flushinput();
-        xmodemOutByte(NAK);
-	}
+                flush(e, afterFlushCancelDone, xmodemErrorTooManyRetries);
+                return;
+            }
+        }
+        e->retry = 0;
+        if (e->stream) {
+            RXLOG("ACK %d", (unsigned char)(e->packetno - 1));
+            rxStreamRespond(e, ACK, e->packetno - 1);
+            waitFor(e, stateRxSync, e->session->syncTimeout);
+            return;
+        }
+        RXLOG("ACK");
+        queueByte(e, ACK);
+        if (e->batch && xbuff[1] == 0) {
+            /* ask for the file's data, compressed if the header was */
+            e->trychar = e->compress ? 'Z' : 'C';
+        }
+        rxSync(e);
+        e->timing = 1;
+        return;
+    }
+    rxReject(e);
 }
 
-int xmodemTransmit(unsigned char const * (*getBufferCallback)(int *size))
+static void rxByte(xmodemEngine *e, unsigned char c)
 {
-	unsigned char xbuff[XMODEM_TRANSMIT_BUFFER_SIZE + 3 + 2 + 1]; /* 1024 for XModem 1k + 3 head chars + 2 crc + nul */
-	int bufsz, crc = -1;
-	unsigned char packetno = 1;
-	int i, c, srcsz = 0, len = 0;
-	int retry;
-	unsigned char const *src = NULL;
-	int totalLen = 0;
-
-	for(;;) {
-		for( retry = 0; retry < 16; ++retry) {
-			if ((c = xmodemInByte((DLY_1S) << 1)) >= 0) {
-				switch (c) {
-				case 'C':
-                    TXLOG("Received C");
-					crc = 1;
-					goto start_trans;
-				case NAK:
-                    TXLOG("Received NAK");
-					crc = 0;
-					goto start_trans;
-				case CAN:
-                    TXLOG("Received CAN");
-					if ((c = xmodemInByte(DLY_1S)) == CAN) {
-                        xmodemOutByte(ACK);
-						flushinput();
-						return xmodemErrorCancelledByRemote;
-					}
-					break;
-				default:
-					break;
-				}
-			}
-		}
-        TXLOG("No sync");
-        xmodemOutByte(CAN);
-        xmodemOutByte(CAN);
-        xmodemOutByte(CAN);
-		flushinput();
-		return xmodemErrorNoSync;
-
-		for(;;) {
-		start_trans:
-            TXLOG("Transmit %d", packetno);
-#ifdef XMODEM_TRANSMIT_1K
-			xbuff[0] = STX;
+    switch (e->state) {
+    case stateRxSync:
+        if (e->trychar == 'R') {
+            if (c == ACK) {
+                rxResumeOffer(e);
+            } else {
+                rxRetry(e);
+            }
+            return;
+        }
+        switch (c) {
+        case SOH:
+            RXLOG("SOH");
+            e->bufsz = XMODEM_BUFF_SIZE_NORMAL;
+            break;
+        case STX:
+#ifdef XMODEM_128_ONLY
+            /* no room for a 1K packet: drain it and NAK, so an adaptive transmitter falls back to 128 bytes */
+            RXLOG("STX refused");
+            rxReject(e);
+            return;
 #else
-			xbuff[0] = SOH;
+            RXLOG("STX");
+            e->bufsz = XMODEM_BUFF_SIZE_1K;
+            break;
 #endif
-			bufsz = XMODEM_TRANSMIT_BUFFER_SIZE;
-			xbuff[1] = packetno;
-			xbuff[2] = ~packetno;
-			// fill buffer
-			int buffRemaining = bufsz;
-			do {
-			    if(len == srcsz) {
-                    src = getBufferCallback(&srcsz);
-                    if(src == NULL) srcsz = 0;
-                    else if(srcsz == 0) src = NULL;
-                    len = 0;
-			    }
-			    if(src != NULL) {
-                    c = srcsz - len;
-                    if(c > buffRemaining) {
-                        c = buffRemaining;
-                    }
-                    memcpy(xbuff + 3 + (bufsz - buffRemaining), src + len, c);
-                    len += c;
-                    buffRemaining -= c;
-			    }
-			} while(src != NULL && buffRemaining > 0);
-
-			if(buffRemaining != bufsz) {
-			    totalLen += bufsz - buffRemaining;
-                if(buffRemaining > 0) {
-                    memset(xbuff + 3 + (bufsz - buffRemaining), CTRLZ, buffRemaining);
-                }
-				if (crc) {
-					unsigned short ccrc = crc16_ccitt(&xbuff[3], bufsz);
-					xbuff[bufsz+3] = (ccrc>>8) & 0xFF;
-					xbuff[bufsz+4] = ccrc & 0xFF;
-				}
-				else {
-					unsigned char ccks = 0;
-					for (i = 3; i < bufsz+3; ++i) {
-						ccks += xbuff[i];
-					}
-					xbuff[bufsz+3] = ccks;
-				}
-				for (retry = 0; retry < XMODEM_MAXRETRANS; ++retry) {
-					for (i = 0; i < bufsz+4+(crc?1:0); ++i) {
-                        xmodemOutByte(xbuff[i]);
-					}
-					if ((c = xmodemInByte(DLY_1S << 1)) >= 0 ) {
-						switch (c) {
-						case ACK:
-                            TXLOG("Received ACK");
-							++packetno;
-							goto start_trans;
-						case CAN:
-                            TXLOG("Received CAN");
-							if ((c = xmodemInByte(DLY_1S)) == CAN) {
-                                TXLOG("CAN ACK");
-                                xmodemOutByte(ACK);
-								flushinput();
-								return xmodemErrorCancelledByRemote;
-							}
-							break;
-						case NAK:
-                            TXLOG("Received NAK");
-						default:
-							break;
-						}
-					}
-                    TXLOG("Retrying after 2s");
-				}
-                TXLOG("Error");
-                xmodemOutByte(CAN);
-                xmodemOutByte(CAN);
-                xmodemOutByte(CAN);
-				flushinput();
-				return xmodemErrorTransmitError;
-			}
-			else {
-				for (retry = 0; retry < 10; ++retry) {
-                    TXLOG("EOT");
-                    xmodemOutByte(EOT);
-					if ((c = xmodemInByte((DLY_1S) << 1)) == ACK) break;
-				}
-				flushinput();
-                if(c == ACK) {
-                    TXLOG("Complete");
-                    return totalLen;
-                } else {
-                    TXLOG("Failed");
-                    return xmodemErrorUnexpectedResponse;
-                }
-			}
-		}
-	}
+        case EOT:
+            RXLOG("EOT");
+            if (e->batch) {
+                rxBatchEot(e);
+            } else if (e->total - e->padding == 0) {
+                flush(e, afterFlushAckDone, xmodemErrorUnexpectedResponse);
+            } else {
+                RXLOG("Found %d ctrlz/0, total length %ld", e->padding, e->total - e->padding);
+                e->stats.dataBytes -= e->padding;
+                flush(e, afterFlushAckDone, (int)(e->total - e->padding)); /* normal end */
+            }
+            return;
+        case CAN:
+            RXLOG("CAN");
+            waitFor(e, stateRxCancel, timeout(e, e->session->byteTimeout, 1));
+            return;
+        default:
+            if (e->stream) {
+                rxStreamNak(e);
+            } else if (e->trychar == 0) {
+                /* the start of a packet was lost or corrupted */
+                rxReject(e);
+            } else {
+                rxRetry(e);
+            }
+            return;
+        }
+        if (e->timing) rttSample(e);
+        if (e->trychar == 'W' || e->trychar == 'V') e->stream = 1;
+        if (e->trychar == 'Z' || e->trychar == 'V') {
+            e->compress = 1;
+            if (e->packetno == 1) {
+                /* the first packet of a file's data starts a new stream */
+                lzDecoderInit(e->session->decoder);
+            }
+        }
+        if (e->trychar == 'C' || e->trychar == 'W' || e->compress) e->crc = 1;
+        else if (e->trychar == NAK) e->crc = 0;
+        e->trychar = 0;
+        e->xbuff[0] = c;
+        e->pos = 1;
+        rxStart(e, e->bufsz);
+        break;
+    case stateRxHunt:
+    case stateRxResync:
+        e->xbuff[0] = e->xbuff[1];
+        e->xbuff[1] = e->xbuff[2];
+        e->xbuff[2] = c;
+        if (e->pos < 3) ++e->pos;
+        if (e->pos == 3 && rxStartByte(e->xbuff[0]) &&
+            (e->state == stateRxResync ? rxHeaderValid(e) :
+             e->xbuff[1] == e->packetno && e->xbuff[2] == (unsigned char)~e->packetno)) {
+            rxStart(e, e->xbuff[0] == STX ? XMODEM_BUFF_SIZE_1K : XMODEM_BUFF_SIZE_NORMAL);
+        } else {
+            /* the line is busy with the rest of a bad packet, or with packets sent before the NAK arrived */
+            waitFor(e, e->state, e->wait);
+        }
+        break;
+    case stateRxResume:
+        if (c == ACK) {
+            RXLOG("Resumed");
+            e->trychar = rxRequest(e);
+            e->retry = 0;
+            rxSync(e);
+        } else {
+            rxRetry(e);
+        }
+        break;
+    case stateRxCancel:
+        if (c == CAN) {
+            flush(e, afterFlushAckDone, xmodemErrorCancelledByRemote);
+        } else if (e->stream) {
+            rxStreamNak(e);
+        } else {
+            rxRetry(e);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void rxTimeout(xmodemEngine *e)
+{
+    switch (e->state) {
+    case stateRxSync:
+    case stateRxCancel:
+        if (e->stream) {
+            /* the last acknowledgement may have been lost */
+            if (++e->retry >= e->session->syncRetries) {
+                RXLOG("No sync");
+                flush(e, afterFlushCancelDone, xmodemErrorNoSync);
+                return;
+            }
+            rxStreamRespond(e, ACK, e->packetno - 1);
+            waitFor(e, stateRxSync, e->session->syncTimeout);
+            break;
+        }
+        rxRetry(e);
+        break;
+    case stateRxHunt:
+        if (++e->retry >= e->session->syncRetries) {
+            RXLOG("No sync");
+            flush(e, afterFlushCancelDone, xmodemErrorNoSync);
+            return;
+        }
+        rxStreamNak(e);
+        break;
+    case stateRxPacket:
+        rxReject(e);
+        break;
+    case stateRxResume:
+        rxRetry(e);
+        break;
+    default:
+        break;
+    }
 }
 
-#ifdef TEST_XMODEM_RECEIVE
-int main(void)
+/* get the next application buffer once the current one is used up, returns 0 at the end of the data */
+static int txSource(xmodemEngine *e)
 {
-	int st;
+    if(e->len == e->srcsz) {
+        e->src = e->getTransmitBuffer(e->session->user, &e->srcsz);
+        if(e->src == NULL) e->srcsz = 0;
+        else if(e->srcsz == 0) e->src = NULL;
+        e->len = 0;
+    }
+    return e->src != NULL;
+}
 
-	printf ("Send data using the xmodem protocol from your terminal emulator now...\n");
-	/* the following should be changed for your environment:
-	   0x30000 is the download address,
-	   65536 is the maximum size to be written at this address
-	 */
-	st = xmodemReceive((char *)0x30000, 65536);
-	if (st < 0) {
-		printf ("Xmodem receive error: status: %d\n", st);
-	}
-	else  {
-		printf ("Xmodem successfully received %d bytes\n", st);
-	}
+/* fill up to len bytes of a packet with compressed data, fewer once the compressed stream has ended */
+static int txCompress(xmodemEngine *e, unsigned char *out, int len)
+{
+    lzEncoder *z = e->session->encoder;
+    int n = 0;
+    while ((n += lzEncoderGet(z, out + n, len - n, e->srcEnd)) < len && !e->srcEnd) {
+        if (txSource(e)) {
+            e->len += lzEncoderPut(z, e->src + e->len, e->srcsz - e->len);
+        } else {
+            e->srcEnd = 1;
+        }
+    }
+    return n;
+}
 
-	return 0;
+/*
+ * fill a packet with any carried data then from the application buffers, returns the number of data bytes and sets
+ * *check to their CRC or checksum, computed as they are copied. With inPlace, a whole packet of data lying in one
+ * application buffer is left there and *inPlace set to it; it is valid until the next buffer is requested.
+ */
+static int txFill(xmodemEngine *e, unsigned char *xbuff, int bufsz, unsigned char const **inPlace,
+                  unsigned short *check)
+{
+    int c;
+    int buffRemaining = bufsz;
+    if (inPlace) *inPlace = NULL;
+    *check = checkInit(e);
+    if (e->carry > 0) {
+        c = e->carry < bufsz ? e->carry : bufsz;
+        memmove(xbuff + 3, e->xbuff + XMODEM_STAGING_BUFFER_SIZE - e->carry, c);
+        *check = checkBlock(e, *check, xbuff + 3, c);
+        e->carry -= c;
+        buffRemaining -= c;
+    }
+    if (e->compress) {
+        c = txCompress(e, xbuff + 3 + (bufsz - buffRemaining), buffRemaining);
+        *check = checkBlock(e, *check, xbuff + 3 + (bufsz - buffRemaining), c);
+        return bufsz - buffRemaining + c;
+    }
+    while (buffRemaining > 0 && txSource(e)) {
+        c = e->srcsz - e->len;
+        if(inPlace && buffRemaining == bufsz && c >= bufsz) {
+            *inPlace = e->src + e->len;
+            e->len += bufsz;
+            return bufsz;
+        }
+        if(c > buffRemaining) {
+            c = buffRemaining;
+        }
+        *check = checkCopy(e, *check, xbuff + 3 + (bufsz - buffRemaining), e->src + e->len, c);
+        e->len += c;
+        buffRemaining -= c;
+    }
+    return bufsz - buffRemaining;
 }
+
+/*
+ * complete a packet around its data: header, padding and CRC or checksum. The data is at payload if sent in place,
+ * otherwise check, if set, is the CRC or checksum of the data already in xbuff, from txFill
+ */
+static void txSeal(xmodemEngine *e, unsigned char *xbuff, unsigned char const *payload, int bufsz, int data,
+                   unsigned char packetno, unsigned short const *check)
+{
+    unsigned short c;
+    xbuff[0] = bufsz == XMODEM_BUFF_SIZE_1K ? STX : SOH;
+    xbuff[1] = packetno;
+    xbuff[2] = ~packetno;
+    if (data < bufsz) {
+        memset(xbuff + 3 + data, CTRLZ, bufsz - data);
+    }
+    if (payload == NULL && check) {
+        c = checkBlock(e, *check, xbuff + 3 + data, bufsz - data);
+    } else {
+        c = checkBlock(e, checkInit(e), payload ? payload : &xbuff[3], bufsz);
+    }
+    if (e->crc) {
+        xbuff[bufsz+3] = (c>>8) & 0xFF;
+        xbuff[bufsz+4] = c & 0xFF;
+    }
+    else {
+        xbuff[bufsz+3] = (unsigned char)c;
+    }
+}
+
+static void txFrame(xmodemEngine *e)
+{
+    if (e->retry >= e->session->maxRetrans) {
+        TXLOG("Error");
+        queue(e, cancelSequence, sizeof(cancelSequence));
+        flush(e, afterFlushDone, xmodemErrorTransmitError);
+        return;
+    }
+    e->frame = e->txbuf;
+    e->frameOff = 0;
+    e->frameLen = e->bufsz + 4 + (e->crc ? 1 : 0);
+    e->timing = 1;
+    ++e->stats.packets;
+    waitFor(e, stateTxAck, timeout(e, e->session->ackTimeout, 3));
+}
+
+/* the packet was not acknowledged; with an adaptive block size a failing 1K packet is resent as 128 byte packets */
+static void txRetry(xmodemEngine *e)
+{
+    ++e->retry;
+    e->clean = 0;
+    if (e->session->adaptiveBlockSize && e->bufsz == XMODEM_BUFF_SIZE_1K &&
+        e->retry >= XMODEM_ADAPTIVE_FALLBACK_RETRIES) {
+        int carry = e->frameData - XMODEM_BUFF_SIZE_NORMAL;
+        TXLOG("Falling back to 128 byte packets");
+        e->blockSize = e->bufsz = XMODEM_BUFF_SIZE_NORMAL;
+        if (carry > 0 && e->framePayload) {
+            /* the rest of the data is still in the application buffer */
+            e->len -= carry;
+            e->frameData = XMODEM_BUFF_SIZE_NORMAL;
+            e->total -= carry;
+        } else if (carry > 0) {
+            /* keep the rest of the data at the end of xbuff, clear of the smaller packet */
+            memmove(e->xbuff + XMODEM_STAGING_BUFFER_SIZE - carry, e->txbuf + 3 + XMODEM_BUFF_SIZE_NORMAL, carry);
+            e->carry = carry;
+            e->frameData = XMODEM_BUFF_SIZE_NORMAL;
+            e->total -= carry;
+        }
+        txSeal(e, e->txbuf, e->framePayload, e->bufsz, e->frameData, e->packetno, NULL);
+        e->retry = 0;
+    }
+    txFrame(e);
+    e->timing = 0; /* an ACK may be for either attempt */
+    if (e->state == stateTxAck) {
+        e->stats.retransmittedBytes += e->frameLen;
+    }
+}
+
+/*
+ * with a prepare buffer, fill and seal the next packet while waiting for the acknowledgement of this one, so it can
+ * go as soon as the acknowledgement arrives. Not while a 1K packet may yet fall back to 128 byte packets, as the
+ * rest of its data would have to go before the next packet.
+ */
+static void txPrepare(xmodemEngine *e)
+{
+    unsigned char *slot;
+    unsigned short check;
+
+    if (!e->session->prepareBuffer || e->prepared || (e->batch && e->packetno == 0) ||
+        (e->session->adaptiveBlockSize && e->bufsz == XMODEM_BUFF_SIZE_1K)) {
+        return;
+    }
+    if (e->framePayload && e->srcsz - e->len < e->blockSize) {
+        /* the next packet needs another application buffer, which may replace the one this packet is sent from */
+        memcpy(e->txbuf + 3, e->framePayload, e->bufsz);
+        e->framePayload = NULL;
+    }
+    slot = e->txbuf == e->xbuff ? e->session->prepareBuffer : e->xbuff;
+    e->nextBufsz = e->blockSize;
+    e->nextData = txFill(e, slot, e->nextBufsz, &e->nextPayload, &check);
+    if (e->nextData > 0) {
+        txSeal(e, slot, e->nextPayload, e->nextBufsz, e->nextData, (unsigned char)(e->packetno + 1), &check);
+    }
+    e->prepared = 1;
+}
+
+/* the block size a session asks for, as far as the build allows */
+static int txBlockSize(xmodemSession const *s)
+{
+#ifdef XMODEM_128_ONLY
+    (void)s;
+    return XMODEM_BUFF_SIZE_NORMAL;
+#else
+    return s->blockSize == XMODEM_BUFF_SIZE_1K ? XMODEM_BUFF_SIZE_1K : XMODEM_BUFF_SIZE_NORMAL;
+#endif
+}
+
+static void txAcked(xmodemEngine *e)
+{
+    if (e->session->adaptiveBlockSize && e->blockSize != txBlockSize(e->session) &&
+        txBlockSize(e->session) == XMODEM_BUFF_SIZE_1K) {
+        /* return to 1K packets once the link has been clean for a while */
+        if (e->retry == 0 && ++e->clean >= XMODEM_ADAPTIVE_RECOVER_PACKETS) {
+            TXLOG("Returning to 1K packets");
+            e->blockSize = XMODEM_BUFF_SIZE_1K;
+            e->clean = 0;
+        }
+    }
+    ++e->packetno;
+    e->stats.dataBytes += e->frameData;
+    progress(e);
+}
+
+static void txEot(xmodemEngine *e)
+{
+    if (e->retry >= 10) {
+        TXLOG("Failed");
+        flush(e, afterFlushDone, xmodemErrorUnexpectedResponse);
+        return;
+    }
+    TXLOG("EOT");
+    queueByte(e, EOT);
+    waitFor(e, stateTxEot, timeout(e, e->session->ackTimeout, 3));
+}
+
+static void txStart(xmodemEngine *e)
+{
+    unsigned short check;
+
+    TXLOG("Transmit %d", e->packetno);
+    e->retry = 0;
+
+    if (e->prepared) {
+        e->txbuf = e->txbuf == e->xbuff ? e->session->prepareBuffer : e->xbuff;
+        e->bufsz = e->nextBufsz;
+        e->frameData = e->nextData;
+        e->framePayload = e->nextPayload;
+        e->prepared = 0;
+    } else {
+        e->bufsz = e->blockSize;
+        e->frameData = txFill(e, e->txbuf, e->bufsz, &e->framePayload, &check);
+        if (e->frameData > 0) {
+            txSeal(e, e->txbuf, e->framePayload, e->bufsz, e->frameData, e->packetno, &check);
+        }
+    }
+    if (e->frameData == 0) {
+        txEot(e);
+        return;
+    }
+    e->total += e->frameData;
+    txFrame(e);
+}
+
+/* YMODEM packet 0 for the next file, or an empty one to end the batch */
+static void txHeader(xmodemEngine *e)
+{
+    char const *name = NULL;
+    long size = -1;
+    unsigned char *p = &e->txbuf[3];
+    int n;
+
+    e->bufsz = XMODEM_BUFF_SIZE_NORMAL;
+    e->retry = 0;
+    e->framePayload = NULL;
+    memset(p, 0, e->bufsz);
+    if (e->nextFile(e->session->user, &name, &size)) {
+        TXLOG("File %s, %ld bytes", name, size);
+        /* leave room for the terminator and the length */
+        n = (int)strlen(name);
+        if (n > e->bufsz - 22) n = e->bufsz - 22;
+        memcpy(p, name, n);
+        p += n + 1;
+        if (size >= 0) {
+            char digits[20];
+            n = 0;
+            do {
+                digits[n++] = '0' + size % 10;
+                size /= 10;
+            } while (size > 0);
+            while (n > 0) {
+                *p++ = digits[--n];
+            }
+        }
+    } else {
+        TXLOG("End of batch");
+        e->eof = 1;
+    }
+    e->frameData = e->bufsz;
+    txSeal(e, e->txbuf, NULL, e->bufsz, e->frameData, e->packetno, NULL);
+    txFrame(e);
+}
+
+static void txHeaderAcked(xmodemEngine *e)
+{
+    if (e->eof) {
+        TXLOG("Complete, %d files", e->files);
+        finish(e, e->files);
+        return;
+    }
+    /* the receiver asks for the data once it has opened the file */
+    e->packetno = 1;
+    e->retry = 0;
+    txSync(e);
+}
+
+/* skip the data the receiver asks to resume after, returning to sync for its 'C' or 'W' */
+static void txResume(xmodemEngine *e)
+{
+    long offset = 0;
+    long c;
+    int i;
+    for (i = 0; i < 4; ++i) {
+        if (e->xbuff[i] != (unsigned char)~e->xbuff[i + 4]) {
+            TXLOG("Bad resume offset");
+            queueByte(e, NAK);
+            ++e->retry;
+            txSync(e);
+            return;
+        }
+        offset = offset << 8 | e->xbuff[i];
+    }
+    TXLOG("Resume from %ld", offset);
+    while (e->total < offset && txSource(e)) {
+        c = e->srcsz - e->len;
+        if (c > offset - e->total) {
+            c = offset - e->total;
+        }
+        e->len += (int)c;
+        e->total += c;
+    }
+    e->resumed = e->total;
+    queueByte(e, ACK);
+    txSync(e);
+}
+
+/* a new compressed stream for each file's data */
+static void txCompressStart(xmodemEngine *e)
+{
+    if (e->compress && e->packetno == 1) {
+        lzEncoderInit(e->session->encoder);
+        e->srcEnd = 0;
+    }
+}
+
+static void txBegin(xmodemEngine *e)
+{
+    if (e->batch && e->packetno == 0) {
+        txHeader(e);
+    } else {
+        txCompressStart(e);
+        txStart(e);
+    }
+}
+
+static unsigned char *txStreamSlot(xmodemEngine *e, int packet)
+{
+    return e->session->windowBuffer + (packet % e->window) * (e->bufsz + 5);
+}
+
+/* streaming: send the next packet in the window, or wait for it to open */
+static void txStream(xmodemEngine *e)
+{
+    unsigned char *frame;
+    unsigned short check;
+    int fresh = 0;
+
+    if (e->next == e->end && e->end - e->base < e->window && !e->eof) {
+        frame = txStreamSlot(e, e->end);
+        e->packetno = (unsigned char)e->end;
+        /* the window keeps whole frames, as going back may need them after their buffer has been given up */
+        if ((e->frameData = txFill(e, frame, e->bufsz, NULL, &check)) == 0) {
+            e->eof = 1;
+        } else {
+            TXLOG("Transmit %d", e->packetno);
+            e->total += e->frameData;
+            txSeal(e, frame, NULL, e->bufsz, e->frameData, e->packetno, &check);
+            ++e->end;
+            fresh = 1;
+        }
+    }
+    if (e->next < e->end) {
+        e->frame = txStreamSlot(e, e->next++);
+        e->frameOff = 0;
+        e->frameLen = e->bufsz + 5;
+        ++e->stats.packets;
+        if (!fresh) {
+            e->stats.retransmittedBytes += e->frameLen;
+        }
+        waitFor(e, stateTxStream, timeout(e, e->session->ackTimeout, 3));
+        return;
+    }
+    if (e->eof && e->base == e->end) {
+        e->retry = 0;
+        txEot(e);
+        return;
+    }
+    waitFor(e, stateTxStream, timeout(e, e->session->ackTimeout, 3));
+}
+
+static void txStreamStart(xmodemEngine *e)
+{
+    TXLOG("Streaming, window %d", e->window);
+    e->stream = 1;
+    e->crc = 1;
+    e->bufsz = e->blockSize;
+    e->base = e->next = e->end = 1;
+    e->retry = 0;
+    txCompressStart(e);
+    txStream(e);
+}
+
+/* streaming: handle a response naming a packet, which is within the window */
+static void txStreamResponse(xmodemEngine *e, unsigned char c, unsigned char packetno)
+{
+    int ahead = (unsigned char)(packetno - (unsigned char)e->base);
+    if (c == ACK && ahead < e->end - e->base) {
+        /* acknowledges every packet up to this one */
+        TXLOG("Received ACK %d", packetno);
+        e->base += ahead + 1;
+        if (e->next < e->base) e->next = e->base;
+        e->retry = 0;
+        /* all but the last packet are full */
+        e->stats.dataBytes = e->total - e->resumed - (long)(e->end - e->base) * e->bufsz;
+        if (e->stats.dataBytes < 0) e->stats.dataBytes = 0;
+        progress(e);
+    } else if (c == NAK && ahead <= e->end - e->base) {
+        /* go back to the packet, the ones before it were received */
+        TXLOG("Received NAK %d", packetno);
+        ++e->stats.naks;
+        e->base += ahead;
+        e->next = e->base;
+        if (++e->retry >= e->session->maxRetrans) {
+            TXLOG("Error");
+            queue(e, cancelSequence, sizeof(cancelSequence));
+            flush(e, afterFlushDone, xmodemErrorTransmitError);
+            return;
+        }
+    } else {
+        return;
+    }
+    if (!outputPending(e)) {
+        txStream(e);
+    }
+}
+
+static void txSync(xmodemEngine *e)
+{
+    if (e->retry >= e->session->syncRetries) {
+        TXLOG("No sync");
+        queue(e, cancelSequence, sizeof(cancelSequence));
+        flush(e, afterFlushDone, xmodemErrorNoSync);
+        return;
+    }
+    waitFor(e, stateTxSync, e->session->syncTimeout);
+}
+
+static void txByte(xmodemEngine *e, unsigned char c)
+{
+    switch (e->state) {
+    case stateTxSync:
+        switch (c) {
+        case 'C':
+            TXLOG("Received C");
+            e->crc = 1;
+            e->compress = 0;
+            txBegin(e);
+            break;
+        case NAK:
+            TXLOG("Received NAK");
+            e->crc = 0;
+            e->compress = 0;
+            txBegin(e);
+            break;
+        case 'W':
+        case 'V':
+            if (e->window > 1 && (c == 'W' || e->session->encoder)) {
+                e->compress = c == 'V';
+                txStreamStart(e);
+            } else {
+                ++e->retry;
+                txSync(e);
+            }
+            break;
+        case 'Z':
+            if (e->session->encoder) {
+                TXLOG("Received Z");
+                e->crc = 1;
+                e->compress = 1;
+                txBegin(e);
+            } else {
+                ++e->retry;
+                txSync(e);
+            }
+            break;
+        case 'R':
+            if (!e->batch && e->stats.packets == 0) {
+                /* a receiver resuming an earlier transfer, the offset follows */
+                TXLOG("Received R");
+                queueByte(e, ACK);
+                e->pos = 0;
+                waitFor(e, stateTxResume, timeout(e, e->session->byteTimeout, 1));
+            } else {
+                ++e->retry;
+                txSync(e);
+            }
+            break;
+        case CAN:
+            TXLOG("Received CAN");
+            waitFor(e, stateTxSyncCancel, timeout(e, e->session->byteTimeout, 1));
+            break;
+        default:
+            ++e->retry;
+            txSync(e);
+            break;
+        }
+        break;
+    case stateTxAck:
+        switch (c) {
+        case ACK:
+            TXLOG("Received ACK");
+            if (e->timing) rttSample(e);
+            if (e->batch && e->packetno == 0) {
+                txHeaderAcked(e);
+                break;
+            }
+            txAcked(e);
+            txStart(e);
+            break;
+        case CAN:
+            TXLOG("Received CAN");
+            waitFor(e, stateTxAckCancel, timeout(e, e->session->byteTimeout, 1));
+            break;
+        default:
+            TXLOG("Received 0x%02X, retrying", c);
+            if (c == NAK) ++e->stats.naks;
+            txRetry(e);
+            break;
+        }
+        break;
+    case stateTxStream:
+        if (e->respLen == 0) {
+            if (c == ACK || c == NAK) {
+                e->resp[e->respLen++] = c;
+            } else if (c == CAN) {
+                TXLOG("Received CAN");
+                waitFor(e, stateTxAckCancel, timeout(e, e->session->byteTimeout, 1));
+            }
+        } else if (e->respLen == 1) {
+            e->resp[e->respLen++] = c;
+        } else {
+            e->respLen = 0;
+            if (c == (unsigned char)~e->resp[1]) {
+                txStreamResponse(e, e->resp[0], e->resp[1]);
+            }
+        }
+        break;
+    case stateTxResume:
+        e->xbuff[e->pos++] = c;
+        if (e->pos == 8) {
+            txResume(e);
+        } else {
+            waitFor(e, stateTxResume, e->wait);
+        }
+        break;
+    case stateTxSyncCancel:
+    case stateTxAckCancel:
+        if (c == CAN) {
+            TXLOG("CAN ACK");
+            queueByte(e, ACK);
+            flush(e, afterFlushDone, xmodemErrorCancelledByRemote);
+        } else if (e->stream) {
+            txStream(e);
+        } else if (e->state == stateTxSyncCancel) {
+            ++e->retry;
+            txSync(e);
+        } else {
+            txRetry(e);
+        }
+        break;
+    case stateTxEot:
+        if (c == ACK && e->batch) {
+            TXLOG("File complete");
+            ++e->files;
+            e->packetno = 0;
+            e->retry = 0;
+            txSync(e);
+        } else if (c == ACK) {
+            TXLOG("Complete");
+            /* the length of the data, rather than of the compressed stream */
+            flush(e, afterFlushDone, (int)(e->compress ? e->resumed + e->session->encoder->in : e->total));
+        } else {
+            ++e->retry;
+            txEot(e);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void txTimeout(xmodemEngine *e)
+{
+    switch (e->state) {
+    case stateTxSync:
+    case stateTxSyncCancel:
+    case stateTxResume:
+        ++e->retry;
+        txSync(e);
+        break;
+    case stateTxAck:
+    case stateTxAckCancel:
+        if (e->stream) {
+            txStream(e);
+            break;
+        }
+        TXLOG("Retrying after timeout");
+        txRetry(e);
+        break;
+    case stateTxStream:
+        /* no acknowledgement, go back to the oldest packet */
+        TXLOG("Retrying from %d after timeout", e->base);
+        e->respLen = 0;
+        if (++e->retry >= e->session->maxRetrans) {
+            TXLOG("Error");
+            queue(e, cancelSequence, sizeof(cancelSequence));
+            flush(e, afterFlushDone, xmodemErrorTransmitError);
+            break;
+        }
+        e->next = e->base;
+        txStream(e);
+        break;
+    case stateTxEot:
+        ++e->retry;
+        txEot(e);
+        break;
+    default:
+        break;
+    }
+}
+
+static void engineInit(xmodemEngine *e, xmodemSession const *session, unsigned long now)
+{
+    memset(e, 0, sizeof(*e));
+    e->session = session;
+    e->now = now;
+    e->start = now;
+#ifdef XMODEM_NO_ENGINE_BUFFER
+    e->xbuff = session->stagingBuffer;
+#else
+    e->xbuff = session->stagingBuffer ? session->stagingBuffer : e->buffer;
 #endif
-#ifdef TEST_XMODEM_SEND
-int main(void)
-{
-	int st;
-
-	printf ("Prepare your terminal emulator to receive data now...\n");
-	/* the following should be changed for your environment:
-	   0x30000 is the download address,
-	   12000 is the maximum size to be send from this address
-	 */
-	st = xmodemTransmit((char *)0x30000, 12000);
-	if (st < 0) {
-		printf ("Xmodem transmit error: status: %d\n", st);
-	}
-	else  {
-		printf ("Xmodem successfully transmitted %d bytes\n", st);
-	}
-
-	return 0;
+    e->txbuf = e->xbuff;
+    e->packetno = 1;
+    e->size = -1;
+    e->stats.crc = -1;
+}
+
+void xmodemEngineInitReceive(xmodemEngine *engine, xmodemSession const *session,
+                             unsigned char * (*getBufferCallback)(void *user, int *size), unsigned long now)
+{
+    engineInit(engine, session, now);
+    engine->getReceiveBuffer = getBufferCallback;
+    engine->bufsz = XMODEM_BUFF_SIZE_NORMAL;
+    engine->trychar = rxRequest(engine);
+    if (session->resumeFrom > 0) {
+        engine->trychar = 'R';
+        engine->total = session->resumeFrom;
+    }
+    engine->retrans = session->maxRetrans;
+    rxSync(engine);
+}
+
+void xmodemEngineInitTransmit(xmodemEngine *engine, xmodemSession const *session,
+                              unsigned char const * (*getBufferCallback)(void *user, int *size), unsigned long now)
+{
+    engineInit(engine, session, now);
+    engine->getTransmitBuffer = getBufferCallback;
+    engine->crc = -1;
+    engine->blockSize = txBlockSize(session);
+    if (session->windowBuffer) {
+        engine->window = session->window > XMODEM_STREAM_MAX_WINDOW ? XMODEM_STREAM_MAX_WINDOW : session->window;
+    }
+    txSync(engine);
+}
+
+void xmodemEngineInitReceiveBatch(xmodemEngine *engine, xmodemSession const *session,
+                                  int (*fileCallback)(void *user, char const *name, long size),
+                                  unsigned char * (*getBufferCallback)(void *user, int *size),
+                                  void (*fileEndCallback)(void *user, long length), unsigned long now)
+{
+    engineInit(engine, session, now);
+    engine->getReceiveBuffer = getBufferCallback;
+    engine->fileStart = fileCallback;
+    engine->fileEnd = fileEndCallback;
+    engine->batch = 1;
+    engine->packetno = 0;
+    engine->bufsz = XMODEM_BUFF_SIZE_NORMAL;
+    engine->trychar = rxRequest(engine);
+    engine->retrans = session->maxRetrans;
+    rxSync(engine);
+}
+
+void xmodemEngineInitTransmitBatch(xmodemEngine *engine, xmodemSession const *session,
+                                   int (*nextFileCallback)(void *user, char const **name, long *size),
+                                   unsigned char const * (*getBufferCallback)(void *user, int *size),
+                                   unsigned long now)
+{
+    engineInit(engine, session, now);
+    engine->getTransmitBuffer = getBufferCallback;
+    engine->nextFile = nextFileCallback;
+    engine->batch = 1;
+    engine->packetno = 0;
+    engine->crc = -1;
+    engine->blockSize = txBlockSize(session);
+    txSync(engine);
+}
+
+int xmodemEngineInputBuffer(xmodemEngine *engine, unsigned char **buf)
+{
+    if (engine->state == stateDone) {
+        *buf = &engine->in;
+        return 0;
+    }
+    if (engine->state == stateRxPacket) {
+        /* the header, then the payload wherever it is going, then the trailer */
+        if (engine->pos < 3) {
+            *buf = engine->xbuff + engine->pos;
+            return 3 - engine->pos;
+        }
+        if (engine->pos < 3 + engine->bufsz) {
+            *buf = engine->payload + (engine->pos - 3);
+            return 3 + engine->bufsz - engine->pos;
+        }
+        *buf = engine->xbuff + engine->pos;
+        return engine->need - engine->pos;
+    }
+    *buf = &engine->in;
+    return 1;
+}
+
+/* checked is set when the CRC or checksum has already been taken over the bytes */
+static void inputReceived(xmodemEngine *e, int len, int checked)
+{
+    if (len <= 0 || e->state == stateDone) {
+        return;
+    }
+    e->stats.bytesReceived += len;
+    switch (e->state) {
+    case stateFlush:
+        e->armed = 0;
+        arm(e);
+        break;
+    case stateRxPacket:
+        if (!checked) {
+            checkUpdate(e, e->pos, e->pos + len);
+        }
+        e->pos += len;
+        if (e->pos == 3) {
+            if (!rxHeaderValid(e)) {
+                /* no need to wait for the rest of a packet with a bad header */
+                rxReject(e);
+                break;
+            }
+            rxPayloadTarget(e);
+        }
+        if (e->pos >= e->need) {
+            rxPacket(e);
+        } else {
+            e->armed = 0;
+            arm(e);
+        }
+        break;
+    default:
+        if (e->getTransmitBuffer) {
+            txByte(e, e->in);
+        } else {
+            rxByte(e, e->in);
+        }
+        break;
+    }
+}
+
+void xmodemEngineInputReceived(xmodemEngine *e, int len)
+{
+    inputReceived(e, len, 0);
+}
+
+int xmodemEngineFeed(xmodemEngine *engine, unsigned char const *data, int len)
+{
+    int used = 0, n, payload;
+    unsigned char *in;
+    while (used < len && (n = xmodemEngineInputBuffer(engine, &in)) > 0) {
+        if (n > len - used) n = len - used;
+        /* the input buffer is all header, all data or all trailer, and data is checked as it is copied */
+        payload = engine->state == stateRxPacket && engine->pos >= 3 && engine->pos < 3 + engine->bufsz;
+        if (payload) {
+            engine->check = checkCopy(engine, engine->check, in, data + used, n);
+        } else {
+            memcpy(in, data + used, n);
+        }
+        inputReceived(engine, n, payload);
+        used += n;
+    }
+    return used;
+}
+
+int xmodemEnginePollOutput(xmodemEngine *engine, unsigned char const **data)
+{
+    if (engine->ctlLen > engine->ctlOff) {
+        *data = engine->ctl + engine->ctlOff;
+        return engine->ctlLen - engine->ctlOff;
+    }
+    if (engine->frameLen > engine->frameOff) {
+        /* a payload sent in place is sent apart from the header and trailer */
+        int off = engine->frameOff;
+        if (engine->framePayload && off >= 3 && off < 3 + engine->bufsz) {
+            *data = engine->framePayload + (off - 3);
+            return 3 + engine->bufsz - off;
+        }
+        *data = engine->frame + off;
+        if (engine->framePayload && off < 3) {
+            return 3 - off;
+        }
+        return engine->frameLen - off;
+    }
+    return 0;
+}
+
+void xmodemEngineOutputSent(xmodemEngine *engine, int len)
+{
+    engine->stats.bytesSent += len;
+    if (engine->ctlLen > engine->ctlOff) {
+        engine->ctlOff += len;
+    } else if (engine->frameLen > engine->frameOff) {
+        engine->frameOff += len;
+    }
+    if (engine->state == stateTxStream && !outputPending(engine)) {
+        txStream(engine);
+    } else if (!engine->armed) {
+        arm(engine);
+    }
+    if (engine->state == stateTxAck && !outputPending(engine)) {
+        txPrepare(engine);
+    }
+}
+
+void xmodemEngineTick(xmodemEngine *e, unsigned long now)
+{
+    if (outputPending(e)) {
+        e->stats.transmitTime += now - e->now;
+    } else if (e->armed && e->state != stateFlush && e->state != stateRxResync) {
+        e->stats.waitTime += now - e->now;
+    }
+    e->now = now;
+    if (!e->armed || (long)(now - e->deadline) < 0) {
+        return;
+    }
+    e->armed = 0;
+    if (e->state == stateFlush) {
+        flushed(e);
+        return;
+    }
+    if (e->state == stateRxResync) {
+        rxResynced(e);
+        return;
+    }
+    ++e->stats.timeouts;
+    if (e->getTransmitBuffer) {
+        txTimeout(e);
+    } else {
+        rxTimeout(e);
+    }
+}
+
+void xmodemEngineAbort(xmodemEngine *engine, int result)
+{
+    engine->ctlOff = engine->ctlLen;
+    engine->frameOff = engine->frameLen;
+    finish(engine, result);
+}
+
+long xmodemEngineTimeout(xmodemEngine const *engine)
+{
+    long remaining;
+    if (!engine->armed) {
+        return -1;
+    }
+    remaining = (long)(engine->deadline - engine->now);
+    return remaining > 0 ? remaining : 0;
+}
+
+int xmodemEngineDone(xmodemEngine const *engine)
+{
+    return engine->state == stateDone && !outputPending(engine);
+}
+
+xmodemStats const *xmodemEngineStats(xmodemEngine const *engine)
+{
+    return &engine->stats;
+}
+
+int xmodemEngineResult(xmodemEngine const *engine)
+{
+    return engine->result;
+}
+
+/* drive an engine with the blocking I/O functions of its session, using the session clock or else the timeouts
+   to keep time */
+static int run(xmodemSession const *s, xmodemEngine *e)
+{
+    unsigned long now = e->now;
+    unsigned char const *out;
+    unsigned char *in;
+    int n, c;
+    long timeout;
+
+    for(;;) {
+        while ((n = xmodemEnginePollOutput(e, &out)) > 0) {
+            outblock(s, out, n);
+            if (s->clock) {
+                xmodemEngineTick(e, s->clock(s->user));
+            }
+            xmodemEngineOutputSent(e, n);
+        }
+        if (xmodemEngineDone(e)) {
+            if (s->stats) {
+                *s->stats = e->stats;
+            }
+            return xmodemEngineResult(e);
+        }
+        timeout = xmodemEngineTimeout(e);
+        n = xmodemEngineInputBuffer(e, &in);
+        if (s->inBlock) {
+            n = s->inBlock(s->user, in, n, (unsigned short)timeout);
+        } else if ((c = s->inByte(s->user, (unsigned short)timeout)) >= 0) {
+            *in = c;
+            n = 1;
+        } else {
+            n = c == xmodemErrorLinkFailed ? c : 0;
+        }
+        if (n == xmodemErrorLinkFailed) {
+            xmodemEngineAbort(e, xmodemErrorLinkFailed);
+        } else if (n > 0) {
+            xmodemEngineInputReceived(e, n);
+            if (s->clock) {
+                xmodemEngineTick(e, s->clock(s->user));
+            }
+        } else {
+            now = s->clock ? s->clock(s->user) : now + timeout;
+            xmodemEngineTick(e, now);
+        }
+    }
+}
+
+int xmodemReceiveEx(xmodemSession const *s, unsigned char * (*getBufferCallback)(void *user, int *size))
+{
+    xmodemEngine engine;
+    xmodemEngineInitReceive(&engine, s, getBufferCallback, s->clock ? s->clock(s->user) : 0);
+    return run(s, &engine);
+}
+
+int xmodemTransmitEx(xmodemSession const *s, unsigned char const * (*getBufferCallback)(void *user, int *size))
+{
+    xmodemEngine engine;
+    xmodemEngineInitTransmit(&engine, s, getBufferCallback, s->clock ? s->clock(s->user) : 0);
+    return run(s, &engine);
+}
+
+int xmodemReceiveBatchEx(xmodemSession const *s,
+                         int (*fileCallback)(void *user, char const *name, long size),
+                         unsigned char * (*getBufferCallback)(void *user, int *size),
+                         void (*fileEndCallback)(void *user, long length))
+{
+    xmodemEngine engine;
+    xmodemEngineInitReceiveBatch(&engine, s, fileCallback, getBufferCallback, fileEndCallback,
+                                 s->clock ? s->clock(s->user) : 0);
+    return run(s, &engine);
+}
+
+int xmodemTransmitBatchEx(xmodemSession const *s,
+                          int (*nextFileCallback)(void *user, char const **name, long *size),
+                          unsigned char const * (*getBufferCallback)(void *user, int *size))
+{
+    xmodemEngine engine;
+    xmodemEngineInitTransmitBatch(&engine, s, nextFileCallback, getBufferCallback, s->clock ? s->clock(s->user) : 0);
+    return run(s, &engine);
+}
+
+static int legacyInByte(void *user, unsigned short timeout)
+{
+    (void)user;
+    return xmodemInByte(timeout);
+}
+
+static void legacyOutByte(void *user, unsigned char c)
+{
+    (void)user;
+    xmodemOutByte(c);
+}
+
+static int legacyInBlock(void *user, unsigned char *buf, int len, unsigned short timeout)
+{
+    (void)user;
+    return xmodemInBlock(buf, len, timeout);
+}
+
+static void legacyOutBlock(void *user, unsigned char const *buf, int len)
+{
+    (void)user;
+    xmodemOutBlock(buf, len);
 }
+
+/* the legacy API passes a callback without a user pointer, so it is carried in the session user pointer */
+struct legacyReceive {
+    unsigned char * (*getBufferCallback)(int *size);
+};
+
+struct legacyTransmit {
+    unsigned char const * (*getBufferCallback)(int *size);
+};
+
+static unsigned char * legacyGetReceiveBuffer(void *user, int *size)
+{
+    return ((struct legacyReceive *)user)->getBufferCallback(size);
+}
+
+static unsigned char const * legacyGetTransmitBuffer(void *user, int *size)
+{
+    return ((struct legacyTransmit *)user)->getBufferCallback(size);
+}
+
+static void legacySessionInit(xmodemSession *session, unsigned char *stagingBuffer, void *user)
+{
+    xmodemSessionInit(session);
+    session->stagingBuffer = stagingBuffer;
+    session->inByte = legacyInByte;
+    session->outByte = legacyOutByte;
+    session->inBlock = xmodemInBlock ? legacyInBlock : NULL;
+    session->outBlock = xmodemOutBlock ? legacyOutBlock : NULL;
+    session->user = user;
+}
+
+/*
+ * the legacy API is tied to the global I/O functions, so there is one receive and one transmit at a time, and their
+ * sessions and engines are static rather than taking the stack of a small target
+ */
+#ifdef XMODEM_NO_ENGINE_BUFFER
+#define LEGACY_STAGING_BUFFER(name) static unsigned char name[XMODEM_STAGING_BUFFER_SIZE]
+#else
+#define LEGACY_STAGING_BUFFER(name) unsigned char *name = NULL
 #endif
+
+int xmodemReceive(unsigned char * (*getBufferCallback)(int *size))
+{
+    static xmodemSession session;
+    static xmodemEngine engine;
+    LEGACY_STAGING_BUFFER(stagingBuffer);
+    struct legacyReceive legacy;
+    legacy.getBufferCallback = getBufferCallback;
+    legacySessionInit(&session, stagingBuffer, &legacy);
+    xmodemEngineInitReceive(&engine, &session, legacyGetReceiveBuffer, 0);
+    return run(&session, &engine);
+}
+
+int xmodemTransmit(unsigned char const * (*getBufferCallback)(int *size))
+{
+    static xmodemSession session;
+    static xmodemEngine engine;
+    LEGACY_STAGING_BUFFER(stagingBuffer);
+    struct legacyTransmit legacy;
+    legacy.getBufferCallback = getBufferCallback;
+    legacySessionInit(&session, stagingBuffer, &legacy);
+    xmodemEngineInitTransmit(&engine, &session, legacyGetTransmitBuffer, 0);
+    return run(&session, &engine);
+}
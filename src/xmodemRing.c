@@ -0,0 +1,170 @@
+/*
+ * A lock-free single-producer single-consumer byte ring.
+ *
+ * head and tail run freely and wrap at the width of unsigned int, so
+ * head - tail is the count even across the wrap, and a power of two
+ * size keeps the masked positions in step with it. A side reads its
+ * own index relaxed and the other's with acquire, and publishes its
+ * own with release once the bytes are copied.
+ */
+
+#include <string.h>
+#include "../include/xmodem.h"
+#include "../include/xmodemRing.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LOAD_OWN(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define LOAD_OTHER(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define PUBLISH(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+#define LOAD_OWN(p) (*(p))
+#define LOAD_OTHER(p) (*(p))
+#define PUBLISH(p, v) (*(p) = (v))
+#endif
+
+int xmodemRingInit(xmodemRing *ring, unsigned char *buf, unsigned int size)
+{
+    if (size == 0 || (size & (size - 1)) != 0) {
+        return -1;
+    }
+    ring->buf = buf;
+    ring->mask = size - 1;
+    ring->head = ring->tail = 0;
+    ring->overruns = 0;
+    return 0;
+}
+
+/* copy len bytes into the ring from position pos, in two pieces across the end of the buffer */
+static void copyIn(xmodemRing *ring, unsigned int pos, unsigned char const *data, unsigned int len)
+{
+    unsigned int at = pos & ring->mask;
+    unsigned int first = ring->mask + 1 - at;
+    if (first > len) first = len;
+    memcpy(ring->buf + at, data, first);
+    memcpy(ring->buf, data + first, len - first);
+}
+
+static void copyOut(xmodemRing const *ring, unsigned int pos, unsigned char *buf, unsigned int len)
+{
+    unsigned int at = pos & ring->mask;
+    unsigned int first = ring->mask + 1 - at;
+    if (first > len) first = len;
+    memcpy(buf, ring->buf + at, first);
+    memcpy(buf + first, ring->buf, len - first);
+}
+
+int xmodemRingPush(xmodemRing *ring, unsigned char const *data, int len)
+{
+    unsigned int head = LOAD_OWN(&ring->head);
+    unsigned int space = ring->mask + 1 - (head - LOAD_OTHER(&ring->tail));
+    unsigned int n = len > 0 ? (unsigned int)len : 0;
+    if (n > space) n = space;
+    if (n > 0) {
+        copyIn(ring, head, data, n);
+        PUBLISH(&ring->head, head + n);
+    }
+    return (int)n;
+}
+
+int xmodemRingPushByte(xmodemRing *ring, unsigned char c)
+{
+    unsigned int head = LOAD_OWN(&ring->head);
+    if (head - LOAD_OTHER(&ring->tail) > ring->mask) {
+        ring->overruns = ring->overruns + 1;
+        return 0;
+    }
+    ring->buf[head & ring->mask] = c;
+    PUBLISH(&ring->head, head + 1);
+    return 1;
+}
+
+int xmodemRingPop(xmodemRing *ring, unsigned char *buf, int len)
+{
+    unsigned int tail = LOAD_OWN(&ring->tail);
+    unsigned int count = LOAD_OTHER(&ring->head) - tail;
+    unsigned int n = len > 0 ? (unsigned int)len : 0;
+    if (n > count) n = count;
+    if (n > 0) {
+        copyOut(ring, tail, buf, n);
+        PUBLISH(&ring->tail, tail + n);
+    }
+    return (int)n;
+}
+
+int xmodemRingPopByte(xmodemRing *ring, unsigned char *c)
+{
+    unsigned int tail = LOAD_OWN(&ring->tail);
+    if (LOAD_OTHER(&ring->head) == tail) {
+        return 0;
+    }
+    *c = ring->buf[tail & ring->mask];
+    PUBLISH(&ring->tail, tail + 1);
+    return 1;
+}
+
+unsigned int xmodemRingCount(xmodemRing const *ring)
+{
+    return LOAD_OTHER(&ring->head) - LOAD_OTHER(&ring->tail);
+}
+
+unsigned int xmodemRingSpace(xmodemRing const *ring)
+{
+    return ring->mask + 1 - xmodemRingCount(ring);
+}
+
+int xmodemRingInByte(void *link, unsigned short timeout)
+{
+    unsigned char c;
+    return xmodemRingInBlock(link, &c, 1, timeout) > 0 ? c : -1;
+}
+
+void xmodemRingOutByte(void *link, unsigned char c)
+{
+    xmodemRingOutBlock(link, &c, 1);
+}
+
+int xmodemRingInBlock(void *link, unsigned char *buf, int len, unsigned short timeout)
+{
+    xmodemRingLink *l = link;
+    unsigned short waited;
+    int n;
+
+    while ((n = xmodemRingPop(l->rx, buf, len)) == 0 && timeout > 0 && l->wait) {
+        waited = l->wait(l->user, timeout);
+        timeout = waited < timeout ? (unsigned short)(timeout - waited) : 0;
+    }
+    return n;
+}
+
+void xmodemRingOutBlock(void *link, unsigned char const *buf, int len)
+{
+    xmodemRingLink *l = link;
+    int n;
+
+    while (len > 0) {
+        n = xmodemRingPush(l->tx, buf, len);
+        buf += n;
+        len -= n;
+        if (n > 0 && l->kick) {
+            l->kick(l->user);
+        }
+        if (len > 0 && l->wait) {
+            /* the transmit interrupt makes room as it sends */
+            l->wait(l->user, XMODEM_RING_OUTPUT_WAIT);
+        }
+    }
+}
+
+int xmodemRingSession(xmodemSession *session, xmodemRingLink *link)
+{
+    /* input that returns at once would be taken for a whole timeout passing, unless the clock says otherwise */
+    if (link->wait == NULL && session->clock == NULL) {
+        return -1;
+    }
+    session->inByte = xmodemRingInByte;
+    session->outByte = xmodemRingOutByte;
+    session->inBlock = xmodemRingInBlock;
+    session->outBlock = xmodemRingOutBlock;
+    session->user = link;
+    return 0;
+}
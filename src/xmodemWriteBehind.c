@@ -0,0 +1,126 @@
+/*
+ * A write-behind receive pipeline.
+ *
+ * Buffers are used in turn. The receiver marks a buffer busy before
+ * committing it and only the completion clears the mark, so each mark
+ * has one writer at a time and needs no lock. The receiver takes the
+ * next buffer in turn rather than any free one, which keeps the writes
+ * in stream order for storage that needs it.
+ */
+
+#include <stddef.h>
+#include "../include/xmodemWriteBehind.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define PUBLISH(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+#define LOAD(p) (*(p))
+#define PUBLISH(p, v) (*(p) = (v))
+#endif
+
+int xmodemWriteBehindInit(xmodemWriteBehind *wb, unsigned char *storage, int size, int count)
+{
+    int i;
+
+    if (size <= 0 || count < 1 || count > XMODEM_WRITE_BEHIND_MAX_BUFFERS) {
+        return -1;
+    }
+    wb->commit = NULL;
+    wb->wait = NULL;
+    wb->user = NULL;
+    wb->waitLimit = 0;
+    wb->storage = storage;
+    wb->bufsz = size;
+    wb->count = count;
+    wb->next = 0;
+    wb->current = -1;
+    wb->handed = 0;
+    wb->failed = 0;
+    for (i = 0; i < XMODEM_WRITE_BEHIND_MAX_BUFFERS; i++) {
+        wb->busy[i] = 0;
+    }
+    return 0;
+}
+
+static void commit(xmodemWriteBehind *wb, int len)
+{
+    int i = wb->current;
+    long offset = wb->handed;
+
+    wb->current = -1;
+    wb->handed += len;
+    PUBLISH(&wb->busy[i], 1);
+    wb->commit(wb->user, wb->storage + (long)i * wb->bufsz, len, offset);
+}
+
+/*
+ * wait for buffer i to be free, or with anyFailure only until a write fails, returns 0 once it is free, or -1 if
+ * waitLimit passed
+ */
+static int waitFree(xmodemWriteBehind *wb, int i, int anyFailure)
+{
+    unsigned long waited = 0;
+
+    while (LOAD(&wb->busy[i]) && !(anyFailure && LOAD(&wb->failed))) {
+        if (wb->waitLimit && waited >= wb->waitLimit) {
+            return -1;
+        }
+        if (wb->wait) {
+            waited += wb->wait(wb->user, XMODEM_WRITE_BEHIND_WAIT);
+        }
+    }
+    return 0;
+}
+
+unsigned char *xmodemWriteBehindGetBuffer(void *writeBehind, int *size)
+{
+    xmodemWriteBehind *wb = writeBehind;
+    int i = wb->next;
+
+    if (wb->current >= 0) {
+        /* the receiver only asks again once the last buffer is full */
+        commit(wb, wb->bufsz);
+    }
+    if (waitFree(wb, i, 1) < 0 || LOAD(&wb->failed)) {
+        return NULL;
+    }
+    wb->current = i;
+    wb->next = (i + 1) % wb->count;
+    *size = wb->bufsz;
+    return wb->storage + (long)i * wb->bufsz;
+}
+
+void xmodemWriteBehindDone(xmodemWriteBehind *wb, unsigned char *buf, int failed)
+{
+    int i = (int)((buf - wb->storage) / wb->bufsz);
+
+    if (failed) {
+        PUBLISH(&wb->failed, 1);
+    }
+    PUBLISH(&wb->busy[i], 0);
+}
+
+void xmodemWriteBehindEnd(xmodemWriteBehind *wb, long length)
+{
+    long len = length - wb->handed;
+
+    if (wb->current >= 0 && len > 0) {
+        commit(wb, len < wb->bufsz ? (int)len : wb->bufsz);
+    }
+    wb->current = -1;
+    wb->handed = 0;
+}
+
+int xmodemWriteBehindSync(xmodemWriteBehind *wb)
+{
+    int i;
+
+    /* a failed write still leaves the others to finish with their buffers */
+    for (i = 0; i < wb->count; i++) {
+        if (waitFree(wb, i, 0) < 0) {
+            return -1;
+        }
+    }
+    return LOAD(&wb->failed) ? -1 : 0;
+}
@@ -0,0 +1,72 @@
+//
+// Additive checksum implementation tests
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "gtest/gtest.h"
+#include "checksum.h"
+
+static unsigned char referenceChecksum(const unsigned char *buf, int len) {
+    unsigned int sum = 0;
+    for(int i = 0; i < len; i++) {
+        sum += buf[i];
+    }
+    return (unsigned char)sum;
+}
+
+class checksumTests : public ::testing::Test {
+protected:
+    unsigned char data[4096 + 32];
+    unsigned char copy[4096 + 64];
+
+    void SetUp() override {
+        srandom(2);
+        for(size_t i = 0; i < sizeof(data); i++) {
+            data[i] = (unsigned char)random();
+        }
+    }
+};
+
+TEST_F(checksumTests, testImplementationsMatchReference) {
+    for(int offset = 0; offset < 32; offset++) {
+        for(int len = 0; len <= 300; len++) {
+            unsigned char expected = referenceChecksum(data + offset, len);
+            ASSERT_EQ(checksum8(0, data + offset, len), expected) << "offset " << offset << " len " << len;
+            ASSERT_EQ(checksum8_bytewise(0, data + offset, len), expected);
+            ASSERT_EQ(checksum8_simd(0, data + offset, len), expected);
+        }
+    }
+    ASSERT_EQ(checksum8_simd(0, data, 4096), referenceChecksum(data, 4096));
+}
+
+TEST_F(checksumTests, testSaturatedLanes) {
+    // every lane wraps many times over
+    memset(data, 0xff, sizeof(data));
+    ASSERT_EQ(checksum8_simd(0, data, 4096), referenceChecksum(data, 4096));
+    ASSERT_EQ(checksum8_simd(0, data, 1023), referenceChecksum(data, 1023));
+}
+
+TEST_F(checksumTests, testContinue) {
+    for(int split = 0; split <= 1024; split += 37) {
+        ASSERT_EQ(checksum8(checksum8(0, data, split), data + split, 1024 - split), referenceChecksum(data, 1024));
+    }
+}
+
+TEST_F(checksumTests, testCopy) {
+    for(int offset = 0; offset < 32; offset += 3) {
+        for(int len = 0; len <= 1100; len += len < 80 ? 1 : 41) {
+            memset(copy, 0, sizeof(copy));
+            ASSERT_EQ(checksum8_copy(7, copy + 32 - offset, data + offset, len),
+                      (unsigned char)(7 + referenceChecksum(data + offset, len))) << "offset " << offset << " len " << len;
+            ASSERT_EQ(memcmp(copy + 32 - offset, data + offset, len), 0);
+            // nothing written either side
+            for(int i = 0; i < 32 - offset; i++) {
+                ASSERT_EQ(copy[i], 0);
+            }
+            for(int i = 32 - offset + len; i < (int)sizeof(copy); i++) {
+                ASSERT_EQ(copy[i], 0);
+            }
+        }
+    }
+}
@@ -0,0 +1,87 @@
+//
+// CRC16 implementation tests
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "gtest/gtest.h"
+#include "crc16.h"
+
+static unsigned short referenceCrc(const unsigned char *buf, int len) {
+    unsigned short crc = 0;
+    for(int i = 0; i < len; i++) {
+        crc ^= (unsigned short)(buf[i] << 8);
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (unsigned short)((crc << 1) ^ 0x1021) : (unsigned short)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+class crc16Tests : public ::testing::Test {
+protected:
+    unsigned char data[4096 + 16];
+
+    void SetUp() override {
+        srandom(1);
+        for(size_t i = 0; i < sizeof(data); i++) {
+            data[i] = (unsigned char)random();
+        }
+    }
+};
+
+TEST_F(crc16Tests, testCheckValue) {
+    const unsigned char check[] = "123456789";
+    ASSERT_EQ(crc16_ccitt(check, 9), 0x31C3);
+}
+
+TEST_F(crc16Tests, testImplementationsMatchReference) {
+    for(int offset = 0; offset < 16; offset++) {
+        for(int len = 0; len <= 300; len++) {
+            unsigned short expected = referenceCrc(data + offset, len);
+            ASSERT_EQ(crc16_ccitt(data + offset, len), expected) << "offset " << offset << " len " << len;
+            ASSERT_EQ(crc16_ccitt_bytewise(0, data + offset, len), expected);
+            ASSERT_EQ(crc16_ccitt_slice8(0, data + offset, len), expected);
+            ASSERT_EQ(crc16_ccitt_hw(0, data + offset, len), expected);
+        }
+    }
+    ASSERT_EQ(crc16_ccitt_hw(0, data, 4096), referenceCrc(data, 4096));
+}
+
+TEST_F(crc16Tests, testImplementationsContinue) {
+    for(int split = 0; split <= 1024; split += 37) {
+        unsigned short expected = referenceCrc(data, 1024);
+        ASSERT_EQ(crc16_ccitt_slice8(crc16_ccitt_slice8(0, data, split), data + split, 1024 - split), expected);
+        ASSERT_EQ(crc16_ccitt_hw(crc16_ccitt_hw(0, data, split), data + split, 1024 - split), expected);
+    }
+}
+
+TEST_F(crc16Tests, testStreaming) {
+    for(int piece = 1; piece <= 64; piece = piece * 2 + 1) {
+        unsigned short crc = crc16_ccitt_init();
+        for(int i = 0; i < 1024; i += piece) {
+            crc = crc16_ccitt_update(crc, data + i, i + piece > 1024 ? 1024 - i : piece);
+        }
+        ASSERT_EQ(crc16_ccitt_final(crc), crc16_ccitt(data, 1024)) << "piece " << piece;
+    }
+}
+
+TEST_F(crc16Tests, testCopy) {
+    unsigned char copy[1200];
+    for(int offset = 0; offset < 16; offset += 3) {
+        for(int len = 0; len <= 1100; len += len < 80 ? 1 : 41) {
+            memset(copy, 0, sizeof(copy));
+            unsigned short expected = referenceCrc(data + offset, len);
+            ASSERT_EQ(crc16_ccitt_copy(0, copy + 16 - offset, data + offset, len), expected)
+                << "offset " << offset << " len " << len;
+            ASSERT_EQ(memcmp(copy + 16 - offset, data + offset, len), 0);
+            for(int i = 16 - offset + len; i < (int)sizeof(copy); i++) {
+                ASSERT_EQ(copy[i], 0);
+            }
+        }
+    }
+    // continuing a CRC
+    unsigned short crc = crc16_ccitt_copy(0, copy, data, 100);
+    ASSERT_EQ(crc16_ccitt_copy(crc, copy + 100, data + 100, 900), referenceCrc(data, 1000));
+    ASSERT_EQ(memcmp(copy, data, 1000), 0);
+}
@@ -0,0 +1,207 @@
+#include <string.h>
+#include <algorithm>
+#include "gtest/gtest.h"
+#include "xmodem.h"
+#include "linksim.h"
+
+struct SimBuffer {
+    uint8_t *data;
+    int size;
+    int offset;
+};
+
+static unsigned char const * sim_GetTxBuffer(void *user, int *size) {
+    SimBuffer *b = (SimBuffer *)user;
+    if(b->offset == b->size) {
+        return NULL;
+    }
+    *size = b->size - b->offset;
+    b->offset = b->size;
+    return b->data;
+}
+
+static unsigned char * sim_GetRxBuffer(void *user, int *size) {
+    SimBuffer *b = (SimBuffer *)user;
+    if(b->offset == b->size) {
+        return NULL;
+    }
+    *size = b->size - b->offset;
+    b->offset = b->size;
+    return b->data;
+}
+
+class linksimTests : public ::testing::Test {
+protected:
+    enum { size = 20000 };
+    uint8_t data[size];
+    uint8_t output[size + 1024];
+    SimBuffer tx, rx;
+    xmodemSession sendSession, receiveSession;
+    xmodemEngine sender, receiver;
+    linksimConfig config, back;
+    linksim sim;
+
+    void SetUp() override {
+        for(int j = 0; j < size; j++) {
+            data[j] = (uint8_t)(j * 13 + 5);
+        }
+        memset(output, 0, sizeof(output));
+        tx = { data, size, 0 };
+        rx = { output, (int)sizeof(output), 0 };
+        xmodemSessionInit(&sendSession);
+        sendSession.user = &tx;
+        xmodemSessionInit(&receiveSession);
+        receiveSession.user = &rx;
+        memset(&config, 0, sizeof(config));
+        memset(&sim, 0, sizeof(sim));
+        config.baud = 115200;
+        config.latency = 2;
+        back = config;
+    }
+
+    void TearDown() override {
+        linksimFree(&sim);
+    }
+
+    // the acknowledgements go over back when it is given, and over config like the data otherwise
+    int run(unsigned long seed, linksimConfig const *ackConfig = NULL) {
+        linksimInit(&sim, &config, ackConfig ? ackConfig : &config, seed);
+        tx.offset = 0;
+        rx.offset = 0;
+        xmodemEngineInitTransmit(&sender, &sendSession, sim_GetTxBuffer, linksimNow(&sim));
+        xmodemEngineInitReceive(&receiver, &receiveSession, sim_GetRxBuffer, linksimNow(&sim));
+        return linksimRun(&sim, &sender, &receiver, 3600UL * 1000);
+    }
+
+    void expectSuccess() {
+        ASSERT_EQ(xmodemEngineResult(&sender), size);
+        ASSERT_EQ(xmodemEngineResult(&receiver), size);
+        ASSERT_EQ(memcmp(output, data, size), 0);
+    }
+};
+
+TEST_F(linksimTests, testLineRate) {
+    config.baud = 9600;
+    ASSERT_EQ(run(1), 0);
+    expectSuccess();
+
+    // every byte takes 10 bits on the line, and each packet waits a round trip for its ACK
+    const int packets = (size + 127) / 128;
+    const unsigned long lineTime = (unsigned long)(packets * (128 + 5)) * 10 * 1000 / 9600;
+    const unsigned long roundTrips = (unsigned long)packets * 2 * config.latency;
+    ASSERT_GE(linksimNow(&sim), lineTime + roundTrips);
+    ASSERT_LE(linksimNow(&sim), (lineTime + roundTrips) * 11 / 10 + 2 * sendSession.flushTimeout);
+    ASSERT_EQ(linksimGetCounts(&sim, 0)->bytes, xmodemEngineStats(&sender)->bytesSent);
+    ASSERT_EQ(linksimGetCounts(&sim, 0)->lost, 0);
+    // the sender spends most of its time transmitting at this rate
+    ASSERT_GT(xmodemEngineStats(&sender)->transmitTime, xmodemEngineStats(&sender)->waitTime);
+}
+
+TEST_F(linksimTests, testSeedRepeatsRun) {
+    config.corruptRate = 1e-3;
+    config.lossRate = 1e-4;
+    ASSERT_EQ(run(42), 0);
+    expectSuccess();
+    unsigned long first = linksimNow(&sim);
+    xmodemStats stats = *xmodemEngineStats(&sender);
+    linksimCounts counts = *linksimGetCounts(&sim, 0);
+    linksimFree(&sim);
+
+    ASSERT_EQ(run(42), 0);
+    expectSuccess();
+    ASSERT_EQ(linksimNow(&sim), first);
+    ASSERT_EQ(xmodemEngineStats(&sender)->naks, stats.naks);
+    ASSERT_EQ(xmodemEngineStats(&sender)->retransmittedBytes, stats.retransmittedBytes);
+    ASSERT_EQ(linksimGetCounts(&sim, 0)->corrupted, counts.corrupted);
+    ASSERT_EQ(linksimGetCounts(&sim, 0)->lost, counts.lost);
+    linksimFree(&sim);
+
+    ASSERT_EQ(run(43), 0);
+    expectSuccess();
+    ASSERT_NE(linksimNow(&sim), first);
+}
+
+TEST_F(linksimTests, testNoisyLink) {
+    config.corruptRate = 1e-3;
+    sendSession.blockSize = 1024;
+    sendSession.adaptiveBlockSize = 1;
+    for(unsigned long seed = 1; seed <= 5; seed++) {
+        ASSERT_EQ(run(seed), 0);
+        expectSuccess();
+        ASSERT_GT(linksimGetCounts(&sim, 0)->corrupted, 0);
+        ASSERT_GT(xmodemEngineStats(&sender)->retransmittedBytes, 0);
+        linksimFree(&sim);
+    }
+}
+
+TEST_F(linksimTests, testStreamingHidesLatency) {
+    config.latency = 50;
+    ASSERT_EQ(run(1), 0);
+    expectSuccess();
+    unsigned long plain = linksimNow(&sim);
+    linksimFree(&sim);
+
+    static unsigned char window[16 * (128 + 5)];
+    sendSession.window = receiveSession.window = 16;
+    sendSession.windowBuffer = window;
+    ASSERT_EQ(run(1), 0);
+    expectSuccess();
+    ASSERT_LT(linksimNow(&sim) * 3, plain);
+}
+
+TEST_F(linksimTests, testAdaptiveTimeouts) {
+    config.corruptRate = 1e-4;
+    ASSERT_EQ(run(3), 0);
+    expectSuccess();
+    ASSERT_GT(xmodemEngineStats(&sender)->naks, 0);
+    unsigned long fixed = linksimNow(&sim);
+    linksimFree(&sim);
+
+    // recovering from each error takes a few round trips rather than the 1.5 s flush
+    sendSession.adaptiveTimeouts = receiveSession.adaptiveTimeouts = 1;
+    ASSERT_EQ(run(3), 0);
+    expectSuccess();
+    ASSERT_GT(xmodemEngineStats(&sender)->naks, 0);
+    ASSERT_LT(linksimNow(&sim) * 2, fixed);
+
+    // the round trip covers the latency both ways, and for the transmitter the end of the packet leaving the FIFO
+    ASSERT_GE(xmodemEngineStats(&sender)->rtt, 2 * config.latency);
+    ASSERT_LE(xmodemEngineStats(&sender)->rtt, 2 * config.latency + 3);
+    ASSERT_GE(xmodemEngineStats(&receiver)->rtt, 2 * config.latency);
+    ASSERT_LE(xmodemEngineStats(&receiver)->rtt, 2 * config.latency + 3);
+}
+
+TEST_F(linksimTests, testResyncAfterLoss) {
+    // lost bytes leave packets short and the rest of them arriving where a header is expected
+    config.lossRate = 1e-3;
+    config.corruptRate = 1e-3;
+    sendSession.baud = receiveSession.baud = config.baud;
+    sendSession.adaptiveTimeouts = receiveSession.adaptiveTimeouts = 1;
+    for(unsigned long seed = 1; seed <= 5; seed++) {
+        ASSERT_EQ(run(seed), 0);
+        expectSuccess();
+        ASSERT_GT(linksimGetCounts(&sim, 0)->lost, 0);
+        // each error costs about a packet and a few round trips, not seconds of waiting for silence
+        const int errors = xmodemEngineStats(&receiver)->naks + xmodemEngineStats(&sender)->timeouts;
+        const unsigned long lineTime = (unsigned long)((size + 127) / 128 * (128 + 5)) * 10 * 1000 / config.baud;
+        ASSERT_LT(linksimNow(&sim), lineTime * 2 + errors * 50);
+        linksimFree(&sim);
+    }
+}
+
+TEST_F(linksimTests, testStreamingGoBackPastRetries) {
+    // a lost ACK leaves the transmitter going back over more packets than maxRetrans, all of which the receiver has
+    static unsigned char window[127 * (128 + 5)];
+    sendSession.window = receiveSession.window = 127;
+    sendSession.windowBuffer = window;
+    config.latency = back.latency = 500;
+    back.lossRate = 0.2;
+    int duplicates = 0;
+    for(unsigned long seed = 1; seed <= 20; seed++) {
+        ASSERT_EQ(run(seed, &back), 0);
+        expectSuccess();
+        duplicates = std::max(duplicates, xmodemEngineStats(&receiver)->duplicates);
+        linksimFree(&sim);
+    }
+    ASSERT_GT(duplicates, receiveSession.maxRetrans);
+}
@@ -0,0 +1,109 @@
+//
+// LZSS codec tests
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <vector>
+#include "gtest/gtest.h"
+#include "lz.h"
+
+class lzTests : public ::testing::Test {
+protected:
+    lzEncoder encoder;
+    lzDecoder decoder;
+
+    // compress in pieces of the given sizes, as the transmitter does from buffers and into packets
+    std::vector<unsigned char> compress(const unsigned char *data, int size, int inPiece, int outPiece) {
+        std::vector<unsigned char> out;
+        unsigned char buf[1024];
+        int offset = 0, n;
+        lzEncoderInit(&encoder);
+        for(;;) {
+            int final = offset == size;
+            while((n = lzEncoderGet(&encoder, buf, outPiece, final)) > 0) {
+                out.insert(out.end(), buf, buf + n);
+            }
+            if(final) break;
+            offset += lzEncoderPut(&encoder, data + offset, MIN(inPiece, size - offset));
+        }
+        EXPECT_EQ(encoder.in, size);
+        return out;
+    }
+
+    std::vector<unsigned char> decompress(const std::vector<unsigned char> &in, int inPiece, int outPiece) {
+        std::vector<unsigned char> out;
+        unsigned char buf[1024];
+        size_t offset = 0;
+        lzDecoderInit(&decoder);
+        while(!lzDecoderDone(&decoder) && (offset < in.size() || lzDecoderPending(&decoder))) {
+            int used;
+            int n = lzDecode(&decoder, in.data() + offset, MIN(inPiece, (int)(in.size() - offset)), &used,
+                             buf, outPiece);
+            out.insert(out.end(), buf, buf + n);
+            offset += used;
+        }
+        return out;
+    }
+
+    void roundTrip(const unsigned char *data, int size, int piece) {
+        std::vector<unsigned char> packed = compress(data, size, piece, piece);
+        std::vector<unsigned char> unpacked = decompress(packed, piece, piece);
+        ASSERT_EQ((int)unpacked.size(), size);
+        ASSERT_EQ(memcmp(unpacked.data(), data, size), 0);
+        ASSERT_TRUE(lzDecoderDone(&decoder));
+    }
+};
+
+TEST_F(lzTests, testRepetitiveData) {
+    static unsigned char data[20000];
+    for(int i = 0; i < (int)sizeof(data); i++) {
+        data[i] = (unsigned char)(i * 13 + 5);
+    }
+    std::vector<unsigned char> packed = compress(data, sizeof(data), 1000, 128);
+    ASSERT_LT(packed.size(), sizeof(data) / 10);
+    for(int piece : { 1, 7, 128, 1000 }) {
+        roundTrip(data, sizeof(data), piece);
+    }
+}
+
+TEST_F(lzTests, testRandomData) {
+    // incompressible data grows by a flag bit per byte, plus the end of the stream
+    static unsigned char data[10000];
+    srandom(1);
+    for(int i = 0; i < (int)sizeof(data); i++) {
+        data[i] = (unsigned char)random();
+    }
+    std::vector<unsigned char> packed = compress(data, sizeof(data), 1024, 1024);
+    ASSERT_LE(packed.size(), sizeof(data) + sizeof(data) / 8 + 3);
+    for(int piece : { 1, 13, 1024 }) {
+        roundTrip(data, sizeof(data), piece);
+    }
+}
+
+TEST_F(lzTests, testText) {
+    static char text[8192];
+    int len = 0;
+    for(int i = 0; len < (int)sizeof(text) - 64; i++) {
+        len += snprintf(text + len, sizeof(text) - len, "line %d: status ok, value %d\n", i, i % 17);
+    }
+    std::vector<unsigned char> packed = compress((unsigned char *)text, len, 512, 128);
+    ASSERT_LT(packed.size() * 2, (size_t)len);
+    roundTrip((unsigned char *)text, len, 3);
+    roundTrip((unsigned char *)text, len, 512);
+}
+
+TEST_F(lzTests, testEmptyAndPadding) {
+    std::vector<unsigned char> packed = compress(NULL, 0, 1, 1);
+    ASSERT_EQ(packed.size(), 3u);
+
+    // what follows the end of the stream, such as packet padding, is not decoded
+    const unsigned char data[] = "abcabcabcabc";
+    packed = compress(data, sizeof(data), 64, 64);
+    packed.insert(packed.end(), 100, 0x1A);
+    std::vector<unsigned char> unpacked = decompress(packed, 1024, 1024);
+    ASSERT_EQ(unpacked.size(), sizeof(data));
+    ASSERT_EQ(memcmp(unpacked.data(), data, sizeof(data)), 0);
+}
@@ -0,0 +1,235 @@
+//
+// Coroutine transfer tests over socket pairs
+//
+
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "xmodemEventLoop.hpp"
+
+struct AsyncTransfer {
+    const uint8_t *data;
+    uint8_t *output;
+    int size;
+    int offset;
+};
+
+static unsigned char const *async_GetTxBuffer(void *user, int *size) {
+    AsyncTransfer *t = (AsyncTransfer *)user;
+    if(t->offset == t->size) {
+        return NULL;
+    }
+    // hand out the data in uneven pieces, as from a file
+    *size = t->size - t->offset < 3000 ? t->size - t->offset : 3000;
+    unsigned char const *ret = t->data + t->offset;
+    t->offset += *size;
+    return ret;
+}
+
+static unsigned char *async_GetRxBuffer(void *user, int *size) {
+    AsyncTransfer *t = (AsyncTransfer *)user;
+    if(t->offset == t->size) {
+        return NULL;
+    }
+    *size = t->size - t->offset;
+    unsigned char *ret = t->output + t->offset;
+    t->offset = t->size;
+    return ret;
+}
+
+// both ends of a transfer, each on a loop of its own choosing
+struct AsyncPair {
+    int fds[2];
+    std::vector<uint8_t> data, output;
+    AsyncTransfer send, receive;
+    xmodemSession sendSession, receiveSession;
+    std::unique_ptr<xmodem::Port> sendPort, receivePort;
+
+    AsyncPair(int i, int size) : data(size), output(size + 1024) {
+        EXPECT_EQ(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds), 0);
+        // odd bytes, never NUL or CTRLZ, so the end of the data is not taken for padding
+        for(int j = 0; j < size; j++) {
+            data[j] = (uint8_t)((j * 7 + i) | 1);
+        }
+        send = { data.data(), NULL, size, 0 };
+        receive = { NULL, output.data(), size + 1024, 0 };
+        xmodemSessionInit(&sendSession);
+        sendSession.user = &send;
+        sendSession.blockSize = 1024;
+        xmodemSessionInit(&receiveSession);
+        receiveSession.user = &receive;
+        // the end of a transfer waits for the line to be quiet
+        sendSession.flushTimeout = receiveSession.flushTimeout = 50;
+    }
+
+    ~AsyncPair() {
+        sendPort.reset();
+        receivePort.reset();
+        for(int fd : fds) {
+            if(fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+};
+
+TEST(xmodemAsyncTests, testTransfer) {
+    AsyncPair pair(0, 20000);
+    xmodemStats sendStats, receiveStats;
+    pair.sendSession.stats = &sendStats;
+    pair.receiveSession.stats = &receiveStats;
+    xmodem::EventLoop loop;
+    pair.sendPort.reset(new xmodem::Port(loop, pair.fds[0]));
+    pair.receivePort.reset(new xmodem::Port(loop, pair.fds[1]));
+    auto sent = xmodem::transmit(*pair.sendPort, pair.sendSession, async_GetTxBuffer);
+    auto received = xmodem::receive(*pair.receivePort, pair.receiveSession, async_GetRxBuffer);
+    sent.start();
+    received.start();
+    ASSERT_EQ(loop.run(), 0);
+    ASSERT_TRUE(sent.done());
+    ASSERT_TRUE(received.done());
+    ASSERT_EQ(sent.result(), 20000);
+    ASSERT_EQ(received.result(), 20000);
+    ASSERT_EQ(memcmp(pair.output.data(), pair.data.data(), 20000), 0);
+    ASSERT_EQ(receiveStats.dataBytes, 20000);
+    ASSERT_EQ(sendStats.dataBytes, 20000);
+    ASSERT_GT(sendStats.packets, 0);
+}
+
+// a coroutine awaiting transfers, as an application would
+static xmodem::Task<int> sendTwice(xmodem::Port &port, xmodemSession const &first, xmodemSession const &second) {
+    int a = co_await xmodem::transmit(port, first, async_GetTxBuffer);
+    int b = co_await xmodem::transmit(port, second, async_GetTxBuffer);
+    co_return a > 0 && b > 0 ? a + b : -1;
+}
+
+static xmodem::Task<int> receiveTwice(xmodem::Port &port, xmodemSession const &first, xmodemSession const &second) {
+    int a = co_await xmodem::receive(port, first, async_GetRxBuffer);
+    int b = co_await xmodem::receive(port, second, async_GetRxBuffer);
+    co_return a > 0 && b > 0 ? a + b : -1;
+}
+
+TEST(xmodemAsyncTests, testAwaitTransfers) {
+    AsyncPair pair(1, 5000), second(2, 7000);
+    xmodem::EventLoop loop;
+    xmodem::Port sendPort(loop, pair.fds[0]), receivePort(loop, pair.fds[1]);
+    auto sent = sendTwice(sendPort, pair.sendSession, second.sendSession);
+    auto received = receiveTwice(receivePort, pair.receiveSession, second.receiveSession);
+    sent.start();
+    received.start();
+    ASSERT_EQ(loop.run(), 0);
+    ASSERT_EQ(sent.result(), 12000);
+    ASSERT_EQ(received.result(), 12000);
+    ASSERT_EQ(memcmp(second.output.data(), second.data.data(), 7000), 0);
+}
+
+TEST(xmodemAsyncTests, testHungUp) {
+    // a transfer whose far end has gone fails on its own without holding up the rest
+    AsyncPair gone(0, 1000), pair(1, 1000);
+    close(gone.fds[1]);
+    gone.fds[1] = -1;
+    gone.sendSession.syncTimeout = 20;
+    gone.sendSession.syncRetries = 3;
+    xmodem::EventLoop loop;
+    xmodem::Port gonePort(loop, gone.fds[0]), sendPort(loop, pair.fds[0]), receivePort(loop, pair.fds[1]);
+    auto failed = xmodem::transmit(gonePort, gone.sendSession, async_GetTxBuffer);
+    auto sent = xmodem::transmit(sendPort, pair.sendSession, async_GetTxBuffer);
+    auto received = xmodem::receive(receivePort, pair.receiveSession, async_GetRxBuffer);
+    failed.start();
+    sent.start();
+    received.start();
+    ASSERT_EQ(loop.run(), 0);
+    // once the retries are out, the cancel it sends cannot be written either
+    ASSERT_EQ(failed.result(), xmodemErrorLinkFailed);
+    ASSERT_EQ(sent.result(), 1000);
+    ASSERT_EQ(received.result(), 1000);
+}
+
+TEST(xmodemAsyncTests, testWriteFails) {
+    // a receiver whose first C cannot be written stops at once rather than waiting out its retries
+    AsyncPair gone(0, 1000);
+    close(gone.fds[0]);
+    gone.fds[0] = -1;
+    gone.receiveSession.syncTimeout = 10000;
+    xmodemStats stats;
+    gone.receiveSession.stats = &stats;
+    xmodem::EventLoop loop;
+    xmodem::Port receivePort(loop, gone.fds[1]);
+    auto failed = xmodem::receive(receivePort, gone.receiveSession, async_GetRxBuffer);
+    auto start = std::chrono::steady_clock::now();
+    failed.start();
+    ASSERT_EQ(loop.run(), 0);
+    ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+    ASSERT_EQ(failed.result(), xmodemErrorLinkFailed);
+    ASSERT_EQ(stats.timeouts, 0);
+}
+
+TEST(xmodemAsyncTests, testManyTransfers) {
+    // many transfers at once on a small pool of threads, each running a loop with a share of the ports
+    const int pairs = 200, threads = 4, size = 64 * 1024;
+    std::vector<std::unique_ptr<AsyncPair>> all;
+    std::vector<xmodem::EventLoop> loops(threads);
+    std::vector<xmodem::Task<int>> sent, received;
+    for(int i = 0; i < pairs; i++) {
+        all.emplace_back(new AsyncPair(i, size));
+        AsyncPair &pair = *all.back();
+        // the two ends of some pairs run on different threads
+        pair.sendPort.reset(new xmodem::Port(loops[i % threads], pair.fds[0]));
+        pair.receivePort.reset(new xmodem::Port(loops[(i + i / threads) % threads], pair.fds[1]));
+    }
+    unsigned long start = xmodem::EventLoop::now();
+    std::vector<std::thread> pool;
+    for(int t = 0; t < threads; t++) {
+        for(int i = 0; i < pairs; i++) {
+            AsyncPair &pair = *all[i];
+            if(i % threads == t) {
+                sent.push_back(xmodem::transmit(*pair.sendPort, pair.sendSession, async_GetTxBuffer));
+            }
+            if((i + i / threads) % threads == t) {
+                received.push_back(xmodem::receive(*pair.receivePort, pair.receiveSession, async_GetRxBuffer));
+            }
+        }
+    }
+    // the tasks are started by the thread that runs their loop
+    for(int t = 0, s = 0, r = 0; t < threads; t++) {
+        int sends = 0, receives = 0;
+        for(int i = 0; i < pairs; i++) {
+            sends += i % threads == t;
+            receives += (i + i / threads) % threads == t;
+        }
+        pool.emplace_back([&loops, &sent, &received, t, s, r, sends, receives] {
+            for(int i = 0; i < sends; i++) {
+                sent[s + i].start();
+            }
+            for(int i = 0; i < receives; i++) {
+                received[r + i].start();
+            }
+            EXPECT_EQ(loops[t].run(), 0);
+        });
+        s += sends;
+        r += receives;
+    }
+    for(auto &thread : pool) {
+        thread.join();
+    }
+    unsigned long elapsed = xmodem::EventLoop::now() - start;
+
+    for(int i = 0; i < pairs; i++) {
+        ASSERT_TRUE(sent[i].done());
+        ASSERT_EQ(sent[i].result(), size);
+        ASSERT_TRUE(received[i].done());
+        ASSERT_EQ(received[i].result(), size);
+    }
+    for(int i = 0; i < pairs; i++) {
+        ASSERT_EQ(memcmp(all[i]->output.data(), all[i]->data.data(), size), 0);
+    }
+    // every transfer ends with a quiet flushTimeout, which dominates the time of short runs
+    long total = (long)pairs * size;
+    printf("%d transfers of %d bytes on %d threads: %lu ms, %ld KB/s aggregate\n", pairs, size, threads, elapsed,
+           elapsed > 0 ? total / (long)elapsed * 1000 / 1024 : 0);
+}
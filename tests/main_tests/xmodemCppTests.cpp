@@ -0,0 +1,367 @@
+//
+// Tests of the C++ transmitter and receiver of xmodem.hpp against the C engine
+//
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <deque>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "xmodem.hpp"
+#include "crc16.h"
+
+// called with each chunk on its way to the other end, which it may alter; returns false to lose it
+typedef bool (*ChunkFilter)(unsigned char *data, int len);
+
+// an I/O policy linking the C++ end to a C engine, on a clock that only advances while the C++ end waits
+struct EngineIo {
+    xmodemEngine *peer = nullptr;
+    unsigned long now = 0;
+    ChunkFilter toPeer = nullptr, fromPeer = nullptr;
+    // everything the C++ end sent, before any filter
+    std::vector<unsigned char> written;
+    std::deque<unsigned char> pending;
+
+    void collect() {
+        unsigned char const *data;
+        unsigned char copy[1024 + 5];
+        int n;
+        while((n = xmodemEnginePollOutput(peer, &data)) > 0) {
+            n = MIN(n, (int)sizeof(copy));
+            memcpy(copy, data, n);
+            xmodemEngineOutputSent(peer, n);
+            if(!fromPeer || fromPeer(copy, n)) {
+                pending.insert(pending.end(), copy, copy + n);
+            }
+        }
+    }
+
+    void write(unsigned char const *buf, int len) {
+        written.insert(written.end(), buf, buf + len);
+        std::vector<unsigned char> copy(buf, buf + len);
+        if(!toPeer || toPeer(copy.data(), len)) {
+            xmodemEngineFeed(peer, copy.data(), len);
+        }
+        collect();
+    }
+
+    int read(unsigned char *buf, int len, unsigned short timeout) {
+        unsigned long deadline = now + timeout;
+        collect();
+        while(pending.empty()) {
+            long t = xmodemEngineTimeout(peer);
+            if(t < 0 || now + t > deadline) {
+                now = deadline;
+                return 0;
+            }
+            now += t;
+            xmodemEngineTick(peer, now);
+            collect();
+        }
+        int n = MIN(len, (int)pending.size());
+        for(int i = 0; i < n; i++) {
+            buf[i] = pending.front();
+            pending.pop_front();
+        }
+        return n;
+    }
+
+    // run the engine on to its end once the C++ end is done
+    void finish() {
+        while(!xmodemEngineDone(peer)) {
+            collect();
+            pending.clear();
+            long t = xmodemEngineTimeout(peer);
+            ASSERT_GE(t, 0);
+            now += t;
+            xmodemEngineTick(peer, now);
+        }
+    }
+};
+
+// an I/O policy over a file descriptor
+struct FdIo {
+    int fd;
+
+    int read(unsigned char *buf, int len, unsigned short timeout) {
+        struct pollfd p = { fd, POLLIN, 0 };
+        if(poll(&p, 1, timeout) <= 0) {
+            return 0;
+        }
+        return (int)::read(fd, buf, len);
+    }
+
+    void write(unsigned char const *buf, int len) {
+        while(len > 0) {
+            ssize_t n = ::write(fd, buf, len);
+            if(n <= 0) {
+                return;
+            }
+            buf += n;
+            len -= (int)n;
+        }
+    }
+};
+
+static int framesSeen = 0;
+static int acksSeen = 0;
+
+static bool frameStart(unsigned char const *data, int len) {
+    return len >= 3 && (data[0] == 0x01 || data[0] == 0x02) && data[1] == (uint8_t)~data[2];
+}
+
+static bool corruptEveryFifthFrame(unsigned char *data, int len) {
+    if(frameStart(data, len) && ++framesSeen % 5 == 0) {
+        data[len / 2] ^= 0x55;
+    }
+    return true;
+}
+
+static bool loseThirdAck(unsigned char *data, int len) {
+    return !(len == 1 && data[0] == 0x06 && ++acksSeen == 3);
+}
+
+static bool loseCrcRequests(unsigned char *data, int len) {
+    return !(len == 1 && data[0] == 'C');
+}
+
+// both directions between two C engines, recording what each sends
+static void runEngines(xmodemEngine *tx, xmodemEngine *rx, unsigned long *now, ChunkFilter txFilter,
+                       std::vector<unsigned char> *txWire, std::vector<unsigned char> *rxWire) {
+    xmodemEngine *from[2] = { tx, rx }, *to[2] = { rx, tx };
+    std::vector<unsigned char> *wire[2] = { txWire, rxWire };
+    while(!xmodemEngineDone(tx) || !xmodemEngineDone(rx)) {
+        bool progress = false;
+        for(int i = 0; i < 2; i++) {
+            unsigned char const *data;
+            unsigned char copy[1024 + 5];
+            int n;
+            while((n = xmodemEnginePollOutput(from[i], &data)) > 0) {
+                n = MIN(n, (int)sizeof(copy));
+                memcpy(copy, data, n);
+                xmodemEngineOutputSent(from[i], n);
+                wire[i]->insert(wire[i]->end(), copy, copy + n);
+                if(i == 1 || !txFilter || txFilter(copy, n)) {
+                    xmodemEngineFeed(to[i], copy, n);
+                }
+                progress = true;
+            }
+        }
+        if(progress) {
+            continue;
+        }
+        long ta = xmodemEngineTimeout(tx), tb = xmodemEngineTimeout(rx);
+        long t = ta < 0 ? tb : (tb < 0 ? ta : MIN(ta, tb));
+        ASSERT_GE(t, 0);
+        *now += t;
+        xmodemEngineTick(tx, *now);
+        xmodemEngineTick(rx, *now);
+    }
+}
+
+class xmodemCppTests : public ::testing::Test {
+protected:
+    enum { size = 5000, chunk = 300 };
+    uint8_t data[size];
+    uint8_t output[size + 1024];
+    int sendOffset = 0, receiveOffset = 0, receiveLimit = sizeof(output);
+    xmodemSession session, peerSession;
+    xmodemEngine peer;
+    EngineIo io;
+
+    static unsigned char const * peer_GetTxBuffer(void *user, int *n) {
+        return ((xmodemCppTests *)user)->source(n);
+    }
+
+    static unsigned char * peer_GetRxBuffer(void *user, int *n) {
+        return ((xmodemCppTests *)user)->sink(n);
+    }
+
+    void SetUp() override {
+        for(int j = 0; j < size; j++) {
+            data[j] = (uint8_t)(j * 13 + 5);
+        }
+        xmodemSessionInit(&session);
+        xmodemSessionInit(&peerSession);
+        peerSession.user = this;
+        io.peer = &peer;
+        framesSeen = 0;
+        acksSeen = 0;
+    }
+
+    // the data in chunks, so packets span application buffers
+    unsigned char const *source(int *n) {
+        *n = MIN((int)chunk, size - sendOffset);
+        unsigned char const *ret = data + sendOffset;
+        sendOffset += *n;
+        return ret;
+    }
+
+    unsigned char *sink(int *n) {
+        *n = MIN((int)chunk, receiveLimit - receiveOffset);
+        unsigned char *ret = output + receiveOffset;
+        receiveOffset += *n;
+        return *n > 0 ? ret : nullptr;
+    }
+
+    template <int BlockSize>
+    int transmit() {
+        xmodemEngineInitReceive(&peer, &peerSession, peer_GetRxBuffer, io.now);
+        int result = xmodem::Transmitter<BlockSize, EngineIo>(session, io).run([this](int *n) { return source(n); });
+        io.finish();
+        return result;
+    }
+
+    template <xmodem::Check C, int MaxBlockSize = 1024>
+    int receive() {
+        xmodemEngineInitTransmit(&peer, &peerSession, peer_GetTxBuffer, io.now);
+        int result = xmodem::Receiver<C, EngineIo, MaxBlockSize>(session, io).run([this](int *n) { return sink(n); });
+        io.finish();
+        return result;
+    }
+
+    // what a C engine sends in place of the C++ end, with the same filter on the packets
+    std::vector<unsigned char> engineWire(bool transmitter, ChunkFilter txFilter) {
+        xmodemSession ownSession = peerSession;
+        if(transmitter) {
+            ownSession.blockSize = session.blockSize;
+        }
+        xmodemEngine own, other;
+        std::vector<unsigned char> txWire, rxWire;
+        unsigned long now = 0;
+        sendOffset = receiveOffset = 0;
+        framesSeen = acksSeen = 0;
+        xmodemEngineInitTransmit(transmitter ? &own : &other, transmitter ? &ownSession : &peerSession,
+                                 peer_GetTxBuffer, now);
+        xmodemEngineInitReceive(transmitter ? &other : &own, transmitter ? &peerSession : &ownSession,
+                                peer_GetRxBuffer, now);
+        runEngines(transmitter ? &own : &other, transmitter ? &other : &own, &now, txFilter, &txWire, &rxWire);
+        EXPECT_EQ(xmodemEngineResult(&own), size);
+        return transmitter ? txWire : rxWire;
+    }
+};
+
+TEST_F(xmodemCppTests, testCrcTable) {
+    xmodem::detail::Checker<xmodem::Check::crc> check;
+    xmodem::detail::checkRun(check, nullptr, data, size);
+    ASSERT_EQ(check.value, crc16_ccitt(data, size));
+}
+
+TEST_F(xmodemCppTests, testTransmit128) {
+    ASSERT_EQ(transmit<128>(), size);
+    ASSERT_EQ(xmodemEngineResult(&peer), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_EQ(xmodemEngineStats(&peer)->crc, 1);
+    ASSERT_EQ(io.written[0], 0x01);
+}
+
+TEST_F(xmodemCppTests, testTransmit1K) {
+    ASSERT_EQ(transmit<1024>(), size);
+    ASSERT_EQ(xmodemEngineResult(&peer), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_EQ(io.written[0], 0x02);
+}
+
+TEST_F(xmodemCppTests, testTransmitChecksum) {
+    // a receiver whose requests for the CRC are lost falls back to the checksum
+    peerSession.syncRetries = 3;
+    io.fromPeer = loseCrcRequests;
+    ASSERT_EQ(transmit<128>(), size);
+    ASSERT_EQ(xmodemEngineResult(&peer), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_EQ(xmodemEngineStats(&peer)->crc, 0);
+}
+
+TEST_F(xmodemCppTests, testTransmitCorruption) {
+    io.toPeer = corruptEveryFifthFrame;
+    ASSERT_EQ(transmit<128>(), size);
+    ASSERT_EQ(xmodemEngineResult(&peer), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_GT(xmodemEngineStats(&peer)->naks, 0);
+}
+
+TEST_F(xmodemCppTests, testTransmitWireMatchesEngine) {
+    ASSERT_EQ(transmit<128>(), size);
+    ASSERT_EQ(io.written, engineWire(true, nullptr));
+
+    io = EngineIo();
+    io.peer = &peer;
+    sendOffset = receiveOffset = 0;
+    session.blockSize = 1024;
+    ASSERT_EQ(transmit<1024>(), size);
+    ASSERT_EQ(io.written, engineWire(true, nullptr));
+}
+
+TEST_F(xmodemCppTests, testTransmitNoSync) {
+    // nothing comes back from a receiver whose every byte is lost
+    io.fromPeer = [](unsigned char *, int) { return false; };
+    ASSERT_EQ(transmit<128>(), xmodemErrorNoSync);
+    std::vector<unsigned char> cancel = { 0x18, 0x18, 0x18 };
+    ASSERT_EQ(io.written, cancel);
+}
+
+TEST_F(xmodemCppTests, testReceiveCrc) {
+    peerSession.blockSize = 1024;
+    ASSERT_EQ(receive<xmodem::Check::crc>(), size);
+    ASSERT_EQ(xmodemEngineResult(&peer), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_EQ(io.written[0], 'C');
+}
+
+TEST_F(xmodemCppTests, testReceiveChecksum) {
+    ASSERT_EQ(receive<xmodem::Check::checksum>(), size);
+    ASSERT_EQ(xmodemEngineResult(&peer), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_EQ(io.written[0], 0x15);
+}
+
+TEST_F(xmodemCppTests, testReceiveCorruptionAndLostAck) {
+    io.fromPeer = corruptEveryFifthFrame;
+    io.toPeer = loseThirdAck;
+    ASSERT_EQ(receive<xmodem::Check::crc>(), size);
+    ASSERT_EQ(xmodemEngineResult(&peer), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_GT(xmodemEngineStats(&peer)->naks, 0);
+}
+
+TEST_F(xmodemCppTests, testReceiveWireMatchesEngine) {
+    io.fromPeer = corruptEveryFifthFrame;
+    ASSERT_EQ(receive<xmodem::Check::crc>(), size);
+    ASSERT_EQ(io.written, engineWire(false, corruptEveryFifthFrame));
+}
+
+TEST_F(xmodemCppTests, testReceiveBufferFull) {
+    receiveLimit = 1000;
+    ASSERT_EQ(receive<xmodem::Check::crc>(), xmodemErrorBufferFull);
+    ASSERT_EQ(xmodemEngineResult(&peer), xmodemErrorCancelledByRemote);
+}
+
+TEST_F(xmodemCppTests, testReceive128Only) {
+    // 1K packets are NAKed until the transmitter falls back to 128 bytes
+    peerSession.blockSize = 1024;
+    peerSession.adaptiveBlockSize = 1;
+    ASSERT_EQ((receive<xmodem::Check::crc, 128>()), size);
+    ASSERT_EQ(xmodemEngineResult(&peer), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+}
+
+TEST_F(xmodemCppTests, testSocketPair) {
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    session.flushTimeout = 50;
+    FdIo tx = { fds[0] }, rx = { fds[1] };
+    int sent = 0, received = 0;
+    std::thread sender([&] {
+        sent = xmodem::Transmitter<1024, FdIo>(session, tx).run([this](int *n) { return source(n); });
+    });
+    received = xmodem::Receiver<xmodem::Check::crc, FdIo>(session, rx).run([this](int *n) { return sink(n); });
+    sender.join();
+    close(fds[0]);
+    close(fds[1]);
+    ASSERT_EQ(sent, size);
+    ASSERT_EQ(received, size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+}
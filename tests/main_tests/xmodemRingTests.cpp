@@ -0,0 +1,267 @@
+//
+// SPSC ring and ring I/O function tests
+//
+
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "xmodem.h"
+#include "xmodemRing.h"
+
+class xmodemRingTests : public ::testing::Test {
+protected:
+    unsigned char storage[16];
+    xmodemRing ring;
+
+    void SetUp() override {
+        ASSERT_EQ(xmodemRingInit(&ring, storage, sizeof(storage)), 0);
+    }
+};
+
+TEST_F(xmodemRingTests, testInitSize) {
+    xmodemRing r;
+    ASSERT_EQ(xmodemRingInit(&r, storage, 0), -1);
+    ASSERT_EQ(xmodemRingInit(&r, storage, 12), -1);
+    ASSERT_EQ(xmodemRingInit(&r, storage, 1), 0);
+    ASSERT_EQ(xmodemRingSpace(&r), 1u);
+}
+
+TEST_F(xmodemRingTests, testPartialBulk) {
+    unsigned char in[20], out[20];
+    for(int i = 0; i < 20; i++) {
+        in[i] = (unsigned char)i;
+    }
+    // only as much as there is room for goes in, and only as much as there is comes out
+    ASSERT_EQ(xmodemRingPush(&ring, in, 20), 16);
+    ASSERT_EQ(xmodemRingSpace(&ring), 0u);
+    ASSERT_EQ(xmodemRingPush(&ring, in, 1), 0);
+    ASSERT_EQ(xmodemRingPop(&ring, out, 10), 10);
+    ASSERT_EQ(xmodemRingCount(&ring), 6u);
+    ASSERT_EQ(xmodemRingPop(&ring, out + 10, 20), 6);
+    ASSERT_EQ(xmodemRingPop(&ring, out, 1), 0);
+    ASSERT_EQ(memcmp(in, out, 16), 0);
+}
+
+TEST_F(xmodemRingTests, testWraparound) {
+    unsigned char in[11], out[11];
+    // push and pop across the end of the storage, and across the wrap of the indices
+    ring.head = ring.tail = 0u - 20;
+    for(int round = 0; round < 10; round++) {
+        for(int i = 0; i < 11; i++) {
+            in[i] = (unsigned char)(round * 11 + i);
+        }
+        ASSERT_EQ(xmodemRingPush(&ring, in, 11), 11);
+        ASSERT_EQ(xmodemRingCount(&ring), 11u);
+        ASSERT_EQ(xmodemRingPop(&ring, out, 11), 11);
+        ASSERT_EQ(memcmp(in, out, 11), 0);
+    }
+}
+
+TEST_F(xmodemRingTests, testOverruns) {
+    unsigned char c;
+    for(int i = 0; i < 20; i++) {
+        ASSERT_EQ(xmodemRingPushByte(&ring, (unsigned char)i), i < 16 ? 1 : 0);
+    }
+    ASSERT_EQ(ring.overruns, 4ul);
+    for(int i = 0; i < 16; i++) {
+        ASSERT_EQ(xmodemRingPopByte(&ring, &c), 1);
+        ASSERT_EQ(c, i);
+    }
+    ASSERT_EQ(xmodemRingPopByte(&ring, &c), 0);
+}
+
+TEST_F(xmodemRingTests, testThreads) {
+    // a producer pushing bytes one at a time, as an interrupt would, and a consumer taking them in bulk
+    const unsigned int total = 1000000;
+    unsigned char big[64];
+    xmodemRing r;
+    ASSERT_EQ(xmodemRingInit(&r, big, sizeof(big)), 0);
+    std::thread producer([&r, total] {
+        for(unsigned int i = 0; i < total; ) {
+            if(xmodemRingPushByte(&r, (unsigned char)(i * 13))) {
+                i++;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+    unsigned char buf[48];
+    unsigned int got = 0, bad = 0;
+    while(got < total) {
+        int n = xmodemRingPop(&r, buf, sizeof(buf));
+        if(n == 0) {
+            std::this_thread::yield();
+        }
+        for(int i = 0; i < n; i++, got++) {
+            bad += buf[i] != (unsigned char)(got * 13);
+        }
+    }
+    producer.join();
+    ASSERT_EQ(bad, 0u);
+    ASSERT_EQ(xmodemRingCount(&r), 0u);
+}
+
+struct RingTestClock {
+    int waits;
+    unsigned short waited;
+    xmodemRing *drain;
+};
+
+// a wait that is never woken, taking at most 7ms of each timeout
+static unsigned short ring_Wait(void *user, unsigned short timeout) {
+    RingTestClock *clock = (RingTestClock *)user;
+    unsigned short t = timeout < 7 ? timeout : 7;
+    clock->waits++;
+    clock->waited += t;
+    if(clock->drain) {
+        // the transmit interrupt sends while the transfer waits
+        unsigned char c;
+        while(xmodemRingPopByte(clock->drain, &c)) {}
+    }
+    return t;
+}
+
+static int ring_Kicks = 0;
+static void ring_Kick(void *user) {
+    ring_Kicks++;
+}
+
+TEST_F(xmodemRingTests, testInTimeout) {
+    unsigned char txStorage[16];
+    xmodemRing tx;
+    xmodemRingInit(&tx, txStorage, sizeof(txStorage));
+    RingTestClock clock = { 0, 0, NULL };
+    xmodemRingLink link = { &ring, &tx, ring_Wait, NULL, &clock };
+    unsigned char buf[4];
+
+    ASSERT_EQ(xmodemRingInByte(&link, 100), -1);
+    ASSERT_EQ(clock.waited, 100);
+    ASSERT_EQ(clock.waits, 15);
+    // input already there returns without waiting
+    xmodemRingPushByte(&ring, 0x43);
+    xmodemRingPushByte(&ring, 0x15);
+    clock.waits = 0;
+    ASSERT_EQ(xmodemRingInByte(&link, 100), 0x43);
+    ASSERT_EQ(xmodemRingInBlock(&link, buf, 4, 100), 1);
+    ASSERT_EQ(buf[0], 0x15);
+    ASSERT_EQ(clock.waits, 0);
+    // no wait hook returns at once, for a session that keeps time with its clock
+    link.wait = NULL;
+    ASSERT_EQ(xmodemRingInBlock(&link, buf, 4, 100), 0);
+}
+
+TEST_F(xmodemRingTests, testOutWaitsForRoom) {
+    unsigned char rxStorage[16];
+    xmodemRing rx;
+    xmodemRingInit(&rx, rxStorage, sizeof(rxStorage));
+    RingTestClock clock = { 0, 0, &ring };
+    xmodemRingLink link = { &rx, &ring, ring_Wait, ring_Kick, &clock };
+    unsigned char frame[40] = { 0 };
+
+    ring_Kicks = 0;
+    xmodemRingOutBlock(&link, frame, sizeof(frame));
+    // 16 bytes at a time, draining twice
+    ASSERT_EQ(clock.waits, 2);
+    ASSERT_EQ(ring_Kicks, 3);
+    ASSERT_EQ(xmodemRingCount(&ring), 8u);
+    xmodemRingOutByte(&link, 0x06);
+    ASSERT_EQ(xmodemRingCount(&ring), 9u);
+}
+
+// a transfer between two sessions over a pair of rings, each end on its own thread
+struct RingEnd {
+    xmodemRingLink link;
+    const unsigned char *data;
+    unsigned char *output;
+    int size;
+    int offset;
+};
+
+static unsigned char const *ring_GetTxBuffer(void *user, int *size) {
+    RingEnd *end = (RingEnd *)user;
+    if(end->offset == end->size) {
+        return NULL;
+    }
+    *size = end->size - end->offset;
+    end->offset = end->size;
+    return end->data;
+}
+
+static unsigned char *ring_GetRxBuffer(void *user, int *size) {
+    RingEnd *end = (RingEnd *)user;
+    if(end->offset == end->size) {
+        return NULL;
+    }
+    *size = end->size - end->offset;
+    end->offset = end->size;
+    return end->output;
+}
+
+static unsigned short ring_Sleep(void *user, unsigned short timeout) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return 1;
+}
+
+static unsigned long ring_Clock(void *user) {
+    return (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+TEST_F(xmodemRingTests, testSessionNeedsWaitOrClock) {
+    xmodemRingLink link = { &ring, &ring, NULL, NULL, NULL };
+    xmodemSession session;
+    xmodemSessionInit(&session);
+    ASSERT_EQ(xmodemRingSession(&session, &link), -1);
+    ASSERT_TRUE(session.inByte == NULL);
+    session.clock = ring_Clock;
+    ASSERT_EQ(xmodemRingSession(&session, &link), 0);
+    ASSERT_TRUE(session.inBlock == xmodemRingInBlock);
+    ASSERT_EQ(session.user, &link);
+    session.clock = NULL;
+    link.wait = ring_Sleep;
+    ASSERT_EQ(xmodemRingSession(&session, &link), 0);
+}
+
+// a transfer between two sessions over a pair of rings, the receiver on this thread
+static void ringTransfer(unsigned short (*wait)(void *user, unsigned short timeout),
+                         unsigned long (*clock)(void *user)) {
+    const int size = 10000;
+    // smaller than a 1K packet, so output waits for room
+    unsigned char aStorage[512], bStorage[512];
+    xmodemRing a, b;
+    xmodemRingInit(&a, aStorage, sizeof(aStorage));
+    xmodemRingInit(&b, bStorage, sizeof(bStorage));
+    std::vector<unsigned char> data(size), output(size + 1024);
+    for(int i = 0; i < size; i++) {
+        data[i] = (unsigned char)((i * 7) | 1);
+    }
+    // the link must be first, as the ring I/O functions get the session user pointer
+    RingEnd sender = { { &b, &a, wait, NULL, NULL }, data.data(), NULL, size, 0 };
+    RingEnd receiver = { { &a, &b, wait, NULL, NULL }, NULL, output.data(), size + 1024, 0 };
+    xmodemSession sendSession, receiveSession;
+    xmodemSessionInit(&sendSession);
+    xmodemSessionInit(&receiveSession);
+    sendSession.clock = receiveSession.clock = clock;
+    ASSERT_EQ(xmodemRingSession(&sendSession, &sender.link), 0);
+    ASSERT_EQ(xmodemRingSession(&receiveSession, &receiver.link), 0);
+    sendSession.blockSize = 1024;
+    sendSession.flushTimeout = receiveSession.flushTimeout = 50;
+
+    int sent = 0, received = 0;
+    std::thread sendThread([&] { sent = xmodemTransmitEx(&sendSession, ring_GetTxBuffer); });
+    received = xmodemReceiveEx(&receiveSession, ring_GetRxBuffer);
+    sendThread.join();
+    ASSERT_EQ(sent, size);
+    ASSERT_EQ(received, size);
+    ASSERT_EQ(memcmp(output.data(), data.data(), size), 0);
+}
+
+TEST_F(xmodemRingTests, testTransfer) {
+    ringTransfer(ring_Sleep, NULL);
+}
+
+TEST_F(xmodemRingTests, testTransferNoWait) {
+    // polling without a wait hook, keeping time with the session clock
+    ringTransfer(NULL, ring_Clock);
+}
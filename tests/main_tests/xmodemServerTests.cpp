@@ -0,0 +1,174 @@
+//
+// Multi-port server tests over pseudo-terminals
+//
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include "gtest/gtest.h"
+#include "serial.h"
+#include "xmodemServer.h"
+
+struct ServerTransfer {
+    const uint8_t *data;
+    uint8_t *output;
+    int size;
+    int offset;
+};
+
+static unsigned char const *server_GetTxBuffer(void *user, int *size) {
+    ServerTransfer *t = (ServerTransfer *)user;
+    if(t->offset == t->size) {
+        return NULL;
+    }
+    // hand out the data in uneven pieces, as from a file
+    *size = t->size - t->offset < 3000 ? t->size - t->offset : 3000;
+    unsigned char const *ret = t->data + t->offset;
+    t->offset += *size;
+    return ret;
+}
+
+static unsigned char *server_GetRxBuffer(void *user, int *size) {
+    ServerTransfer *t = (ServerTransfer *)user;
+    if(t->offset == t->size) {
+        return NULL;
+    }
+    *size = t->size - t->offset;
+    unsigned char *ret = t->output + t->offset;
+    t->offset = t->size;
+    return ret;
+}
+
+class xmodemServerTests : public ::testing::Test {
+protected:
+    enum { pairs = 6, size = 20000 };
+    int fds[pairs][2];
+    uint8_t data[pairs][size];
+    uint8_t output[pairs][size + 1024];
+    ServerTransfer send[pairs], receive[pairs];
+    xmodemSession sendSession[pairs], receiveSession[pairs];
+    xmodemServer server;
+
+    void SetUp() override {
+        for(int i = 0; i < pairs; i++) {
+            ASSERT_EQ(xmodemSerialPty(fds[i]), 0);
+            for(int j = 0; j < size; j++) {
+                data[i][j] = (uint8_t)(j * 7 + i);
+            }
+            send[i] = { data[i], NULL, size, 0 };
+            receive[i] = { NULL, output[i], size + 1024, 0 };
+            xmodemSessionInit(&sendSession[i]);
+            sendSession[i].user = &send[i];
+            sendSession[i].blockSize = 1024;
+            xmodemSessionInit(&receiveSession[i]);
+            receiveSession[i].user = &receive[i];
+            // the end of a transfer waits for the line to be quiet
+            sendSession[i].flushTimeout = receiveSession[i].flushTimeout = 50;
+        }
+    }
+
+    void TearDown() override {
+        for(int i = 0; i < pairs; i++) {
+            close(fds[i][0]);
+            if(fds[i][1] >= 0) {
+                close(fds[i][1]);
+            }
+        }
+        xmodemServerFree(&server);
+    }
+
+    // both ends of every pair run in the one server
+    void run(int workers) {
+        xmodemServerInit(&server, workers);
+        for(int i = 0; i < pairs; i++) {
+            ASSERT_EQ(xmodemServerAddTransmit(&server, fds[i][0], &sendSession[i], server_GetTxBuffer), 2 * i);
+            ASSERT_EQ(xmodemServerAddReceive(&server, fds[i][1], &receiveSession[i], server_GetRxBuffer), 2 * i + 1);
+        }
+        ASSERT_EQ(xmodemServerRun(&server), 0);
+    }
+
+    void check() {
+        xmodemServerStats const *st = xmodemServerGetStats(&server);
+        for(int i = 0; i < pairs; i++) {
+            ASSERT_EQ(xmodemServerResult(&server, 2 * i), size);
+            ASSERT_EQ(xmodemServerResult(&server, 2 * i + 1), size);
+            ASSERT_EQ(memcmp(output[i], data[i], size), 0);
+            ASSERT_EQ(xmodemServerPortStats(&server, 2 * i + 1)->dataBytes, size);
+        }
+        ASSERT_EQ(st->transfers, 2 * pairs);
+        ASSERT_EQ(st->failed, 0);
+        ASSERT_EQ(st->transmitted, (long)pairs * size);
+        ASSERT_EQ(st->received, (long)pairs * size);
+        ASSERT_GT(st->throughput, 0);
+    }
+};
+
+TEST_F(xmodemServerTests, testOneThread) {
+    run(1);
+    check();
+}
+
+TEST_F(xmodemServerTests, testWorkerPool) {
+    // each worker has both ends of some pairs, or one end of a pair whose other end is elsewhere
+    run(3);
+    check();
+}
+
+TEST_F(xmodemServerTests, testHungUpPort) {
+    // a port whose far end has gone fails on its own without holding up the rest
+    close(fds[0][1]);
+    fds[0][1] = -1;
+    sendSession[0].syncTimeout = 20;
+    sendSession[0].syncRetries = 3;
+    xmodemServerInit(&server, 2);
+    for(int i = 0; i < pairs; i++) {
+        xmodemServerAddTransmit(&server, fds[i][0], &sendSession[i], server_GetTxBuffer);
+        if(i > 0) {
+            xmodemServerAddReceive(&server, fds[i][1], &receiveSession[i], server_GetRxBuffer);
+        }
+    }
+    ASSERT_EQ(xmodemServerRun(&server), 1);
+    ASSERT_EQ(xmodemServerResult(&server, 0), xmodemErrorLinkFailed);
+    ASSERT_EQ(xmodemServerGetStats(&server)->received, (long)(pairs - 1) * size);
+}
+
+TEST_F(xmodemServerTests, testPeerClosesMidTransfer) {
+    // a socket whose far end takes two packets and closes, so reads see the end of the stream
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    std::thread peer([&sv] {
+        unsigned char packet[1029];
+        unsigned char c = 'C';
+        ASSERT_EQ(write(sv[1], &c, 1), 1);
+        for(int p = 0; p < 2; p++) {
+            for(int got = 0; got < (int)sizeof(packet); ) {
+                ssize_t n = read(sv[1], packet + got, sizeof(packet) - got);
+                ASSERT_GT(n, 0);
+                got += (int)n;
+            }
+            c = 0x06;
+            ASSERT_EQ(write(sv[1], &c, 1), 1);
+        }
+        close(sv[1]);
+    });
+    xmodemServerInit(&server, 2);
+    xmodemServerAddTransmit(&server, sv[0], &sendSession[0], server_GetTxBuffer);
+    for(int i = 1; i < pairs; i++) {
+        xmodemServerAddTransmit(&server, fds[i][0], &sendSession[i], server_GetTxBuffer);
+        xmodemServerAddReceive(&server, fds[i][1], &receiveSession[i], server_GetRxBuffer);
+    }
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_EQ(xmodemServerRun(&server), 1);
+    long elapsed = (long)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    peer.join();
+    close(sv[0]);
+    // ended as the peer went, well within the ACK timeout it would otherwise retry on
+    ASSERT_EQ(xmodemServerResult(&server, 0), xmodemErrorLinkFailed);
+    ASSERT_LT(elapsed, (long)sendSession[0].ackTimeout);
+    ASSERT_EQ(xmodemServerGetStats(&server)->received, (long)(pairs - 1) * size);
+}
@@ -3,8 +3,14 @@
 //
 
 #include <sys/param.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string>
 #include "gtest/gtest.h"
 #include "xmodem.h"
+#include "crc16.h"
+#include "xmodemRing.h"
 
 #define PRINT_WIRE_DATA 0
 
@@ -15,36 +21,35 @@
 #endif
 
 #define WIRE_BUFFER_SIZE 300
+#define WIRE_RING_SIZE 512
 #define XMODEM_BUFFER_SIZE 128
-static uint8_t tx_wireBuffer[WIRE_BUFFER_SIZE];
-static size_t tx_wireBufferStart = 0;
-static size_t tx_wireBufferEnd = 0;
-static uint8_t rx_wireBuffer[WIRE_BUFFER_SIZE];
-static size_t rx_wireBufferStart = 0;
-static size_t rx_wireBufferEnd = 0;
+#define XMODEM_BUFFER_SIZE_1K 1024
+// the wire in each direction, each ring filled by one thread and emptied by the other
+static uint8_t tx_wireStorage[WIRE_RING_SIZE];
+static uint8_t rx_wireStorage[WIRE_RING_SIZE];
+static xmodemRing tx_wire, rx_wire;
 static pthread_t sendThread, receiveThread;
 static double lossRate = 0;
 static double corruptionRate = 0;
+
+static unsigned short wire_Wait(void *user, unsigned short timeout) {
+    static const struct timespec spec = {
+            .tv_sec = 0,
+            .tv_nsec = 10000000L
+    };
+    nanosleep(&spec, NULL);
+    return 10;
+}
+
+static xmodemRingLink sendLink = { &rx_wire, &tx_wire, wire_Wait, NULL, NULL };
+static xmodemRingLink receiveLink = { &tx_wire, &rx_wire, wire_Wait, NULL, NULL };
+
 int xmodem_InByte(unsigned short timeout) {
     bool isSend = pthread_self() == sendThread;
-    uint8_t *wireBuffer = isSend ? rx_wireBuffer : tx_wireBuffer;
-    size_t *wireBufferStart = isSend ? &rx_wireBufferStart : &tx_wireBufferStart;
-    size_t *wireBufferEnd = isSend ? &rx_wireBufferEnd : &tx_wireBufferEnd;
-    for(int i = 0; i < timeout / 10; i++) {
-        if(*wireBufferEnd != *wireBufferStart) {
-            uint8_t ret = wireBuffer[*wireBufferStart];
-            *wireBufferStart += 1;
-            if(*wireBufferStart == WIRE_BUFFER_SIZE) {
-                *wireBufferStart = 0;
-            }
-            PRINT_WIRE("%s op R byte 0x%02X\n", isSend ? "T" : "R", ret);
-            return ret;
-        }
-        static const struct timespec spec = {
-                .tv_sec = 0,
-                .tv_nsec = 10000000L
-        };
-        nanosleep(&spec, NULL);
+    int ret = xmodemRingInByte(isSend ? &sendLink : &receiveLink, timeout);
+    if(ret >= 0) {
+        PRINT_WIRE("%s op R byte 0x%02X\n", isSend ? "T" : "R", ret);
+        return ret;
     }
     PRINT_WIRE("%s op failed to receive byte after delay %dms\n", isSend ? "T" : "R", timeout);
     return -10;
@@ -55,8 +60,6 @@ static bool isUnlucky(double rate) {
 }
 void xmodem_OutByte(unsigned char c) {
     bool isSend = pthread_self() == sendThread;
-    uint8_t *wireBuffer = isSend ? tx_wireBuffer : rx_wireBuffer;
-    size_t *wireBufferEnd = isSend ? &tx_wireBufferEnd : &rx_wireBufferEnd;
     bool corrupt = false, lost = false;
     if(lossRate > 0) {
         lost = isUnlucky(lossRate);
@@ -71,13 +74,34 @@ void xmodem_OutByte(unsigned char c) {
             c = (unsigned char)random();
         }
         PRINT_WIRE("%s op T byte 0x%02X%s\n", isSend ? "T" : "R", c, corrupt ? "" : " CORRUPT");
-        wireBuffer[*wireBufferEnd] = c;
-        *wireBufferEnd += 1;
-        if(*wireBufferEnd == WIRE_BUFFER_SIZE) {
-            *wireBufferEnd = 0;
-        }
+        // a full wire drops the byte, counted in the ring's overruns
+        xmodemRingPushByte(isSend ? &tx_wire : &rx_wire, c);
+    }
+
+}
+
+static int inBlockCalls = 0;
+static int outBlockCalls = 0;
+int xmodem_InBlock(unsigned char *buf, int len, unsigned short timeout) {
+    inBlockCalls++;
+    int c = xmodem_InByte(timeout);
+    if(c < 0) {
+        return 0;
     }
+    int got = 0;
+    buf[got++] = (unsigned char)c;
+    // take whatever else is already on the wire without waiting
+    while(got < len && (c = xmodem_InByte(0)) >= 0) {
+        buf[got++] = (unsigned char)c;
+    }
+    return got;
+}
 
+void xmodem_OutBlock(unsigned char const *buf, int len) {
+    outBlockCalls++;
+    for(int i = 0; i < len; i++) {
+        xmodem_OutByte(buf[i]);
+    }
 }
 
 static uint8_t dataToTransfer[WIRE_BUFFER_SIZE];
@@ -135,11 +159,14 @@ void * receiveFunc(void* ptr) {
 
 class xmodemTests : public ::testing::Test {
     void SetUp() override {
-        tx_wireBufferStart = 0;
-        tx_wireBufferEnd = 0;
-        rx_wireBufferStart = 0;
-        rx_wireBufferEnd = 0;
+        xmodemRingInit(&tx_wire, tx_wireStorage, sizeof(tx_wireStorage));
+        xmodemRingInit(&rx_wire, rx_wireStorage, sizeof(rx_wireStorage));
         lossRate = 0;
+        corruptionRate = 0;
+        xmodemInBlock = NULL;
+        xmodemOutBlock = NULL;
+        inBlockCalls = 0;
+        outBlockCalls = 0;
         for(int i = 0; i < sizeof(dataToTransfer); i++) {
             dataToTransfer[i] = (uint8_t)i;
         }
@@ -321,3 +348,1011 @@ TEST_F(xmodemTests, testSendReceiveSuccessFullBufferFullDataLossAndCorruption) {
     }
     ASSERT_EQ(memcmp(receiveOutput, dataToTransfer, sendDataSize), 0);
 }
+
+TEST_F(xmodemTests, testSendReceiveSuccessBlockIO) {
+    xmodemInBlock = xmodem_InBlock;
+    xmodemOutBlock = xmodem_OutBlock;
+    sendDataSize = sizeof(dataToTransfer);
+    sendBufferSize = sizeof(dataToTransfer);
+    receiveBufferSize = sizeof(receiveBuffer);
+    receiveTotalSize = sizeof(receiveBuffer);
+
+    ::pthread_create(&sendThread, nullptr, sendFunc, nullptr);
+    ::pthread_create(&receiveThread, nullptr, receiveFunc, nullptr);
+    ::pthread_join(sendThread, nullptr);
+    ::pthread_join(receiveThread, nullptr);
+
+    ASSERT_EQ(sendResult, sendDataSize);
+    ASSERT_EQ(receiveResult, sendDataSize);
+    ASSERT_GT(inBlockCalls, 0);
+    ASSERT_GT(outBlockCalls, 0);
+    if(receiveResult > receiveOffset) {
+        memcpy(receiveOutput + receiveOffset, receiveBuffer, receiveResult - receiveOffset);
+    }
+    ASSERT_EQ(memcmp(receiveOutput, dataToTransfer, sendDataSize), 0);
+}
+
+struct Transfer {
+    int fd;
+    const uint8_t *data;
+    uint8_t *output;
+    int size;
+    int offset;
+    int result;
+};
+
+static int socket_InByte(void *user, unsigned short timeout) {
+    Transfer *t = (Transfer *)user;
+    struct pollfd pfd = { t->fd, POLLIN, 0 };
+    unsigned char c;
+    if(poll(&pfd, 1, timeout) <= 0 || read(t->fd, &c, 1) != 1) {
+        return -1;
+    }
+    return c;
+}
+
+static void socket_OutByte(void *user, unsigned char c) {
+    Transfer *t = (Transfer *)user;
+    ssize_t written = write(t->fd, &c, 1);
+    (void)written;
+}
+
+static unsigned char const * transfer_GetTxBuffer(void *user, int *size) {
+    Transfer *t = (Transfer *)user;
+    *size = t->size - t->offset;
+    unsigned char const *ret = t->data + t->offset;
+    t->offset = t->size;
+    return ret;
+}
+
+static unsigned char * transfer_GetRxBuffer(void *user, int *size) {
+    Transfer *t = (Transfer *)user;
+    if(t->offset != 0) {
+        return NULL;
+    }
+    t->offset = t->size;
+    *size = t->size + XMODEM_BUFFER_SIZE_1K;
+    return t->output;
+}
+
+static void socketSessionInit(xmodemSession *session, Transfer *t) {
+    xmodemSessionInit(session);
+    session->inByte = socket_InByte;
+    session->outByte = socket_OutByte;
+    session->user = t;
+}
+
+static void * socketSendFunc(void *ptr) {
+    Transfer *t = (Transfer *)ptr;
+    xmodemSession session;
+    socketSessionInit(&session, t);
+    t->result = xmodemTransmitEx(&session, transfer_GetTxBuffer);
+    return NULL;
+}
+
+static void * socketReceiveFunc(void *ptr) {
+    Transfer *t = (Transfer *)ptr;
+    xmodemSession session;
+    socketSessionInit(&session, t);
+    t->result = xmodemReceiveEx(&session, transfer_GetRxBuffer);
+    return NULL;
+}
+
+TEST_F(xmodemTests, testConcurrentSessions) {
+    const int transfers = 4;
+    const int size = 1000;
+    static uint8_t data[transfers][size];
+    static uint8_t output[transfers][size + XMODEM_BUFFER_SIZE_1K];
+    Transfer send[transfers], receive[transfers];
+    pthread_t threads[transfers * 2];
+    for(int i = 0; i < transfers; i++) {
+        int fds[2];
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        for(int j = 0; j < size; j++) {
+            data[i][j] = (uint8_t)(i * 31 + j);
+        }
+        send[i] = { fds[0], data[i], NULL, size, 0, 0 };
+        receive[i] = { fds[1], NULL, output[i], size, 0, 0 };
+        ::pthread_create(&threads[i * 2], nullptr, socketSendFunc, &send[i]);
+        ::pthread_create(&threads[i * 2 + 1], nullptr, socketReceiveFunc, &receive[i]);
+    }
+    for(int i = 0; i < transfers * 2; i++) {
+        ::pthread_join(threads[i], nullptr);
+    }
+    for(int i = 0; i < transfers; i++) {
+        close(send[i].fd);
+        close(receive[i].fd);
+        ASSERT_EQ(send[i].result, size);
+        ASSERT_EQ(receive[i].result, size);
+        ASSERT_EQ(memcmp(output[i], data[i], size), 0);
+    }
+}
+
+// called with each chunk of output on its way from the first engine to the second, which it may alter
+typedef void (*LinkFilter)(unsigned char *data, int len);
+
+static void moveOutput(xmodemEngine *from, xmodemEngine *to, LinkFilter filter, bool *progress) {
+    unsigned char const *data;
+    unsigned char copy[XMODEM_BUFFER_SIZE_1K + 5];
+    int n;
+    while((n = xmodemEnginePollOutput(from, &data)) > 0) {
+        if(filter) {
+            n = MIN(n, (int)sizeof(copy));
+            memcpy(copy, data, n);
+            filter(copy, n);
+            xmodemEngineFeed(to, copy, n);
+        } else {
+            xmodemEngineFeed(to, data, n);
+        }
+        xmodemEngineOutputSent(from, n);
+        *progress = true;
+    }
+}
+
+static void runEngines(xmodemEngine *a, xmodemEngine *b, unsigned long *now, LinkFilter filter = NULL) {
+    while(!xmodemEngineDone(a) || !xmodemEngineDone(b)) {
+        bool progress = false;
+        moveOutput(a, b, filter, &progress);
+        moveOutput(b, a, NULL, &progress);
+        if(progress) {
+            continue;
+        }
+        long ta = xmodemEngineTimeout(a), tb = xmodemEngineTimeout(b);
+        long t = ta < 0 ? tb : (tb < 0 ? ta : MIN(ta, tb));
+        ASSERT_GE(t, 0);
+        *now += t;
+        xmodemEngineTick(a, *now);
+        xmodemEngineTick(b, *now);
+    }
+}
+
+TEST_F(xmodemTests, testEngineSendReceive) {
+    const int size = 1000;
+    static uint8_t data[size];
+    static uint8_t output[size + XMODEM_BUFFER_SIZE_1K];
+    for(int j = 0; j < size; j++) {
+        data[j] = (uint8_t)(j * 7 + 1);
+    }
+    Transfer send = { -1, data, NULL, size, 0, 0 };
+    Transfer receive = { -1, NULL, output, size, 0, 0 };
+    xmodemSession sendSession, receiveSession;
+    xmodemSessionInit(&sendSession);
+    sendSession.user = &send;
+    xmodemSessionInit(&receiveSession);
+    receiveSession.user = &receive;
+    xmodemEngine sender, receiver;
+    unsigned long now = 0;
+    xmodemEngineInitTransmit(&sender, &sendSession, transfer_GetTxBuffer, now);
+    xmodemEngineInitReceive(&receiver, &receiveSession, transfer_GetRxBuffer, now);
+    runEngines(&sender, &receiver, &now);
+
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+}
+
+TEST_F(xmodemTests, testEngineTransmitNoSync) {
+    Transfer send = { -1, dataToTransfer, NULL, 100, 0, 0 };
+    xmodemSession session;
+    xmodemSessionInit(&session);
+    session.user = &send;
+    xmodemEngine sender;
+    unsigned long now = 1000;
+    xmodemEngineInitTransmit(&sender, &session, transfer_GetTxBuffer, now);
+    unsigned char const *data;
+    int cancels = 0;
+    while(!xmodemEngineDone(&sender)) {
+        int n = xmodemEnginePollOutput(&sender, &data);
+        if(n > 0) {
+            cancels += n;
+            xmodemEngineOutputSent(&sender, n);
+            continue;
+        }
+        ASSERT_GE(xmodemEngineTimeout(&sender), 0);
+        now += xmodemEngineTimeout(&sender);
+        xmodemEngineTick(&sender, now);
+    }
+    ASSERT_EQ(xmodemEngineResult(&sender), xmodemErrorNoSync);
+    ASSERT_EQ(cancels, 3);
+    ASSERT_EQ(now, 1000 + session.syncRetries * session.syncTimeout + session.flushTimeout);
+}
+
+// hands out the output in 128 byte buffers, up to a limit, counting the calls
+static int failedLink_InBlock(void *user, unsigned char *buf, int len, unsigned short timeout) {
+    ++*(int *)user;
+    return xmodemErrorLinkFailed;
+}
+
+static void failedLink_OutBlock(void *user, unsigned char const *buf, int len) {
+}
+
+static unsigned char const * failedLink_GetTxBuffer(void *user, int *size) {
+    return NULL;
+}
+
+static unsigned char * failedLink_GetRxBuffer(void *user, int *size) {
+    return NULL;
+}
+
+TEST_F(xmodemTests, testLinkFailedEndsTransfer) {
+    // input reporting the link gone ends the transfer at once rather than after the sync retries
+    int reads = 0;
+    xmodemSession session;
+    xmodemSessionInit(&session);
+    session.inBlock = failedLink_InBlock;
+    session.outBlock = failedLink_OutBlock;
+    session.user = &reads;
+    ASSERT_EQ(xmodemReceiveEx(&session, failedLink_GetRxBuffer), xmodemErrorLinkFailed);
+    ASSERT_EQ(reads, 1);
+    reads = 0;
+    ASSERT_EQ(xmodemTransmitEx(&session, failedLink_GetTxBuffer), xmodemErrorLinkFailed);
+    ASSERT_EQ(reads, 1);
+}
+
+struct CountedBuffers {
+    uint8_t *output;
+    int buffers;
+    int limit;
+    int calls;
+};
+
+static unsigned char *counted_GetRxBuffer(void *user, int *size) {
+    CountedBuffers *c = (CountedBuffers *)user;
+    c->calls++;
+    if(c->buffers == c->limit) {
+        return NULL;
+    }
+    *size = XMODEM_BUFFER_SIZE;
+    return c->output + XMODEM_BUFFER_SIZE * c->buffers++;
+}
+
+static void corruptEveryFifthFrame(unsigned char *data, int len);
+
+TEST_F(xmodemTests, testEngineReceiveBufferCalls) {
+    // a buffer is only asked for once a packet is checked, so bad packets take none
+    const int size = 1000;
+    static uint8_t data[size];
+    static uint8_t output[8 * XMODEM_BUFFER_SIZE];
+    for(int j = 0; j < size; j++) {
+        data[j] = (uint8_t)(j * 7 + 1);
+    }
+    for(int limit : { 8, 2 }) {
+        Transfer send = { -1, data, NULL, size, 0, 0 };
+        CountedBuffers receive = { output, 0, limit, 0 };
+        xmodemSession sendSession, receiveSession;
+        xmodemSessionInit(&sendSession);
+        sendSession.user = &send;
+        sendSession.blockSize = XMODEM_BUFFER_SIZE;
+        xmodemSessionInit(&receiveSession);
+        receiveSession.user = &receive;
+        xmodemEngine sender, receiver;
+        unsigned long now = 0;
+        xmodemEngineInitTransmit(&sender, &sendSession, transfer_GetTxBuffer, now);
+        xmodemEngineInitReceive(&receiver, &receiveSession, counted_GetRxBuffer, now);
+        runEngines(&sender, &receiver, &now, corruptEveryFifthFrame);
+        if(limit == 8) {
+            ASSERT_EQ(xmodemEngineResult(&receiver), size);
+            ASSERT_EQ(receive.calls, 8);
+            ASSERT_EQ(memcmp(output, data, size), 0);
+        } else {
+            // once refused, the application is not asked again
+            ASSERT_EQ(xmodemEngineResult(&receiver), xmodemErrorBufferFull);
+            ASSERT_EQ(receive.calls, 3);
+        }
+    }
+}
+
+static int sohFrames = 0;
+static int stxFrames = 0;
+
+// a frame may come out in one chunk, or with its header apart when its payload is sent in place
+static bool frameStart(unsigned char const *data, int len) {
+    return len >= 3 && (data[0] == 0x01 || data[0] == 0x02) && data[1] == (uint8_t)~data[2];
+}
+
+static void countFrames(unsigned char *data, int len) {
+    if(frameStart(data, len) && data[0] == 0x01) sohFrames++;
+    if(frameStart(data, len) && data[0] == 0x02) stxFrames++;
+}
+
+static int framesSeen = 0;
+
+static void corruptEveryFifthFrame(unsigned char *data, int len) {
+    countFrames(data, len);
+    if(frameStart(data, len) && ++framesSeen % 5 == 0) {
+        data[len / 2] ^= 0x55;
+    }
+}
+
+static void corruptStxFrames(unsigned char *data, int len) {
+    countFrames(data, len);
+    if(frameStart(data, len) && data[0] == 0x02) {
+        data[len / 2] ^= 0x55;
+    }
+}
+
+class xmodemEngineTests : public ::testing::Test {
+protected:
+    enum { size = 5000 };
+    uint8_t data[size];
+    uint8_t output[size + XMODEM_BUFFER_SIZE_1K];
+    Transfer send, receive;
+    xmodemSession sendSession, receiveSession;
+    xmodemEngine sender, receiver;
+    unsigned long now = 0;
+
+    void SetUp() override {
+        for(int j = 0; j < size; j++) {
+            data[j] = (uint8_t)(j * 13 + 5);
+        }
+        send = { -1, data, NULL, size, 0, 0 };
+        receive = { -1, NULL, output, size, 0, 0 };
+        xmodemSessionInit(&sendSession);
+        sendSession.user = &send;
+        xmodemSessionInit(&receiveSession);
+        receiveSession.user = &receive;
+        sohFrames = 0;
+        stxFrames = 0;
+        framesSeen = 0;
+    }
+
+    void run(LinkFilter filter) {
+        xmodemEngineInitTransmit(&sender, &sendSession, transfer_GetTxBuffer, now);
+        xmodemEngineInitReceive(&receiver, &receiveSession, transfer_GetRxBuffer, now);
+        runEngines(&sender, &receiver, &now, filter);
+    }
+};
+
+TEST_F(xmodemEngineTests, testBlockSize1K) {
+    sendSession.blockSize = 1024;
+    run(countFrames);
+
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_EQ(stxFrames, (size + 1023) / 1024);
+    ASSERT_EQ(sohFrames, 0);
+}
+
+TEST_F(xmodemEngineTests, testAdaptiveBlockSizeFallsBack) {
+    sendSession.blockSize = 1024;
+    sendSession.adaptiveBlockSize = 1;
+    run(corruptStxFrames);
+
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_GT(sohFrames, 0);
+    // climbs back to 1K after a run of clean packets, and falls back again
+    ASSERT_GT(stxFrames, 2);
+}
+
+TEST_F(xmodemEngineTests, testFixedBlockSizeDoesNotFallBack) {
+    sendSession.blockSize = 1024;
+    run(corruptStxFrames);
+
+    ASSERT_EQ(xmodemEngineResult(&sender), xmodemErrorTransmitError);
+    ASSERT_EQ(sohFrames, 0);
+}
+
+TEST_F(xmodemEngineTests, testStreaming) {
+    static unsigned char window[8 * (1024 + 5)];
+    sendSession.blockSize = 1024;
+    sendSession.window = 8;
+    sendSession.windowBuffer = window;
+    receiveSession.window = 8;
+    run(countFrames);
+
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_EQ(stxFrames, (size + 1023) / 1024);
+    // no time spent waiting for responses, only the final flushes
+    ASSERT_LE(now, (unsigned long)receiveSession.flushTimeout + sendSession.flushTimeout);
+}
+
+TEST_F(xmodemEngineTests, testStreamingGoesBackAfterError) {
+    static unsigned char window[4 * (128 + 5)];
+    sendSession.window = 4;
+    sendSession.windowBuffer = window;
+    receiveSession.window = 4;
+    run(corruptEveryFifthFrame);
+
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_GT(sohFrames, (size + 127) / 128);
+}
+
+TEST_F(xmodemEngineTests, testStreamingFallsBackToPlainTransmitter) {
+    receiveSession.window = 8;
+    run(countFrames);
+
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+}
+
+static void framePacket(unsigned char *frame, unsigned char packetno, unsigned char fill) {
+    frame[0] = 0x01;
+    frame[1] = packetno;
+    frame[2] = ~packetno;
+    memset(frame + 3, fill, 128);
+    unsigned short crc = crc16_ccitt(frame + 3, 128);
+    frame[131] = crc >> 8;
+    frame[132] = crc & 0xFF;
+}
+
+static int engineOutput(xmodemEngine *e) {
+    unsigned char const *data;
+    if(xmodemEnginePollOutput(e, &data) <= 0) {
+        return -1;
+    }
+    int c = data[0];
+    xmodemEngineOutputSent(e, 1);
+    return c;
+}
+
+TEST_F(xmodemEngineTests, testReceiveInPlace) {
+    unsigned char frame[133];
+    unsigned char *in;
+    xmodemEngineInitReceive(&receiver, &receiveSession, transfer_GetRxBuffer, now);
+    ASSERT_EQ(engineOutput(&receiver), 'C');
+
+    // the buffer is only asked for once the first packet is checked, so that packet is staged and copied
+    framePacket(frame, 1, 'a');
+    ASSERT_EQ(xmodemEngineFeed(&receiver, frame, 3), 3);
+    ASSERT_EQ(xmodemEngineInputBuffer(&receiver, &in), 128);
+    ASSERT_TRUE(in < output || in >= output + sizeof(output));
+    xmodemEngineFeed(&receiver, frame + 3, 130);
+    ASSERT_EQ(engineOutput(&receiver), 0x06);
+    ASSERT_EQ(output[0], 'a');
+
+    // a duplicate is staged, leaving the data alone
+    framePacket(frame, 1, 'b');
+    xmodemEngineFeed(&receiver, frame, 3);
+    xmodemEngineInputBuffer(&receiver, &in);
+    ASSERT_TRUE(in < output || in >= output + sizeof(output));
+    xmodemEngineFeed(&receiver, frame + 3, 130);
+    ASSERT_EQ(engineOutput(&receiver), 0x06);
+
+    // a packet failing its check is written in place but not kept
+    framePacket(frame, 2, 'c');
+    frame[132] ^= 1;
+    xmodemEngineFeed(&receiver, frame, 3);
+    xmodemEngineInputBuffer(&receiver, &in);
+    ASSERT_EQ(in, output + 128);
+    xmodemEngineFeed(&receiver, frame + 3, 130);
+    now += receiveSession.flushTimeout;
+    xmodemEngineTick(&receiver, now);
+    ASSERT_EQ(engineOutput(&receiver), 0x15);
+
+    framePacket(frame, 2, 'd');
+    xmodemEngineFeed(&receiver, frame, 133);
+    ASSERT_EQ(engineOutput(&receiver), 0x06);
+    const unsigned char eot = 0x04;
+    xmodemEngineFeed(&receiver, &eot, 1);
+    now += receiveSession.flushTimeout;
+    xmodemEngineTick(&receiver, now);
+    ASSERT_EQ(engineOutput(&receiver), 0x06);
+    ASSERT_EQ(xmodemEngineResult(&receiver), 256);
+    for(int i = 0; i < 256; i++) {
+        ASSERT_EQ(output[i], i < 128 ? 'a' : 'd');
+    }
+}
+
+TEST_F(xmodemEngineTests, testResync) {
+    unsigned char frame[133];
+    receiveSession.baud = 115200;
+    xmodemEngineInitReceive(&receiver, &receiveSession, transfer_GetRxBuffer, now);
+    ASSERT_EQ(engineOutput(&receiver), 'C');
+
+    // a bad header is rejected on its third byte, and the NAK goes once the line has been quiet for a few bytes
+    framePacket(frame, 1, 'a');
+    frame[2] ^= 0x10;
+    xmodemEngineFeed(&receiver, frame, 3);
+    ASSERT_EQ(xmodemEngineTimeout(&receiver), 2);
+    xmodemEngineFeed(&receiver, frame + 3, 100);
+    ASSERT_EQ(engineOutput(&receiver), -1);
+    now += 2;
+    xmodemEngineTick(&receiver, now);
+    ASSERT_EQ(engineOutput(&receiver), 0x15);
+
+    // the rest of a packet arriving after the NAK is drained, and a packet starting within it is received
+    framePacket(frame, 1, 'a');
+    xmodemEngineFeed(&receiver, frame + 100, 33);
+    xmodemEngineFeed(&receiver, frame, 133);
+    ASSERT_EQ(engineOutput(&receiver), 0x06);
+    ASSERT_EQ(engineOutput(&receiver), -1);
+    ASSERT_EQ(xmodemEngineStats(&receiver)->naks, 1);
+    ASSERT_EQ(xmodemEngineStats(&receiver)->timeouts, 0);
+    ASSERT_EQ(output[0], 'a');
+}
+
+TEST_F(xmodemEngineTests, testReceiveAcrossBuffers) {
+    // buffers that packets do not fit evenly, so some are staged and split
+    xmodemEngineInitTransmit(&sender, &sendSession, transfer_GetTxBuffer, now);
+    xmodemEngineInitReceive(&receiver, &receiveSession,
+                            [](void *user, int *sz) -> unsigned char * {
+                                Transfer *t = (Transfer *)user;
+                                if(t->offset >= t->size + 1024) return NULL;
+                                *sz = 300;
+                                t->offset += 300;
+                                return t->output + t->offset - 300;
+                            }, now);
+    runEngines(&sender, &receiver, &now, corruptEveryFifthFrame);
+
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+}
+
+TEST_F(xmodemEngineTests, testTransmitInPlace) {
+    unsigned char const *out;
+    xmodemEngineInitTransmit(&sender, &sendSession, transfer_GetTxBuffer, now);
+    const unsigned char c = 'C';
+    xmodemEngineFeed(&sender, &c, 1);
+
+    // a whole packet of data is sent from the application's buffer, between the header and CRC
+    ASSERT_EQ(xmodemEnginePollOutput(&sender, &out), 3);
+    ASSERT_EQ(out[0], 0x01);
+    xmodemEngineOutputSent(&sender, 3);
+    ASSERT_EQ(xmodemEnginePollOutput(&sender, &out), 128);
+    ASSERT_EQ(out, data);
+    xmodemEngineOutputSent(&sender, 128);
+    ASSERT_EQ(xmodemEnginePollOutput(&sender, &out), 2);
+    unsigned short crc = crc16_ccitt(data, 128);
+    ASSERT_EQ(out[0], crc >> 8);
+    ASSERT_EQ(out[1], crc & 0xFF);
+    xmodemEngineOutputSent(&sender, 2);
+
+    // the last packet needs padding, so is staged
+    for(int i = 1; i < size / 128; i++) {
+        const unsigned char ack = 0x06;
+        xmodemEngineFeed(&sender, &ack, 1);
+        while(xmodemEnginePollOutput(&sender, &out) > 0) {
+            xmodemEngineOutputSent(&sender, xmodemEnginePollOutput(&sender, &out));
+        }
+    }
+    const unsigned char ack = 0x06;
+    xmodemEngineFeed(&sender, &ack, 1);
+    ASSERT_EQ(xmodemEnginePollOutput(&sender, &out), 133);
+    ASSERT_EQ(memcmp(out + 3, data + size / 128 * 128, size % 128), 0);
+    ASSERT_EQ(out[3 + size % 128], 0x1A);
+}
+
+TEST_F(xmodemEngineTests, testTransmitAcrossBuffers) {
+    // buffers that packets do not fit evenly, so some are staged, with the adaptive fallback splitting both kinds
+    sendSession.blockSize = 1024;
+    sendSession.adaptiveBlockSize = 1;
+    xmodemEngineInitTransmit(&sender, &sendSession,
+                             [](void *user, int *sz) -> unsigned char const * {
+                                 Transfer *t = (Transfer *)user;
+                                 if(t->offset == t->size) return NULL;
+                                 *sz = MIN(1500, t->size - t->offset);
+                                 t->offset += *sz;
+                                 return t->data + t->offset - *sz;
+                             }, now);
+    xmodemEngineInitReceive(&receiver, &receiveSession, transfer_GetRxBuffer, now);
+    runEngines(&sender, &receiver, &now, corruptEveryFifthFrame);
+
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+}
+
+static xmodemEngine *fetchingEngine = NULL;
+static int fetchesAhead = 0;
+
+// hands out 128 bytes at a time, counting the buffers taken before the data already sent has all been acknowledged
+static unsigned char const * prepare_GetTxBuffer(void *user, int *size) {
+    Transfer *t = (Transfer *)user;
+    if(t->offset == t->size) return NULL;
+    if(xmodemEngineStats(fetchingEngine)->dataBytes < t->offset) fetchesAhead++;
+    *size = MIN(128, t->size - t->offset);
+    t->offset += *size;
+    return t->data + t->offset - *size;
+}
+
+TEST_F(xmodemEngineTests, testTransmitPreparesNextPacket) {
+    static unsigned char prepare[128 + 5];
+    fetchingEngine = &sender;
+    fetchesAhead = 0;
+    xmodemEngineInitTransmit(&sender, &sendSession, prepare_GetTxBuffer, now);
+    xmodemEngineInitReceive(&receiver, &receiveSession, transfer_GetRxBuffer, now);
+    runEngines(&sender, &receiver, &now);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(fetchesAhead, 0);
+
+    // with a prepare buffer every packet after the first is fetched while the one before waits for its ACK
+    sendSession.prepareBuffer = prepare;
+    send.offset = receive.offset = 0;
+    memset(output, 0, sizeof(output));
+    xmodemEngineInitTransmit(&sender, &sendSession, prepare_GetTxBuffer, now);
+    xmodemEngineInitReceive(&receiver, &receiveSession, transfer_GetRxBuffer, now);
+    runEngines(&sender, &receiver, &now);
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_EQ(fetchesAhead, (size + 127) / 128 - 1);
+}
+
+TEST_F(xmodemEngineTests, testTransmitPreparedWithRetries) {
+    // prepared packets survive retries of the one before, and the adaptive fallback, whether staged or in place
+    static unsigned char prepare[1024 + 5];
+    sendSession.prepareBuffer = prepare;
+    sendSession.blockSize = 1024;
+    sendSession.adaptiveBlockSize = 1;
+    xmodemEngineInitTransmit(&sender, &sendSession,
+                             [](void *user, int *sz) -> unsigned char const * {
+                                 Transfer *t = (Transfer *)user;
+                                 if(t->offset == t->size) return NULL;
+                                 *sz = MIN(300, t->size - t->offset);
+                                 t->offset += *sz;
+                                 return t->data + t->offset - *sz;
+                             }, now);
+    xmodemEngineInitReceive(&receiver, &receiveSession, transfer_GetRxBuffer, now);
+    runEngines(&sender, &receiver, &now, corruptEveryFifthFrame);
+
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+}
+
+static long lastCheckpoint = 0;
+static int checkpoints = 0;
+
+static void recordCheckpoint(void *, unsigned char, long offset) {
+    lastCheckpoint = offset;
+    checkpoints++;
+}
+
+static void cutAfterTwentyFrames(unsigned char *data, int len) {
+    if(frameStart(data, len) && ++framesSeen > 20) {
+        data[1] ^= 0xFF;
+    }
+}
+
+static void dropResumeRequests(unsigned char *data, int len) {
+    if(len == 1 && data[0] == 'R') {
+        data[0] = 0;
+    }
+}
+
+TEST_F(xmodemEngineTests, testResume) {
+    lastCheckpoint = 0;
+    checkpoints = 0;
+    receiveSession.checkpoint = recordCheckpoint;
+    run(cutAfterTwentyFrames);
+    ASSERT_LT(xmodemEngineResult(&sender), 0);
+    ASSERT_LT(xmodemEngineResult(&receiver), 0);
+    ASSERT_EQ(checkpoints, 20);
+    ASSERT_EQ(lastCheckpoint, 20 * 128);
+
+    // a second attempt carries on from the checkpoint, with the receive buffers continuing from there
+    const long resumeFrom = lastCheckpoint;
+    memset(output, 0, sizeof(output));
+    receiveSession.resumeFrom = resumeFrom;
+    send.offset = 0;
+    receive = { -1, NULL, output + resumeFrom, (int)(size - resumeFrom), 0, 0 };
+    run(NULL);
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(xmodemEngineStats(&sender)->dataBytes, size - resumeFrom);
+    ASSERT_EQ(xmodemEngineStats(&receiver)->dataBytes, size - resumeFrom);
+    ASSERT_EQ(memcmp(output + resumeFrom, data + resumeFrom, size - resumeFrom), 0);
+    ASSERT_EQ(lastCheckpoint, size);
+}
+
+TEST_F(xmodemEngineTests, testResumeUnanswered) {
+    // a transmitter that does not answer the resume request sends everything, and the receiver drops what it has
+    receiveSession.resumeFrom = 1000;
+    receive = { -1, NULL, output, size - 1000, 0, 0 };
+    xmodemEngineInitTransmit(&sender, &sendSession, transfer_GetTxBuffer, now);
+    xmodemEngineInitReceive(&receiver, &receiveSession, transfer_GetRxBuffer, now);
+    runEngines(&receiver, &sender, &now, dropResumeRequests);
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(xmodemEngineStats(&receiver)->dataBytes, size - 1000);
+    ASSERT_EQ(memcmp(output, data + 1000, size - 1000), 0);
+}
+
+TEST_F(xmodemEngineTests, testStagingBuffer) {
+    static unsigned char txStaging[XMODEM_STAGING_BUFFER_SIZE], rxStaging[XMODEM_STAGING_BUFFER_SIZE];
+    sendSession.blockSize = 1024;
+    sendSession.stagingBuffer = txStaging;
+    receiveSession.stagingBuffer = rxStaging;
+    run(NULL);
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    // the padded last packet was assembled in the supplied buffers
+    ASSERT_EQ(txStaging[0], 0x02);
+    ASSERT_EQ(memcmp(txStaging + 3, data + size / 1024 * 1024, size % 1024), 0);
+    ASSERT_EQ(rxStaging[0], 0x02);
+    ASSERT_EQ(rxStaging[1], (size + 1023) / 1024);
+}
+
+static lzEncoder encoder;
+static lzDecoder decoder;
+
+TEST_F(xmodemEngineTests, testCompression) {
+    sendSession.encoder = &encoder;
+    receiveSession.decoder = &decoder;
+    run(countFrames);
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_EQ(xmodemEngineStats(&receiver)->dataBytes, size);
+    // the data repeats every 256 bytes, so fits in a tenth of the packets
+    ASSERT_LE(sohFrames, (size + 127) / 128 / 10);
+    ASSERT_LT(xmodemEngineStats(&sender)->bytesSent, size / 8);
+}
+
+TEST_F(xmodemEngineTests, testCompressionWithErrors) {
+    uint8_t noise[size];
+    srandom(3);
+    for(int j = 0; j < size; j++) {
+        noise[j] = (uint8_t)random();
+    }
+    // incompressible data still goes through, a little larger
+    send = { -1, noise, NULL, size, 0, 0 };
+    sendSession.encoder = &encoder;
+    receiveSession.decoder = &decoder;
+    run(corruptEveryFifthFrame);
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, noise, size), 0);
+}
+
+TEST_F(xmodemEngineTests, testCompressionStreaming) {
+    static unsigned char window[4 * (128 + 5)];
+    sendSession.window = 4;
+    sendSession.windowBuffer = window;
+    sendSession.encoder = &encoder;
+    receiveSession.window = 4;
+    receiveSession.decoder = &decoder;
+    run(countFrames);
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_LE(sohFrames, (size + 127) / 128 / 10);
+    // no time spent waiting for responses, only the final flushes
+    ASSERT_LE(now, (unsigned long)receiveSession.flushTimeout + sendSession.flushTimeout);
+}
+
+TEST_F(xmodemEngineTests, testCompressionFallsBackToPlainTransmitter) {
+    receiveSession.decoder = &decoder;
+    run(countFrames);
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_EQ(sohFrames, (size + 127) / 128);
+}
+
+TEST_F(xmodemEngineTests, testCompressionNotAskedFor) {
+    sendSession.encoder = &encoder;
+    run(countFrames);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output, data, size), 0);
+    ASSERT_EQ(sohFrames, (size + 127) / 128);
+}
+
+TEST_F(xmodemEngineTests, testCompressionResume) {
+    // the resumed attempt compresses from the offset on
+    receiveSession.resumeFrom = 1000;
+    sendSession.encoder = &encoder;
+    receiveSession.decoder = &decoder;
+    receive = { -1, NULL, output + 1000, size - 1000, 0, 0 };
+    run(NULL);
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    ASSERT_EQ(memcmp(output + 1000, data + 1000, size - 1000), 0);
+}
+
+struct BatchFile {
+    const char *name;
+    const uint8_t *data;
+    long size;
+};
+
+struct Batch {
+    const BatchFile *files;
+    int count;
+    int current;
+    int offset;
+    bool sendSize;
+    std::string names[4];
+    long sizes[4];
+    long lengths[4];
+    uint8_t output[4][5000];
+    int received;
+    int ended;
+};
+
+static int batch_NextFile(void *user, char const **name, long *size) {
+    Batch *b = (Batch *)user;
+    if(b->current == b->count) {
+        return 0;
+    }
+    *name = b->files[b->current].name;
+    *size = b->sendSize ? b->files[b->current].size : -1;
+    b->offset = 0;
+    b->current++;
+    return 1;
+}
+
+static unsigned char const * batch_GetTxBuffer(void *user, int *size) {
+    Batch *b = (Batch *)user;
+    const BatchFile *f = &b->files[b->current - 1];
+    if(b->offset == f->size) {
+        return NULL;
+    }
+    *size = (int)f->size;
+    b->offset = (int)f->size;
+    return f->data;
+}
+
+static int batch_FileStart(void *user, char const *name, long size) {
+    Batch *b = (Batch *)user;
+    b->names[b->received] = name;
+    b->sizes[b->received] = size;
+    b->offset = 0;
+    b->received++;
+    return 0;
+}
+
+static unsigned char * batch_GetRxBuffer(void *user, int *size) {
+    Batch *b = (Batch *)user;
+    if(b->offset != 0) {
+        return NULL;
+    }
+    long known = b->sizes[b->received - 1];
+    // a file of known length gets a buffer of exactly that length
+    *size = known >= 0 ? (int)known : (int)sizeof(b->output[0]);
+    b->offset = *size;
+    return b->output[b->received - 1];
+}
+
+static void batch_FileEnd(void *user, long length) {
+    Batch *b = (Batch *)user;
+    b->lengths[b->ended++] = length;
+}
+
+class xmodemBatchTests : public ::testing::Test {
+protected:
+    uint8_t image[3000];
+    uint8_t padded[100];
+    BatchFile files[3];
+    Batch send, receive;
+    xmodemSession sendSession, receiveSession;
+    xmodemEngine sender, receiver;
+    unsigned long now = 0;
+
+    void SetUp() override {
+        for(int j = 0; j < (int)sizeof(image); j++) {
+            image[j] = (uint8_t)(j * 11 + 3);
+        }
+        // ends with bytes that look like padding
+        memset(padded, 0x1A, sizeof(padded));
+        padded[0] = 'x';
+        files[0] = { "image.bin", image, sizeof(image) };
+        files[1] = { "padded.bin", padded, sizeof(padded) };
+        files[2] = { "empty", NULL, 0 };
+        send = Batch();
+        send.files = files;
+        send.count = 3;
+        send.sendSize = true;
+        receive = Batch();
+        xmodemSessionInit(&sendSession);
+        sendSession.user = &send;
+        xmodemSessionInit(&receiveSession);
+        receiveSession.user = &receive;
+        sohFrames = 0;
+        stxFrames = 0;
+        framesSeen = 0;
+    }
+
+    void run(LinkFilter filter) {
+        xmodemEngineInitTransmitBatch(&sender, &sendSession, batch_NextFile, batch_GetTxBuffer, now);
+        xmodemEngineInitReceiveBatch(&receiver, &receiveSession, batch_FileStart, batch_GetRxBuffer, batch_FileEnd,
+                                     now);
+        runEngines(&sender, &receiver, &now, filter);
+    }
+};
+
+TEST_F(xmodemBatchTests, testExactLengths) {
+    sendSession.blockSize = 1024;
+    run(countFrames);
+
+    ASSERT_EQ(xmodemEngineResult(&sender), 3);
+    ASSERT_EQ(xmodemEngineResult(&receiver), 3);
+    ASSERT_EQ(receive.ended, 3);
+    for(int i = 0; i < 3; i++) {
+        ASSERT_EQ(receive.names[i], files[i].name);
+        ASSERT_EQ(receive.sizes[i], files[i].size);
+        ASSERT_EQ(receive.lengths[i], files[i].size);
+        ASSERT_EQ(memcmp(receive.output[i], files[i].data, files[i].size), 0);
+    }
+    // a header for each file and one to end the batch
+    ASSERT_EQ(sohFrames, 3 + 1);
+    ASSERT_EQ(stxFrames, 3 + 1);
+}
+
+TEST_F(xmodemBatchTests, testWithoutLengths) {
+    send.sendSize = false;
+    run(corruptEveryFifthFrame);
+
+    ASSERT_EQ(xmodemEngineResult(&sender), 3);
+    ASSERT_EQ(xmodemEngineResult(&receiver), 3);
+    ASSERT_EQ(receive.sizes[0], -1);
+    ASSERT_EQ(receive.lengths[0], (long)sizeof(image));
+    ASSERT_EQ(memcmp(receive.output[0], image, sizeof(image)), 0);
+    // without a length the padding of the last packet is removed, taking the end of the file with it
+    ASSERT_EQ(receive.lengths[1], 1);
+    ASSERT_EQ(receive.lengths[2], 0);
+}
+
+TEST_F(xmodemBatchTests, testCompressedWithoutLengths) {
+    // the compressed stream ends exactly, so files keep data that looks like padding
+    send.sendSize = false;
+    sendSession.encoder = &encoder;
+    receiveSession.decoder = &decoder;
+    run(countFrames);
+
+    ASSERT_EQ(xmodemEngineResult(&sender), 3);
+    ASSERT_EQ(xmodemEngineResult(&receiver), 3);
+    for(int i = 0; i < 3; i++) {
+        ASSERT_EQ(receive.lengths[i], files[i].size);
+        ASSERT_EQ(memcmp(receive.output[i], files[i].data, files[i].size), 0);
+    }
+}
+
+TEST_F(xmodemBatchTests, testFileRefused) {
+    xmodemEngineInitTransmitBatch(&sender, &sendSession, batch_NextFile, batch_GetTxBuffer, now);
+    xmodemEngineInitReceiveBatch(&receiver, &receiveSession,
+                                 [](void *, char const *, long) { return 1; }, batch_GetRxBuffer, NULL, now);
+    runEngines(&sender, &receiver, &now);
+
+    ASSERT_EQ(xmodemEngineResult(&receiver), xmodemErrorFileRefused);
+    ASSERT_EQ(xmodemEngineResult(&sender), xmodemErrorCancelledByRemote);
+}
+
+static int progressCalls = 0;
+
+static void countProgress(void *, xmodemStats const *) {
+    progressCalls++;
+}
+
+TEST_F(xmodemEngineTests, testStats) {
+    progressCalls = 0;
+    sendSession.progress = countProgress;
+    run(corruptEveryFifthFrame);
+
+    ASSERT_EQ(xmodemEngineResult(&sender), size);
+    ASSERT_EQ(xmodemEngineResult(&receiver), size);
+    xmodemStats const *tx = xmodemEngineStats(&sender);
+    xmodemStats const *rx = xmodemEngineStats(&receiver);
+    const int packets = (size + 127) / 128;
+    const int corrupted = sohFrames - packets;
+    ASSERT_GT(corrupted, 0);
+
+    ASSERT_EQ(tx->dataBytes, size);
+    ASSERT_EQ(rx->dataBytes, size);
+    ASSERT_EQ(tx->packets, sohFrames);
+    // the corruption lands in the header, so those packets are rejected before they are received whole
+    ASSERT_EQ(rx->packets, packets);
+    ASSERT_EQ(tx->naks, corrupted);
+    ASSERT_EQ(rx->naks, corrupted);
+    ASSERT_EQ(tx->retransmittedBytes, corrupted * (128 + 5));
+    ASSERT_EQ(rx->duplicates, 0);
+    ASSERT_EQ(tx->crc, 1);
+    ASSERT_EQ(rx->crc, 1);
+    ASSERT_EQ(tx->bytesSent, rx->bytesReceived);
+    ASSERT_EQ(rx->bytesSent, tx->bytesReceived);
+    // the receiver waits for the line to clear before each NAK
+    ASSERT_GE(tx->waitTime, (unsigned long)corrupted * receiveSession.flushTimeout);
+    ASSERT_EQ(tx->elapsed, now);
+    ASSERT_EQ(tx->goodput, (long)(size * 1000L / now));
+    // each acknowledged packet, and the end
+    ASSERT_EQ(progressCalls, packets + 1);
+}
@@ -0,0 +1,252 @@
+//
+// Write-behind receive pipeline tests
+//
+
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "gtest/gtest.h"
+#include "xmodem.h"
+#include "xmodemRing.h"
+#include "xmodemWriteBehind.h"
+
+// storage that takes a while to write each buffer, on a thread of its own as a flash controller would
+struct SlowStorage {
+    xmodemWriteBehind *wb;
+    std::vector<unsigned char> contents;
+    int delayMs;
+    int failAt = -1;
+    bool hang = false;
+    int commits = 0;
+    int waits = 0;
+    long lastOffset = -1;
+    bool ordered = true;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    struct Write {
+        unsigned char *buf;
+        int len;
+        long offset;
+    };
+    std::deque<Write> queue;
+    bool stop = false;
+    std::thread worker;
+
+    SlowStorage(xmodemWriteBehind *wb, int size, int delayMs) : wb(wb), contents(size), delayMs(delayMs) {
+        wb->commit = commit;
+        wb->wait = wait;
+        wb->user = this;
+        worker = std::thread([this] { run(); });
+    }
+
+    ~SlowStorage() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    static void commit(void *user, unsigned char *buf, int len, long offset) {
+        SlowStorage *s = (SlowStorage *)user;
+        s->ordered = s->ordered && offset > s->lastOffset;
+        s->lastOffset = offset;
+        {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            s->queue.push_back({ buf, len, offset });
+        }
+        s->cv.notify_all();
+    }
+
+    static unsigned short wait(void *user, unsigned short timeout) {
+        SlowStorage *s = (SlowStorage *)user;
+        s->waits++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return 1;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for(;;) {
+            cv.wait(lock, [this] { return stop || !queue.empty(); });
+            if(stop) {
+                return;
+            }
+            Write w = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+            bool failed = commits++ == failAt;
+            if(!failed && w.offset + w.len <= (long)contents.size()) {
+                memcpy(contents.data() + w.offset, w.buf, w.len);
+            }
+            if(!hang) {
+                xmodemWriteBehindDone(wb, w.buf, failed);
+            }
+            lock.lock();
+        }
+    }
+};
+
+// the two ends of a transfer over a pair of rings
+struct WriteBehindEnd {
+    xmodemRingLink link;
+    xmodemWriteBehind *wb;
+    const unsigned char *data;
+    int size;
+    int offset;
+};
+
+static unsigned char const *wb_GetTxBuffer(void *user, int *size) {
+    WriteBehindEnd *end = (WriteBehindEnd *)user;
+    if(end->offset == end->size) {
+        return NULL;
+    }
+    *size = end->size - end->offset;
+    end->offset = end->size;
+    return end->data;
+}
+
+static unsigned char *wb_GetRxBuffer(void *user, int *size) {
+    return xmodemWriteBehindGetBuffer(((WriteBehindEnd *)user)->wb, size);
+}
+
+static unsigned short wb_Sleep(void *user, unsigned short timeout) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return 1;
+}
+
+class xmodemWriteBehindTests : public ::testing::Test {
+protected:
+    unsigned char aStorage[2048], bStorage[2048];
+    xmodemRing a, b;
+    std::vector<unsigned char> data;
+    xmodemWriteBehind wb;
+    WriteBehindEnd sender, receiver;
+    xmodemSession sendSession, receiveSession;
+    int sent = 0, received = 0;
+
+    void SetUp() override {
+        xmodemRingInit(&a, aStorage, sizeof(aStorage));
+        xmodemRingInit(&b, bStorage, sizeof(bStorage));
+        sender = { { &b, &a, wb_Sleep, NULL, NULL }, NULL, NULL, 0, 0 };
+        receiver = { { &a, &b, wb_Sleep, NULL, NULL }, &wb, NULL, 0, 0 };
+        xmodemSessionInit(&sendSession);
+        xmodemSessionInit(&receiveSession);
+        sendSession.user = &sender;
+        receiveSession.user = &receiver;
+        sendSession.blockSize = 1024;
+        sendSession.flushTimeout = receiveSession.flushTimeout = 50;
+        sendSession.inByte = receiveSession.inByte = xmodemRingInByte;
+        sendSession.outByte = receiveSession.outByte = xmodemRingOutByte;
+        sendSession.inBlock = receiveSession.inBlock = xmodemRingInBlock;
+        sendSession.outBlock = receiveSession.outBlock = xmodemRingOutBlock;
+    }
+
+    void transfer(int size) {
+        data.resize(size);
+        for(int i = 0; i < size; i++) {
+            data[i] = (unsigned char)((i * 7) | 1);
+        }
+        sender.data = data.data();
+        sender.size = size;
+        std::thread sendThread([this] { sent = xmodemTransmitEx(&sendSession, wb_GetTxBuffer); });
+        received = xmodemReceiveEx(&receiveSession, wb_GetRxBuffer);
+        sendThread.join();
+    }
+};
+
+TEST_F(xmodemWriteBehindTests, testInit) {
+    unsigned char storage[16];
+    ASSERT_EQ(xmodemWriteBehindInit(&wb, storage, 0, 1), -1);
+    ASSERT_EQ(xmodemWriteBehindInit(&wb, storage, 8, 0), -1);
+    ASSERT_EQ(xmodemWriteBehindInit(&wb, storage, 8, XMODEM_WRITE_BEHIND_MAX_BUFFERS + 1), -1);
+    ASSERT_EQ(xmodemWriteBehindInit(&wb, storage, 8, 2), 0);
+}
+
+TEST_F(xmodemWriteBehindTests, testInTurn) {
+    // commits that complete at once, within commit
+    static unsigned char storage[3 * 8];
+    static int commits;
+    static long offsets;
+    ASSERT_EQ(xmodemWriteBehindInit(&wb, storage, 8, 3), 0);
+    commits = 0;
+    offsets = 0;
+    wb.user = &wb;
+    wb.commit = [](void *user, unsigned char *buf, int len, long offset) {
+        commits++;
+        offsets += offset;
+        xmodemWriteBehindDone((xmodemWriteBehind *)user, buf, 0);
+    };
+    int size;
+    ASSERT_EQ(xmodemWriteBehindGetBuffer(&wb, &size), storage);
+    ASSERT_EQ(size, 8);
+    ASSERT_EQ(xmodemWriteBehindGetBuffer(&wb, &size), storage + 8);
+    ASSERT_EQ(xmodemWriteBehindGetBuffer(&wb, &size), storage + 16);
+    ASSERT_EQ(xmodemWriteBehindGetBuffer(&wb, &size), storage);
+    ASSERT_EQ(commits, 3);
+    // only the data of the last buffer is committed, and the next stream starts afresh
+    xmodemWriteBehindEnd(&wb, 29);
+    ASSERT_EQ(commits, 4);
+    ASSERT_EQ(offsets, 0 + 8 + 16 + 24);
+    xmodemWriteBehindEnd(&wb, 0);
+    ASSERT_EQ(commits, 4);
+    ASSERT_EQ(xmodemWriteBehindGetBuffer(&wb, &size), storage + 8);
+    ASSERT_EQ(xmodemWriteBehindSync(&wb), 0);
+}
+
+TEST_F(xmodemWriteBehindTests, testTransfer) {
+    static unsigned char storage[4 * 2048];
+    ASSERT_EQ(xmodemWriteBehindInit(&wb, storage, 2048, 4), 0);
+    SlowStorage flash(&wb, 40000, 5);
+    transfer(40000);
+    xmodemWriteBehindEnd(&wb, received);
+    ASSERT_EQ(xmodemWriteBehindSync(&wb), 0);
+    ASSERT_EQ(sent, 40000);
+    ASSERT_EQ(received, 40000);
+    ASSERT_EQ(flash.commits, 20);
+    ASSERT_TRUE(flash.ordered);
+    ASSERT_EQ(memcmp(flash.contents.data(), data.data(), 40000), 0);
+}
+
+TEST_F(xmodemWriteBehindTests, testBackPressure) {
+    // writes slower than the wire, so the receiver waits for each buffer in turn
+    static unsigned char storage[2 * 1024];
+    ASSERT_EQ(xmodemWriteBehindInit(&wb, storage, 1024, 2), 0);
+    SlowStorage flash(&wb, 10000, 100);
+    transfer(10000);
+    xmodemWriteBehindEnd(&wb, received);
+    ASSERT_EQ(xmodemWriteBehindSync(&wb), 0);
+    ASSERT_EQ(received, 10000);
+    ASSERT_GT(flash.waits, 0);
+    ASSERT_EQ(memcmp(flash.contents.data(), data.data(), 10000), 0);
+}
+
+TEST_F(xmodemWriteBehindTests, testWriteFails) {
+    static unsigned char storage[2 * 1024];
+    ASSERT_EQ(xmodemWriteBehindInit(&wb, storage, 1024, 2), 0);
+    SlowStorage flash(&wb, 10000, 5);
+    flash.failAt = 2;
+    transfer(10000);
+    ASSERT_EQ(received, xmodemErrorBufferFull);
+    ASSERT_LT(sent, 0);
+    ASSERT_EQ(xmodemWriteBehindSync(&wb), -1);
+}
+
+TEST_F(xmodemWriteBehindTests, testWaitLimit) {
+    // storage that never completes a write
+    static unsigned char storage[2 * 1024];
+    ASSERT_EQ(xmodemWriteBehindInit(&wb, storage, 1024, 2), 0);
+    SlowStorage flash(&wb, 10000, 0);
+    flash.hang = true;
+    wb.waitLimit = 50;
+    transfer(10000);
+    ASSERT_EQ(received, xmodemErrorBufferFull);
+    ASSERT_EQ(xmodemWriteBehindSync(&wb), -1);
+}